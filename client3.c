@@ -13,6 +13,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <pthread.h>
+#include <limits.h>
 
 struct DNS_HEADER{
     unsigned short id;          // identification number
@@ -35,63 +36,164 @@ struct DNS_HEADER{
     unsigned short ar_count :16;   // number of resource records
 };
 
+struct ns_address;
+
 struct lookup_record {
     char *domain_name;
-    char *dns_name;
-    char *alt_domain_name;
+    char **ns_names;    // the domain's nameservers
+    int ns_count;
+    struct ns_address *addresses;  // every address of every nameserver
+    int address_count;
+};
+
+struct source_results;
+
+/** One address of one of a domain's nameservers, and what probing it got.
+ *  Every address of every nameserver is probed at the same time. */
+struct ns_address {
+    struct lookup_record *record;
+    int index;          // in record->addresses
+    char *ns_name;
+    char addr_text[INET6_ADDRSTRLEN];
+    struct ares_addr_port_node server;
+    int qty_received;
+    int qty_truncated;
+    int qty_failed;
+    int qty_followup_received;  // truncated answers asked again over TCP
+    int qty_followup_failed;
+    double rtt_total;   // seconds, over the received responses
+    double rtt_max;
+    struct source_results *by_source;  // one per source
+};
+
+/** Where probes are sent from. Each source has its own channels, whose
+ *  sockets are bound to its address, so a target's rate limiter sees every
+ *  source as a separate client. */
+struct source {
+    char *name;                // the address as given, or "default"
+    unsigned int local_ip4;    // host order; 0 for the default source
+    ares_channel channel;
+    ares_channel *tcp_channels;  // one per nameserver address, if -t or -T
+    int tcp_channel_count;
+};
+
+/** A nameserver address's results for the probes sent from one source */
+struct source_results {
+    struct ns_address *address;
+    int source;
+    int qty_sent;
     int qty_received;
     int qty_truncated;
     int qty_failed;
+    double rtt_total;
 };
 
 struct lookup_record **queries;
 int server_count = 0;
 struct ares_options options;
 int packet_id=0;
+int outstanding = 0;   // queries sent but not yet called back
+/** Probes and follow-ups over TCP go through a source's TCP channel for the
+ *  nameserver address, since ares_send_to only sends over UDP. */
+int tcp_probe = 0;     // -t: probe over TCP instead of UDP
+int tcp_followup = 0;  // -T: ask truncated UDP answers again over TCP
+struct ares_options tcp_options;
+struct source *sources;
+int nsources = 0;
+int per_target = 0;    // -r: each target gets one source, rather than each query
+
+/** The kernel charges each queued datagram its whole buffer (around 2KB),
+ *  not just the DNS payload, against a socket's buffer size. */
+#define DATAGRAM_COST 2048
+/** Linux's usual default socket buffer; never ask for less than that */
+#define MIN_SOCKET_BUFFER (208 * 1024)
 
 void setup_c_ares();
 void read_file(char *file_name, struct lookup_record **queries);
 void get_dns(ares_channel channel, struct lookup_record *record);
-void send_packet(ares_channel channel, struct lookup_record *record);
+void send_packet(struct source_results *results);
+void send_followup(struct source_results *results);
 FILE *log_filep;
 /**
- * Function: query_callback
- * Callback after query is sent
+ * Function: account_probes
+ * Counts the outcomes of a batch of probes taken off a channel
+ *
+ * completions: the probes' completion records, each with the target's
+ *              results for the source the probe was sent from as its arg
+ * count: how many there are
+ */
+void account_probes(const struct ares_completion *completions, int count){
+    int i;
+    outstanding -= count;
+    for (i = 0; i < count; i++) {
+        struct source_results *results = (struct source_results*) completions[i].arg;
+        struct ns_address *address = results->address;
+        if (completions[i].status == ARES_SUCCESS){
+            // the kernel timestamps the response as it arrives, so the time it
+            // spent waiting for us to read it doesn't count
+            double rtt = completions[i].rtt / 1e6;
+            address->rtt_total += rtt;
+            results->rtt_total += rtt;
+            if (rtt > address->rtt_max)
+                address->rtt_max = rtt;
+            address->qty_received++;
+            results->qty_received++;
+            if (completions[i].flags & ARES_COMPLETION_TC){
+                address->qty_truncated++;
+                results->qty_truncated++;
+                if (tcp_followup)
+                    send_followup(results);
+            }
+        }
+        else {
+            address->qty_failed++;
+            results->qty_failed++;
+        }
+    }
+}
+
+/**
+ * Function: followup_callback
+ * Callback after a truncated answer's query was asked again over TCP
  *
- * arg: itself
+ * arg: the nameserver address asked
  * status: ares defined response status
  * timeouts: how many times query timed out
  * abuf: Result buffer, dns header. Failed query, abuf is null
  * alen: Length of abuf
+ * times: when the query was sent and the response received
  */
-void query_callback(void* arg, int status, int timeouts, unsigned char *abuf, int alen){
-    
-    struct lookup_record *record = (struct lookup_record*) arg;
-    //printf("Status: %d\n", status);
-	if (status == ARES_SUCCESS){
-        struct DNS_HEADER *dns_hdr = (struct DNS_HEADER*) abuf;
-        record->qty_received++;
-        if (dns_hdr->tc == 1){
-            record->qty_truncated++;
-        }
-	}
-	else {
-        record->qty_failed++;
-    }
+void followup_callback(void* arg, int status, int timeouts, unsigned char *abuf, int alen,
+                       const struct ares_query_times *times){
+    struct ns_address *address = (struct ns_address*) arg;
+    outstanding--;
+    if (status == ARES_SUCCESS)
+        address->qty_followup_received++;
+    else
+        address->qty_followup_failed++;
 }
 
+/** An NS lookup for the domain or one of its ancestors, and the nameservers
+ *  it found */
+struct zone_cut {
+    const char *name;
+    char **ns_names;
+    int ns_count;
+};
+
 /**
  * Function: dnslookup_callback
  * Callback after dns lookup query is sent
  *
- * arg: itself
+ * arg: the zone_cut asked about
  * status: ares defined response status
  * timeouts: how many times query timed out
  * abuf: Result buffer, dns header. Failed query, abuf is null
  * alen: Length of abuf
  */
 void dnslookup_callback(void* arg, int status, int timeouts, unsigned char *abuf, int alen){
-    struct lookup_record *record = (struct lookup_record*) arg;
+    struct zone_cut *cut = (struct zone_cut*) arg;
+    outstanding--;
 
     if (status == ARES_SUCCESS) {
         struct hostent  *host;// = malloc(sizeof(struct hostent));
@@ -102,21 +204,143 @@ void dnslookup_callback(void* arg, int status, int timeouts, unsigned char *abuf
         //    fflush(log_filep);
         }
         else {
-            record->dns_name = (char*) malloc(strlen(host->h_aliases[0])+1);
-            strcpy(record->dns_name, host->h_aliases[0]);
+            // keep every nameserver, not just the first
+            int i;
+            for (i = 0; host->h_aliases[i]; i++) {
+                cut->ns_names = realloc(cut->ns_names, (cut->ns_count + 1) * sizeof(char*));
+                cut->ns_names[cut->ns_count++] = strdup(host->h_aliases[i]);
+            }
             ares_free_hostent(host);
         }
     }
 }
 
+/**
+ * Function: add_address
+ * Adds an address to the ones to probe, unless it's already there:
+ * nameservers often share addresses, and each is probed once
+ */
+static void add_address(struct lookup_record *record, char *ns_name, int family,
+                        const void *addr, int port) {
+    int len = family == AF_INET ? 4 : 16;
+    int j;
+    for (j = 0; j < record->address_count; j++) {
+        struct ares_addr_port_node *server = &record->addresses[j].server;
+        if (server->family == family && memcmp(&server->addr, addr, len) == 0 &&
+            server->udp_port == port)
+            return;
+    }
+
+    record->addresses = realloc(record->addresses,
+                                (record->address_count + 1) * sizeof(struct ns_address));
+    struct ns_address *address = &record->addresses[record->address_count++];
+    memset(address, 0, sizeof(*address));
+    address->ns_name = ns_name;
+    address->server.family = family;
+    memcpy(&address->server.addr, addr, len);
+    address->server.udp_port = port;
+    address->server.tcp_port = port;
+    inet_ntop(family, addr, address->addr_text, sizeof(address->addr_text));
+}
+
+/** What address_callback needs to know about a nameserver being looked up */
+struct ns_lookup {
+    struct lookup_record *record;
+    char *ns_name;
+};
+
+/**
+ * Function: address_callback
+ * Callback after a nameserver's IPv4 or IPv6 addresses were looked up
+ *
+ * arg: the ns_lookup
+ * status: ares defined response status
+ * timeouts: how many times query timed out
+ * host: the addresses found. Failed lookup, host is null
+ */
+void address_callback(void* arg, int status, int timeouts, struct hostent *host){
+    struct ns_lookup *lookup = (struct ns_lookup*) arg;
+    struct lookup_record *record = lookup->record;
+    outstanding--;
+
+    if (status != ARES_SUCCESS)
+        return;
+    int i;
+    for (i = 0; host->h_addr_list[i]; i++)
+        add_address(record, lookup->ns_name, host->h_addrtype, host->h_addr_list[i], 0);
+}
+
+/**
+ * Function: channels_fds
+ * Adds the sockets of every source's channels to the sets
+ */
+static int channels_fds(fd_set *read_fds, fd_set *write_fds) {
+    int nfds = 0;
+    int i, j, n;
+    for (i = 0; i < nsources; i++) {
+        n = ares_fds(sources[i].channel, read_fds, write_fds);
+        if (n > nfds)
+            nfds = n;
+        for (j = 0; j < sources[i].tcp_channel_count; j++) {
+            n = ares_fds(sources[i].tcp_channels[j], read_fds, write_fds);
+            if (n > nfds)
+                nfds = n;
+        }
+    }
+    return nfds;
+}
+
+static struct timeval *channels_timeout(struct timeval *max_t, struct timeval *tv) {
+    struct timeval *tvp = max_t;
+    int i, j;
+    for (i = 0; i < nsources; i++) {
+        tvp = ares_timeout(sources[i].channel, tvp, tv);
+        for (j = 0; j < sources[i].tcp_channel_count; j++)
+            tvp = ares_timeout(sources[i].tcp_channels[j], tvp, tv);
+    }
+    return tvp;
+}
+
+/** Processes a channel, then counts the probes it completed in bulk */
+static void channel_process(ares_channel channel, fd_set *read_fds, fd_set *write_fds) {
+    struct ares_completion completions[256];
+    int n;
+    ares_process(channel, read_fds, write_fds);
+    while ((n = ares_get_completions(channel, completions, 256)) > 0)
+        account_probes(completions, n);
+}
+
+static void channels_process(fd_set *read_fds, fd_set *write_fds) {
+    int i, j;
+    for (i = 0; i < nsources; i++) {
+        channel_process(sources[i].channel, read_fds, write_fds);
+        for (j = 0; j < sources[i].tcp_channel_count; j++)
+            channel_process(sources[i].tcp_channels[j], read_fds, write_fds);
+    }
+}
+
+/** Adds up the counters of every source's channel */
+static void channels_stats(struct ares_stats *stats) {
+    struct ares_stats source_stats;
+    int i;
+    stats->udp_deferred_sends = 0;
+    stats->udp_rx_drops = 0;
+    stats->completions_dropped = 0;
+    for (i = 0; i < nsources; i++) {
+        ares_get_stats(sources[i].channel, &source_stats);
+        stats->udp_deferred_sends += source_stats.udp_deferred_sends;
+        stats->udp_rx_drops += source_stats.udp_rx_drops;
+        stats->completions_dropped += source_stats.completions_dropped;
+    }
+}
+
 /**
  * Function: wait_ares
- * Waits for all pending queries on channel to be processed according to timeout val
+ * Waits for all pending queries on every channel to be processed according to timeout val
  *
  * timeout: File descriptor read timeout (in ms)
- * channel: ares_channel to process
  */
-static void wait_ares(int timeout, ares_channel channel) {
+static void wait_ares(int timeout) {
     while(1){
         // declare timevals for timeouts and fd
         struct timeval *tvp, tv, max_t;
@@ -129,23 +353,50 @@ static void wait_ares(int timeout, ares_channel channel) {
         FD_ZERO(&write_fds);
     
         // Gets file descriptors to process
-        int nfds = ares_fds(channel, &read_fds, &write_fds);
-        if(nfds == 0){
+        // the channels stay open between targets, so their sockets
+        // outlive the queries; stop once nothing is outstanding
+        int nfds = channels_fds(&read_fds, &write_fds);
+        if(nfds == 0 || outstanding == 0){
             break;
         }
 
         // maximum time we should wait
-        tvp = ares_timeout(channel, &max_t, &tv);
+        tvp = channels_timeout(&max_t, &tv);
 
         // updates the file descriptors with timeout
         select(nfds, &read_fds, &write_fds, NULL, tvp);
 
         // handles pending queries on channel
-        ares_process(channel, &read_fds, &write_fds);
+        channels_process(&read_fds, &write_fds);
+    }
+}
+
+/**
+ * Function: drain_tcp_channels
+ * Waits for the queries still on the sources' TCP channels to finish, so
+ * they can be pointed at the next domain's nameservers and none of their
+ * callbacks outlive this domain's record
+ */
+static void drain_tcp_channels(void) {
+    struct timeval *tvp, tv;
+    fd_set read_fds, write_fds;
+    int i, j, nfds;
+    for (i = 0; i < nsources; i++) {
+        for (j = 0; j < sources[i].tcp_channel_count; j++) {
+            ares_channel channel = sources[i].tcp_channels[j];
+            // every query waiting on a channel has a timeout
+            while ((tvp = ares_timeout(channel, NULL, &tv)) != NULL) {
+                FD_ZERO(&read_fds);
+                FD_ZERO(&write_fds);
+                nfds = ares_fds(channel, &read_fds, &write_fds);
+                select(nfds, &read_fds, &write_fds, NULL, tvp);
+                channel_process(channel, &read_fds, &write_fds);
+            }
+        }
     }
 }
 
-static void short_wait_ares(int timeout, ares_channel channel) {
+static void short_wait_ares(int timeout) {
     while(1){
         // declare timevals for timeouts and fd
         struct timeval *tvp, tv, max_t;
@@ -158,39 +409,739 @@ static void short_wait_ares(int timeout, ares_channel channel) {
         FD_ZERO(&write_fds);
 
         // Gets file descriptors to process
-        int nfds = ares_fds(channel, &read_fds, &write_fds);
-        if(nfds == 0){
+        // the channels stay open between targets, so their sockets
+        // outlive the queries; stop once nothing is outstanding
+        int nfds = channels_fds(&read_fds, &write_fds);
+        if(nfds == 0 || outstanding == 0){
             break;
         }
 
         // maximum time we should wait
-        tvp = ares_timeout(channel, &max_t, &tv);
+        tvp = channels_timeout(&max_t, &tv);
 
         // updates the file descriptors with timeout
         select(nfds, &read_fds, &write_fds, NULL, tvp);
         struct timeval tmp;
         tmp.tv_sec=0;
         tmp.tv_usec=0;
-        int n = select(nfds, &read_fds, NULL, NULL, &tmp);
+        // queued TCP queries go out once their connection is writable
+        int n = select(nfds, &read_fds, &write_fds, NULL, &tmp);
         if(n==0){
          break;
         }
 
         // handles pending queries on channel
-        ares_process(channel, &read_fds, &write_fds);
+        channels_process(&read_fds, &write_fds);
      }
 }
 
+/**
+ * Function: burst_buffer_size
+ * Socket buffer size big enough to hold a whole burst of datagrams
+ *
+ * burst: number of packets sent to a target before waiting for answers
+ */
+static int burst_buffer_size(int burst) {
+    long size = (long)burst * DATAGRAM_COST;
+    if (size < MIN_SOCKET_BUFFER)
+        size = MIN_SOCKET_BUFFER;
+    if (size > INT_MAX)
+        size = INT_MAX;
+    return (int) size;
+}
+
+/**
+ * Function: add_sources
+ * Adds a source for each address in a comma separated list
+ *
+ * list: local IPv4 addresses to send probes from
+ */
+static void add_sources(char *list) {
+    char *name;
+    struct in_addr addr;
+    for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        if (inet_pton(AF_INET, name, &addr) != 1) {
+            printf("[error] not an IPv4 address: %s\n", name);
+            exit(1);
+        }
+        sources = realloc(sources, (nsources + 1) * sizeof(struct source));
+        memset(&sources[nsources], 0, sizeof(struct source));
+        sources[nsources].name = name;
+        sources[nsources].local_ip4 = ntohl(addr.s_addr);
+        nsources++;
+    }
+}
+
+/**
+ * Function: init_channel
+ * Sets up a channel whose sockets are bound to the source's address
+ */
+static int init_channel(ares_channel *channel, struct source *source,
+                        struct ares_options *opts, int optmask) {
+    int status = ares_init_options(channel, opts, optmask);
+    if (status == ARES_SUCCESS && source->local_ip4)
+        ares_set_local_ip4(*channel, source->local_ip4);
+    return status;
+}
+
+/**
+ * Function: bind_tcp_channels
+ * Points each source's TCP channels at the domain's nameserver addresses,
+ * one channel per address, adding channels as needed
+ */
+static int bind_tcp_channels(struct lookup_record *record) {
+    int i, j, status;
+    for (i = 0; i < nsources; i++) {
+        struct source *source = &sources[i];
+        for (j = 0; j < record->address_count; j++) {
+            if (j == source->tcp_channel_count) {
+                source->tcp_channels = realloc(source->tcp_channels,
+                                               (j + 1) * sizeof(ares_channel));
+                status = init_channel(&source->tcp_channels[j], source, &tcp_options,
+                                      ARES_OPT_FLAGS | ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES |
+                                      ARES_OPT_TCP_CONNS);
+                if (status != ARES_SUCCESS)
+                    return status;
+                source->tcp_channel_count++;
+            }
+            status = ares_rebind_servers(source->tcp_channels[j],
+                                         &record->addresses[j].server, 0);
+            // only an idle channel can be rebound, so let any query still
+            // on it finish rather than skip the domain
+            if (status == ARES_ENOTIMP) {
+                drain_tcp_channels();
+                status = ares_rebind_servers(source->tcp_channels[j],
+                                             &record->addresses[j].server, 0);
+            }
+            if (status != ARES_SUCCESS)
+                return status;
+        }
+    }
+    return ARES_SUCCESS;
+}
+
+/**
+ * Function: ready_addresses
+ * Gets each of the domain's nameserver addresses ready to probe
+ */
+static void ready_addresses(struct lookup_record *record) {
+    int i, j;
+    // the array has stopped moving, so it's safe to point into it now
+    for (i = 0; i < record->address_count; i++) {
+        struct ns_address *address = &record->addresses[i];
+        address->record = record;
+        address->index = i;
+        address->by_source = calloc(nsources, sizeof(struct source_results));
+        for (j = 0; j < nsources; j++) {
+            address->by_source[j].address = address;
+            address->by_source[j].source = j;
+        }
+    }
+}
+
+/**
+ * Function: find_addresses
+ * Looks up the IPv4 and IPv6 addresses of all the domain's nameservers at
+ * once, and gets each address ready to probe
+ */
+static void find_addresses(ares_channel channel, struct lookup_record *record) {
+    struct ns_lookup *lookups = malloc(record->ns_count * sizeof(struct ns_lookup));
+    int i;
+    for (i = 0; i < record->ns_count; i++) {
+        lookups[i].record = record;
+        lookups[i].ns_name = record->ns_names[i];
+        outstanding += 2;
+        ares_gethostbyname(channel, record->ns_names[i], AF_INET, address_callback, &lookups[i]);
+        ares_gethostbyname(channel, record->ns_names[i], AF_INET6, address_callback, &lookups[i]);
+    }
+    wait_ares(options.timeout);
+    free(lookups);
+    ready_addresses(record);
+}
+
+/** Iterative mode (-i) finds nameservers without the system's resolver: it
+ *  walks down from the given root servers, following referrals. Every
+ *  delegation it learns is cached by zone, so targets under the same TLD or
+ *  zone share the walk. */
+#define DELEGATION_BUCKETS 65536
+/** Most referrals followed for one name, which stops loops */
+#define MAX_REFERRALS 16
+/** How deep lookups of nameservers that came without glue may nest */
+#define MAX_GLUELESS_DEPTH 4
+/** Servers of a zone tried, one after another, before giving up on it */
+#define MAX_ZONE_TRIES 3
+
+/** A zone's nameservers, and their addresses once known */
+struct delegation {
+    char *zone;         // lower case, no trailing dot; "" for the root
+    char **ns_names;
+    int ns_count;
+    struct zone_server *servers;
+    int server_count;
+    int resolved;       // addresses of nameservers without glue were looked for
+    struct delegation *next;  // in the same bucket
+};
+
+struct zone_server {
+    int ns;             // in the delegation's ns_names
+    struct ares_addr_port_node addr;
+};
+
+struct delegation *delegations[DELEGATION_BUCKETS];
+int iterative = 0;      // -i: walk from the root servers instead of asking the resolver
+
+static unsigned int zone_hash(const char *zone) {
+    unsigned int h = 2166136261U; /* FNV-1a */
+    for (; *zone; zone++)
+        h = (h ^ (unsigned char)*zone) * 16777619U;
+    return h & (DELEGATION_BUCKETS - 1);
+}
+
+static struct delegation *find_delegation(const char *zone) {
+    struct delegation *d;
+    for (d = delegations[zone_hash(zone)]; d; d = d->next) {
+        if (strcmp(d->zone, zone) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+static struct delegation *add_delegation(const char *zone) {
+    struct delegation *d = calloc(1, sizeof(struct delegation));
+    unsigned int h = zone_hash(zone);
+    d->zone = strdup(zone);
+    d->next = delegations[h];
+    delegations[h] = d;
+    return d;
+}
+
+static int add_zone_ns(struct delegation *d, const char *ns_name) {
+    int i;
+    for (i = 0; i < d->ns_count; i++) {
+        if (strcmp(d->ns_names[i], ns_name) == 0)
+            return i;
+    }
+    d->ns_names = realloc(d->ns_names, (d->ns_count + 1) * sizeof(char*));
+    d->ns_names[d->ns_count] = strdup(ns_name);
+    return d->ns_count++;
+}
+
+/** port is 0 for the standard one */
+static void add_zone_server(struct delegation *d, int ns, int family, const void *addr,
+                            int port) {
+    int i;
+    int len = family == AF_INET ? 4 : 16;
+    for (i = 0; i < d->server_count; i++) {
+        if (d->servers[i].addr.family == family &&
+            memcmp(&d->servers[i].addr.addr, addr, len) == 0 &&
+            d->servers[i].addr.udp_port == port)
+            return;
+    }
+    d->servers = realloc(d->servers, (d->server_count + 1) * sizeof(struct zone_server));
+    memset(&d->servers[d->server_count], 0, sizeof(struct zone_server));
+    d->servers[d->server_count].ns = ns;
+    d->servers[d->server_count].addr.family = family;
+    memcpy(&d->servers[d->server_count].addr.addr, addr, len);
+    d->servers[d->server_count].addr.udp_port = port;
+    d->servers[d->server_count].addr.tcp_port = port;
+    d->server_count++;
+}
+
+static void free_delegations() {
+    struct delegation *d, *next;
+    int i, j;
+    for (i = 0; i < DELEGATION_BUCKETS; i++) {
+        for (d = delegations[i]; d; d = next) {
+            next = d->next;
+            for (j = 0; j < d->ns_count; j++)
+                free(d->ns_names[j]);
+            free(d->ns_names);
+            free(d->servers);
+            free(d->zone);
+            free(d);
+        }
+        delegations[i] = NULL;
+    }
+}
+
+/**
+ * Function: add_root_servers
+ * Seeds the cache with the root zone's servers. Servers found below a root
+ * server are asked on the same port as it, so a walk can be tried out on
+ * stand-ins listening on an unprivileged port of loopback addresses.
+ *
+ * list: comma separated addresses, each IPv4 with an optional :port, or
+ *       IPv6, in brackets if followed by :port
+ */
+static void add_root_servers(char *list) {
+    struct delegation *root = find_delegation("");
+    unsigned char addr[16];
+    char *name, *host, *port, *end;
+    int family, port_number;
+    if (!root)
+        root = add_delegation("");
+    for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        char text[INET6_ADDRSTRLEN + 8];
+        snprintf(text, sizeof(text), "%s", name);
+        host = text;
+        port = NULL;
+        if (host[0] == '[' && (end = strchr(host, ']')) != NULL) {
+            host++;
+            *end = '\0';
+            if (end[1] == ':')
+                port = end + 2;
+            else if (end[1] != '\0')
+                host = NULL;
+        } else if ((end = strchr(host, ':')) != NULL && !strchr(end + 1, ':')) {
+            *end = '\0';
+            port = end + 1;
+        }
+        family = host && strchr(host, ':') ? AF_INET6 : AF_INET;
+        port_number = 0;
+        if (port) {
+            long value = strtol(port, &end, 10);
+            if (*port == '\0' || *end != '\0' || value < 1 || value > 65535)
+                host = NULL;
+            port_number = (int) value;
+        }
+        if (!host || inet_pton(family, host, addr) != 1) {
+            printf("[error] not an IP address, or address:port: %s\n", name);
+            exit(1);
+        }
+        add_zone_server(root, add_zone_ns(root, name), family, addr, port_number);
+    }
+}
+
+/** Whether name is zone or lies below it */
+static int in_zone(const char *name, const char *zone) {
+    size_t name_len = strlen(name);
+    size_t zone_len = strlen(zone);
+    if (zone_len == 0)
+        return 1;
+    if (name_len == zone_len)
+        return strcmp(name, zone) == 0;
+    return name_len > zone_len && name[name_len - zone_len - 1] == '.' &&
+           strcmp(name + name_len - zone_len, zone) == 0;
+}
+
+/** Lower case, without the trailing dot */
+static char *canonical_name(const char *name) {
+    char *copy = strdup(name);
+    size_t len = strlen(copy);
+    size_t i;
+    if (len > 0 && copy[len - 1] == '.')
+        copy[len - 1] = '\0';
+    for (i = 0; copy[i]; i++)
+        copy[i] = tolower((unsigned char)copy[i]);
+    return copy;
+}
+
+/** The delegation of the deepest zone in the cache that holds name */
+static struct delegation *closest_delegation(const char *name) {
+    struct delegation *d;
+    while (1) {
+        if ((d = find_delegation(name)) != NULL && d->ns_count > 0)
+            return d;
+        if (*name == '\0')
+            return NULL;
+        name = strchr(name, '.');
+        name = name ? name + 1 : "";
+    }
+}
+
+/** One resource record of a response */
+struct dns_rr {
+    char *name;         // canonical
+    int type;
+    const unsigned char *rdata;
+    int rdlen;
+};
+
+/**
+ * Function: read_rr
+ * Reads the resource record at *p and moves *p past it
+ *
+ * returns 0, or -1 if the response is malformed
+ */
+static int read_rr(const unsigned char *abuf, int alen, const unsigned char **p,
+                   struct dns_rr *rr) {
+    char *name;
+    long len;
+    if (ares_expand_name(*p, abuf, alen, &name, &len) != ARES_SUCCESS)
+        return -1;
+    *p += len;
+    if (*p + 10 > abuf + alen) {
+        ares_free_string(name);
+        return -1;
+    }
+    rr->name = canonical_name(name);
+    ares_free_string(name);
+    rr->type = ((*p)[0] << 8) | (*p)[1];
+    rr->rdlen = ((*p)[8] << 8) | (*p)[9];
+    rr->rdata = *p + 10;
+    *p += 10 + rr->rdlen;
+    if (*p > abuf + alen) {
+        free(rr->name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Function: read_rrs
+ * Reads every resource record of a response, in order: answers, then
+ * authority records, then additional records
+ *
+ * returns the number of records read, or -1 if the response is malformed;
+ * section_counts gets how many came from each section
+ */
+static int read_rrs(const unsigned char *abuf, int alen, struct dns_rr **rrs,
+                    int section_counts[3]) {
+    const unsigned char *p = abuf + 12;
+    char *name;
+    long len;
+    int qdcount, total, i, n;
+    if (alen < 12)
+        return -1;
+    qdcount = (abuf[4] << 8) | abuf[5];
+    section_counts[0] = (abuf[6] << 8) | abuf[7];
+    section_counts[1] = (abuf[8] << 8) | abuf[9];
+    section_counts[2] = (abuf[10] << 8) | abuf[11];
+    for (i = 0; i < qdcount; i++) {
+        if (ares_expand_name(p, abuf, alen, &name, &len) != ARES_SUCCESS)
+            return -1;
+        ares_free_string(name);
+        p += len + 4;
+    }
+    total = section_counts[0] + section_counts[1] + section_counts[2];
+    *rrs = malloc((total + 1) * sizeof(struct dns_rr));
+    for (n = 0; n < total; n++) {
+        if (p >= abuf + alen || read_rr(abuf, alen, &p, &(*rrs)[n]) != 0)
+            break;
+    }
+    // a truncated response still has its first records
+    for (i = 0; i < 3; i++) {
+        int in_section = n - (i ? section_counts[0] : 0) - (i == 2 ? section_counts[1] : 0);
+        if (in_section < 0)
+            in_section = 0;
+        if (section_counts[i] > in_section)
+            section_counts[i] = in_section;
+    }
+    return n;
+}
+
+static void free_rrs(struct dns_rr *rrs, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        free(rrs[i].name);
+    free(rrs);
+}
+
+/** A response to one of the iterative queries */
+struct iterative_answer {
+    unsigned char *abuf;
+    int alen;
+    int port;           // of the server that answered; 0 for the standard one
+};
+
+void iterative_callback(void* arg, int status, int timeouts, unsigned char *abuf, int alen){
+    struct iterative_answer *answer = (struct iterative_answer*) arg;
+    outstanding--;
+    if (status == ARES_SUCCESS) {
+        answer->abuf = malloc(alen);
+        memcpy(answer->abuf, abuf, alen);
+        answer->alen = alen;
+    }
+}
+
+/**
+ * Function: ask_zone
+ * Asks the zone's servers, without recursion, for name's records of the
+ * given type; tries a few servers in turn until one answers
+ *
+ * returns 0 with the response in answer, or -1 if no server answered
+ */
+static int ask_zone(ares_channel channel, struct delegation *d, const char *name,
+                    int type, struct iterative_answer *answer) {
+    unsigned char *qbuf;
+    int buflen, i;
+    answer->abuf = NULL;
+    for (i = 0; i < d->server_count && i < MAX_ZONE_TRIES && !answer->abuf; i++) {
+        if (ares_create_query(name, ns_c_in, type, ++packet_id, 0, &qbuf, &buflen, 0) != ARES_SUCCESS)
+            return -1;
+        outstanding++;
+        // each server is waited for, so an answer is from the last one asked
+        answer->port = d->servers[i].addr.udp_port;
+        ares_send_to(channel, &d->servers[i].addr, qbuf, buflen, iterative_callback, answer);
+        ares_free_string(qbuf);
+        wait_ares(options.timeout);
+    }
+    return answer->abuf ? 0 : -1;
+}
+
+static struct delegation *iterate_zone(ares_channel channel, const char *name, int depth);
+
+/**
+ * Function: resolve_ns
+ * Finds the IPv4 and IPv6 addresses of one of the zone's nameservers, by
+ * walking to the nameserver's own zone and asking it
+ */
+static void resolve_ns(ares_channel channel, struct delegation *d, int ns, int depth) {
+    static const int types[2] = { ns_t_a, ns_t_aaaa };
+    int j, k, n, counts[3];
+    struct delegation *ns_zone = iterate_zone(channel, d->ns_names[ns], depth + 1);
+    if (!ns_zone)
+        return;
+    for (k = 0; k < 2; k++) {
+        struct iterative_answer answer;
+        struct dns_rr *rrs;
+        if (ask_zone(channel, ns_zone, d->ns_names[ns], types[k], &answer) != 0)
+            continue;
+        n = read_rrs(answer.abuf, answer.alen, &rrs, counts);
+        for (j = 0; j < n && j < counts[0]; j++) {
+            if (strcmp(rrs[j].name, d->ns_names[ns]) != 0)
+                continue;
+            if (rrs[j].type == ns_t_a && rrs[j].rdlen == 4)
+                add_zone_server(d, ns, AF_INET, rrs[j].rdata, answer.port);
+            else if (rrs[j].type == ns_t_aaaa && rrs[j].rdlen == 16)
+                add_zone_server(d, ns, AF_INET6, rrs[j].rdata, answer.port);
+        }
+        if (n >= 0)
+            free_rrs(rrs, n);
+        free(answer.abuf);
+    }
+}
+
+/**
+ * Function: resolve_zone_servers
+ * Finds addresses for the zone's nameservers that came without glue
+ */
+static void resolve_zone_servers(ares_channel channel, struct delegation *d, int depth) {
+    int i, j;
+    int have_addr;
+    d->resolved = 1;
+    if (depth >= MAX_GLUELESS_DEPTH)
+        return;
+    for (i = 0; i < d->ns_count; i++) {
+        have_addr = 0;
+        for (j = 0; j < d->server_count; j++) {
+            if (d->servers[j].ns == i)
+                have_addr = 1;
+        }
+        // a name inside the zone it serves needed glue to be found
+        if (!have_addr && !in_zone(d->ns_names[i], d->zone))
+            resolve_ns(channel, d, i, depth);
+    }
+}
+
+/**
+ * Function: follow_referral
+ * Caches the delegation in a response from zone's servers, if it has one
+ * for a zone below zone that holds name
+ *
+ * returns that delegation, or NULL if the response isn't a referral
+ */
+static struct delegation *follow_referral(struct delegation *zone, const char *name,
+                                          struct iterative_answer *answer) {
+    struct dns_rr *rrs;
+    struct delegation *child = NULL;
+    char *cut = NULL;
+    char *ns_name;
+    long len;
+    int counts[3];
+    int i, j;
+    int n = read_rrs(answer->abuf, answer->alen, &rrs, counts);
+    if (n < 0)
+        return NULL;
+
+    // the NS records of a child zone, in the answers if the server happens
+    // to serve it too, otherwise in the authority records
+    for (i = 0; i < counts[0] + counts[1]; i++) {
+        if (rrs[i].type != ns_t_ns || !in_zone(name, rrs[i].name) ||
+            !in_zone(rrs[i].name, zone->zone) || strcmp(rrs[i].name, zone->zone) == 0)
+            continue;
+        if (!cut) {
+            cut = rrs[i].name;
+            child = find_delegation(cut);
+            if (child && child->ns_count > 0)
+                break;  // already known
+            if (!child)
+                child = add_delegation(cut);
+        }
+        if (strcmp(rrs[i].name, cut) != 0)
+            continue;
+        if (ares_expand_name(rrs[i].rdata, answer->abuf, answer->alen, &ns_name, &len) != ARES_SUCCESS)
+            continue;
+        char *canonical = canonical_name(ns_name);
+        add_zone_ns(child, canonical);
+        free(canonical);
+        ares_free_string(ns_name);
+    }
+
+    // glue, which is only needed, and only to be trusted, for nameservers
+    // inside the child zone; the others are looked up in their own zones
+    if (child && !child->resolved) {
+        for (i = counts[0] + counts[1]; i < n; i++) {
+            for (j = 0; j < child->ns_count; j++) {
+                if (strcmp(rrs[i].name, child->ns_names[j]) == 0)
+                    break;
+            }
+            if (j == child->ns_count || !in_zone(child->ns_names[j], child->zone))
+                continue;
+            if (rrs[i].type == ns_t_a && rrs[i].rdlen == 4)
+                add_zone_server(child, j, AF_INET, rrs[i].rdata, answer->port);
+            else if (rrs[i].type == ns_t_aaaa && rrs[i].rdlen == 16)
+                add_zone_server(child, j, AF_INET6, rrs[i].rdata, answer->port);
+        }
+    }
+    free_rrs(rrs, n);
+    return child && child->ns_count > 0 ? child : NULL;
+}
+
+/**
+ * Function: iterate_zone
+ * Finds the deepest zone holding name, starting from the deepest one in
+ * the cache and following referrals down from there
+ *
+ * returns its delegation, or NULL if the walk failed
+ */
+static struct delegation *iterate_zone(ares_channel channel, const char *name, int depth) {
+    struct delegation *zone = closest_delegation(name);
+    struct delegation *child;
+    int steps;
+    for (steps = 0; zone && steps < MAX_REFERRALS; steps++) {
+        if (strcmp(zone->zone, name) == 0)
+            return zone;
+        if (zone->server_count == 0 && !zone->resolved)
+            resolve_zone_servers(channel, zone, depth);
+
+        struct iterative_answer answer;
+        if (ask_zone(channel, zone, name, ns_t_ns, &answer) != 0)
+            return NULL;
+        child = follow_referral(zone, name, &answer);
+        free(answer.abuf);
+        // no referral: zone's servers answer for name themselves
+        if (!child)
+            return zone;
+        zone = child;
+    }
+    return zone;
+}
+
+/**
+ * Function: iterate_dns
+ * Finds the domain's nameservers, and all their addresses, with the
+ * iterative walk rather than the system's resolver
+ */
+static void iterate_dns(ares_channel channel, struct lookup_record *record) {
+    char *name = canonical_name(record->domain_name);
+    struct delegation *d = iterate_zone(channel, name, 0);
+    int i;
+    free(name);
+    // the root's servers aren't any domain's own
+    if (!d || d->zone[0] == '\0')
+        return;
+    if (!d->resolved)
+        resolve_zone_servers(channel, d, 0);
+
+    record->ns_names = malloc(d->ns_count * sizeof(char*));
+    for (i = 0; i < d->ns_count; i++)
+        record->ns_names[i] = strdup(d->ns_names[i]);
+    record->ns_count = d->ns_count;
+    for (i = 0; i < d->server_count; i++) {
+        struct zone_server *server = &d->servers[i];
+        add_address(record, record->ns_names[server->ns], server->addr.family,
+                    &server->addr.addr, server->addr.udp_port);
+    }
+}
+
+/**
+ * Function: iterate_addresses
+ * Gets the domain's nameserver addresses ready to probe, looking them up
+ * with the iterative walk if iterate_dns didn't already find them
+ */
+static void iterate_addresses(ares_channel channel, struct lookup_record *record) {
+    int i, j;
+    if (record->address_count == 0) {
+        struct delegation names;
+        memset(&names, 0, sizeof(names));
+        names.ns_names = record->ns_names;
+        names.ns_count = record->ns_count;
+        for (i = 0; i < names.ns_count; i++)
+            resolve_ns(channel, &names, i, 0);
+        for (j = 0; j < names.server_count; j++)
+            add_address(record, record->ns_names[names.servers[j].ns],
+                        names.servers[j].addr.family, &names.servers[j].addr.addr,
+                        names.servers[j].addr.udp_port);
+        free(names.servers);
+    }
+    ready_addresses(record);
+}
+
 void free_mem(struct lookup_record *record) {
-    if (record->dns_name != NULL)
-        free(record->dns_name);
+    int i;
+    for (i = 0; i < record->ns_count; i++)
+        free(record->ns_names[i]);
+    free(record->ns_names);
+    for (i = 0; i < record->address_count; i++)
+        free(record->addresses[i].by_source);
+    free(record->addresses);
+    free(record->domain_name);
     free(record);
 }
 
 int main(int argc, char *argv[]) {
     char *log_file;
+    int tcp_conns = 1;
+    int adaptive = 0;
+    int hedge = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:Ts:ri:aH")) != -1) {
+        switch (opt) {
+        case 't':
+            tcp_probe = 1;
+            tcp_conns = atoi(optarg);
+            break;
+        case 'T':
+            tcp_followup = 1;
+            break;
+        case 's':
+            add_sources(optarg);
+            break;
+        case 'r':
+            per_target = 1;
+            break;
+        case 'i':
+            iterative = 1;
+            add_root_servers(optarg);
+            break;
+        case 'a':
+            adaptive = 1;
+            break;
+        case 'H':
+            hedge = 1;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc < 3){
-		printf("Usage: client [packets_to_send] [file_to_red] [file_output (optional)]\n");
+		printf("Usage: client [-t tcp_connections] [-T] [-s addr[,addr...]] [-r] [-i addr[:port][,...]] [-a] [-H] [packets_to_send] [file_to_red] [file_output (optional)]\n");
+		printf("  -t N  probe over TCP, pipelining over N connections to each target\n");
+		printf("  -T    ask truncated UDP answers again over TCP\n");
+		printf("  -s    local IPv4 addresses to send from, in turn; can be repeated\n");
+		printf("  -r    send each target's probes from one source, rotating per target\n");
+		printf("  -i    find nameservers by walking down from these root servers,\n"
+		       "        rather than asking the system's resolver; a root server\n"
+		       "        given as addr:port or [addr]:port has the servers found\n"
+		       "        below it asked, and probed, on that port too\n");
+		printf("  -a    time out queries by each server's measured round trip time,\n"
+		       "        never waiting longer than the fixed timeout, and send lookups\n"
+		       "        to the system resolver that answers fastest and most reliably\n");
+		printf("  -H    send NS and address lookups that are slower than most to a\n"
+		       "        second system resolver as well, for up to 5%% of lookups\n");
 		exit(1);
 	}
     if (argc == 4 && argv[3])
@@ -198,15 +1149,50 @@ int main(int argc, char *argv[]) {
 
     int packetsToSend = atoi(argv[1]);
     char *fileToRead = argv[2];
+    if (nsources == 0) {
+        sources = calloc(1, sizeof(struct source));
+        sources[0].name = "default";
+        nsources = 1;
+    }
 
     setup_c_ares();
 
     /* Should be sending only DNS packets with no extra processing */
     options.timeout = 1000;            // timeout in ms
     options.tries = 1;               //number of retries to send
-    options.flags = ARES_FLAG_IGNTC; // can add option ARES_FLAG_NOCHECKRESP to keep refused responses
+    options.flags = ARES_FLAG_IGNTC | ARES_FLAG_STAYOPEN | ARES_FLAG_KERNEL_TIMESTAMPS; // can add option ARES_FLAG_NOCHECKRESP to keep refused responses
+    /** Every answer in a target's burst can be waiting before we get to read
+     *  any, so size the buffers to hold all of them. The kernel still caps
+     *  them at net.core.rmem_max / wmem_max, so raise those for big bursts;
+     *  the rx_dropped column shows when answers didn't fit. */
+    options.socket_receive_buffer_size = burst_buffer_size(packetsToSend);
+    options.socket_send_buffer_size = burst_buffer_size(packetsToSend);
     /** ares initialization and options */
-    int optmask = ARES_OPT_FLAGS | ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES;
+    int optmask = ARES_OPT_FLAGS | ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES |
+                  ARES_OPT_SOCK_RCVBUF | ARES_OPT_SOCK_SNDBUF | ARES_OPT_CACHE;
+    /** Targets share parent zones and nameservers, so NS and address
+     *  lookups repeat a lot; probes go out with ares_send_to, which is never
+     *  answered from the cache */
+    options.cache_size = 1 << 20;
+    /** Targets looked up together often ask for the same nameserver's
+     *  address before either answer is back, and those share one query */
+    options.flags |= ARES_FLAG_COALESCE;
+    /** A lost probe or lookup is given up on once it's clearly overdue for
+     *  the server it went to, rather than after the full timeout, and a
+     *  slow or lossy system resolver stops holding up the NS lookups */
+    if (adaptive) {
+        options.flags |= ARES_FLAG_ADAPTIVE_TIMEOUTS | ARES_FLAG_ADAPTIVE_SERVERS;
+        options.timeout_min = 50;
+        options.timeout_max = options.timeout;
+        optmask |= ARES_OPT_TIMEOUT_BOUNDS;
+    }
+    /** The slowest few lookups would otherwise decide how long discovery
+     *  takes; probes go to one address with ares_send_to, so aren't hedged */
+    if (hedge) {
+        options.hedge_percentile = 95;
+        options.hedge_budget = 5;
+        optmask |= ARES_OPT_HEDGE;
+    }
 
     struct lookup_record *queries[101000];
     /** Read in file and save */
@@ -214,11 +1200,34 @@ int main(int argc, char *argv[]) {
     read_file(fileToRead, queries);
     if (log_file) {
         log_filep = fopen(log_file, "w+");
-        fprintf(log_filep, "status domain_name dns_name dns_ip queries_sent responses_received responses_truncated responses_failed\n");
+        fprintf(log_filep, "status domain_name dns_name dns_ip queries_sent responses_received responses_truncated responses_failed rx_dropped sends_deferred avg_rtt_ms max_rtt_ms followups_received followups_failed\n");
+        if (nsources > 1)
+            fprintf(log_filep, "source domain_name dns_ip source_addr queries_sent responses_received responses_truncated responses_failed avg_rtt_ms\n");
     }
 
     printf("[info] read in file, sending requests...\n");
-    
+
+    /** Each source's channel is reused for every target: probes are sent
+     *  straight to each nameserver address with ares_send_to, so it never
+     *  needs reconfiguring. NS and address lookups go to the system
+     *  resolvers the first source's channel was set up with. */
+    int status;
+    int i, a;
+    for (i = 0; i < nsources; i++) {
+        status = init_channel(&sources[i].channel, &sources[i], &options, optmask);
+        if ( status != ARES_SUCCESS ) {
+            printf("[error] could not initialize channel\n");
+            return 1;
+        }
+    }
+    ares_channel channel = sources[0].channel;
+
+    /** The TCP channels keep their connections open for the whole domain and
+     *  pipeline the burst over them; they're rebound to each domain in turn. */
+    tcp_options = options;
+    tcp_options.flags = ARES_FLAG_USEVC | ARES_FLAG_STAYOPEN | ARES_FLAG_KERNEL_TIMESTAMPS;
+    tcp_options.tcp_conns = tcp_conns;
+
     /** Send queries */
     int q;
     for ( q=0; q<server_count; q++ ) {
@@ -228,85 +1237,113 @@ int main(int argc, char *argv[]) {
             printf("[info] on query %d of %d\n", q, server_count);
         }
         //printf("Testing %s, %s\n", record.dns_name, record.domain_name);
-        ares_channel channel;
-
-        int status = ares_init_options(&channel, &options, optmask);
-        if ( status != ARES_SUCCESS ) {
-            printf("[error] could not initialize channel\n");
-            fprintf(log_filep, "[error] could not initialize for %s channel, skipping\n", record->dns_name);
-            fflush(log_filep);
-            return 1;
-        }
-        if (record->dns_name==NULL) {
-            get_dns(channel, record);
-            wait_ares(options.timeout, channel);
-        }
-        // make sure get_dns was a success
-        if (record->dns_name == NULL || strcmp(record->dns_name, "") == 0) {
-            // in case it's a subdomain, lookup again
-            char *tmp =  malloc(strlen(record->domain_name)+1);
-            strcpy(tmp,record->domain_name);
-            strtok(tmp, ".");
-	    //free(tmp);
-            record->alt_domain_name = strtok(NULL, "");
+        if (record->ns_count == 0 && iterative)
+            iterate_dns(channel, record);
+        else if (record->ns_count == 0)
             get_dns(channel, record);
-            wait_ares(options.timeout, channel);
-            // if it's still a failure, skip
-            if (record->dns_name == NULL || strcmp(record->dns_name, "") == 0) {
-                fprintf(log_filep, "[error] could not find dns server of %s, skipping\n", record->domain_name);
-                fflush(log_filep);
-                free_mem(record);
-                continue;
-          }
+        // make sure get_dns was a success, for the name or an ancestor
+        if (record->ns_count == 0) {
+            fprintf(log_filep, "[error] could not find dns server of %s, skipping\n", record->domain_name);
+            fflush(log_filep);
+            free_mem(record);
+            continue;
         }
-        
-        struct ares_addr_node server;
-        server.family = AF_INET;
-        server.next = NULL;
-        struct hostent *host_record = gethostbyname(record->dns_name);
-        if ( host_record == NULL ) {
-            fprintf(log_filep, "[error] could not find addr of %s, skipping\n", record->dns_name);
+
+        if (iterative)
+            iterate_addresses(channel, record);
+        else
+            find_addresses(channel, record);
+        if ( record->address_count == 0 ) {
+            fprintf(log_filep, "[error] could not find addr of %s, skipping\n", record->ns_names[0]);
             fflush(log_filep);
             free_mem(record);
             continue;
         }
-        struct in_addr host_addr;
-        memcpy(&host_addr.s_addr, host_record->h_addr,4);
-        server.addr.addr4 = host_addr;
         int val;
-        if ( (val = ares_set_servers(channel, &server)) != ARES_SUCCESS ) {
-            fprintf(log_filep, "[error] Setting server for domain %s: %d\n", record->domain_name, val);
+        if ((tcp_probe || tcp_followup) &&
+            (status = bind_tcp_channels(record)) != ARES_SUCCESS) {
+            fprintf(log_filep, "[error] could not bind TCP channels for %s: %s, skipping\n",
+                    record->domain_name, ares_strerror(status));
             fflush(log_filep);
             free_mem(record);
             continue;
         }
 
+        // answers lost in our own receive buffer, or sends that had to
+        // wait for room, rather than failures of the target
+        struct ares_stats before, after;
+        channels_stats(&before);
+
         struct timespec sleeptime;
         sleeptime.tv_sec=0;        /* seconds */
         sleeptime.tv_nsec=500;       /* nanoseconds */
         for ( val=0; val<packetsToSend; val++ ) {
             nanosleep(&sleeptime,NULL);    
-            send_packet(channel, record);
+            // every address gets its probe in turn, so they're all probed
+            // at once; spread the probes over the sources, or the targets
+            // with -r
+            for (a = 0; a < record->address_count; a++)
+                send_packet(&record->addresses[a].by_source[(per_target ? q : val) % nsources]);
             if (val % 100 == 0){
-                short_wait_ares(10000, channel);
+                short_wait_ares(10000);
             }
         }
-        wait_ares(100000, channel);
+        wait_ares(100000);
 //was timeout*10000
+        drain_tcp_channels();
+        channels_stats(&after);
         if (log_file) {
-            fprintf(log_filep, "[info] %s %s %s %d %d %d %d\n", record->domain_name,
-                                                    record->dns_name,
-                                                    inet_ntoa(host_addr),
+          // one row per nameserver address; our own drops and deferred sends
+          // can't be told apart by address, so they're the whole domain's
+          for (a = 0; a < record->address_count; a++) {
+            struct ns_address *address = &record->addresses[a];
+            fprintf(log_filep, "[info] %s %s %s %d %d %d %d %lu %lu %.3f %.3f %d %d\n", record->domain_name,
+                                                    address->ns_name,
+                                                    address->addr_text,
                                                     packetsToSend,
-                                                    record->qty_received, 
-                                                    record->qty_truncated, 
-                                                    record->qty_failed);
+                                                    address->qty_received, 
+                                                    address->qty_truncated, 
+                                                    address->qty_failed,
+                                                    after.udp_rx_drops - before.udp_rx_drops,
+                                                    after.udp_deferred_sends - before.udp_deferred_sends,
+                                                    address->qty_received ?
+                                                        address->rtt_total * 1000 / address->qty_received : 0.0,
+                                                    address->rtt_max * 1000,
+                                                    address->qty_followup_received,
+                                                    address->qty_followup_failed);
+            if (nsources > 1) {
+                for (i = 0; i < nsources; i++) {
+                    struct source_results *results = &address->by_source[i];
+                    if (results->qty_sent == 0)
+                        continue;
+                    fprintf(log_filep, "[source] %s %s %s %d %d %d %d %.3f\n", record->domain_name,
+                            address->addr_text,
+                            sources[i].name,
+                            results->qty_sent,
+                            results->qty_received,
+                            results->qty_truncated,
+                            results->qty_failed,
+                            results->qty_received ?
+                                results->rtt_total * 1000 / results->qty_received : 0.0);
+                }
+            }
+          }
             fflush(log_filep);
             free_mem(record);
         }
-        
-        ares_destroy(channel);
     }
+    struct ares_stats totals;
+    channels_stats(&totals);
+    printf("[info] answers dropped by our receive buffers: %lu, sends deferred: %lu\n",
+           totals.udp_rx_drops, totals.udp_deferred_sends);
+    for (i = 0; i < nsources; i++) {
+        ares_destroy(sources[i].channel);
+        for (a = 0; a < sources[i].tcp_channel_count; a++)
+            ares_destroy(sources[i].tcp_channels[a]);
+        free(sources[i].tcp_channels);
+    }
+    free(sources);
+    free_delegations();
 
    fflush(log_filep);
     /** Clean up */
@@ -318,20 +1355,52 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
+/**
+ * Function: get_dns
+ * Finds the domain's nameservers. A subdomain often isn't a zone of its own,
+ * so the NS records of the name and of every one of its ancestors are asked
+ * for at once, and the deepest zone that has any wins.
+ */
 void get_dns(ares_channel channel, struct lookup_record *record) {
     unsigned char *qbuf;
     int buflen;
     int status;
-    char *lookup = record->domain_name;
-    if (record->alt_domain_name)
-        lookup = record->alt_domain_name;
+    int count = 1;
+    int i, j;
+    const char *lookup;
+    for (lookup = record->domain_name; *lookup; lookup++) {
+        if (*lookup == '.' && lookup[1])
+            count++;
+    }
 
-    if ((status =ares_create_query(lookup, ns_c_in, ns_t_ns, ++packet_id, 1, &qbuf, &buflen, 0)) != ARES_SUCCESS) {
-        printf("[error] error creating query: %s\n", ares_strerror(status));
+    struct zone_cut *cuts = calloc(count, sizeof(struct zone_cut));
+    lookup = record->domain_name;
+    for (i = 0; i < count; i++) {
+        cuts[i].name = lookup;
+        if ((status =ares_create_query(lookup, ns_c_in, ns_t_ns, ++packet_id, 1, &qbuf, &buflen, 0)) != ARES_SUCCESS) {
+            printf("[error] error creating query: %s\n", ares_strerror(status));
+        }
+        else {
+            outstanding++;
+            ares_send(channel, qbuf, buflen, dnslookup_callback, &cuts[i]);
+            ares_free_string(qbuf);
+        }
+        if (i + 1 < count)
+            lookup = strchr(lookup, '.') + 1;
     }
-    ares_send(channel, qbuf, buflen, dnslookup_callback, record);
-    ares_free_string(qbuf);
-    return;
+    wait_ares(options.timeout);
+
+    for (i = 0; i < count; i++) {
+        if (record->ns_count == 0 && cuts[i].ns_count > 0) {
+            record->ns_names = cuts[i].ns_names;
+            record->ns_count = cuts[i].ns_count;
+            continue;
+        }
+        for (j = 0; j < cuts[i].ns_count; j++)
+            free(cuts[i].ns_names[j]);
+        free(cuts[i].ns_names);
+    }
+    free(cuts);
 }
 
 void read_file(char *file_name, struct lookup_record **queries ) {
@@ -352,13 +1421,13 @@ void read_file(char *file_name, struct lookup_record **queries ) {
         }
 //while ( EOF != fscanf(source,"%s %s",tmp,tmp2)){
        // printf("%s %s %d\n",tmp, tmp2, numtokens);
-struct lookup_record *record = (struct lookup_record*) malloc(sizeof(struct lookup_record));
+struct lookup_record *record = (struct lookup_record*) calloc(1, sizeof(struct lookup_record));
         record->domain_name = strdup(tmp);
-        record->dns_name=NULL;
         if(numtokens==2){
-          record->dns_name = strdup(tmp2);
+          record->ns_names = malloc(sizeof(char*));
+          record->ns_names[0] = strdup(tmp2);
+          record->ns_count = 1;
         }
-        record->alt_domain_name = NULL;
         queries[server_count++] = record;
     }
     fclose(source);
@@ -372,14 +1441,35 @@ void setup_c_ares() {
     }
 }
 
-void send_packet(ares_channel channel, struct lookup_record *record) {   
+void send_packet(struct source_results *results) {
+    struct ns_address *address = results->address;
     unsigned char *qbuf; 
     int buflen;
     
     int err;
-    if ( (err = ares_create_query(record->domain_name, ns_c_in, ns_t_a, ++packet_id, 0, &qbuf, &buflen, 0)) != ARES_SUCCESS ) {
+    if ( (err = ares_create_query(address->record->domain_name, ns_c_in, ns_t_a, ++packet_id, 0, &qbuf, &buflen, 0)) != ARES_SUCCESS ) {
+        printf("[error] error creating query %d\n", err);
+    }
+    outstanding++;
+    results->qty_sent++;
+    if (tcp_probe)
+        ares_send_batched(sources[results->source].tcp_channels[address->index], qbuf, buflen, results);
+    else
+        ares_send_to_batched(sources[results->source].channel, &address->server, qbuf, buflen, results);
+    ares_free_string(qbuf);
+}
+
+void send_followup(struct source_results *results) {
+    unsigned char *qbuf;
+    int buflen;
+
+    int err;
+    struct ns_address *address = results->address;
+    if ( (err = ares_create_query(address->record->domain_name, ns_c_in, ns_t_a, ++packet_id, 0, &qbuf, &buflen, 0)) != ARES_SUCCESS ) {
         printf("[error] error creating query %d\n", err);
+        return;
     }
-    ares_send(channel, qbuf, buflen, query_callback, record);
+    outstanding++;
+    ares_send_timed(sources[results->source].tcp_channels[address->index], qbuf, buflen, followup_callback, address);
     ares_free_string(qbuf);
 }
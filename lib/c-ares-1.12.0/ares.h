@@ -140,6 +140,11 @@ extern "C" {
 #define ARES_FLAG_NOALIASES     (1 << 6)
 #define ARES_FLAG_NOCHECKRESP   (1 << 7)
 #define ARES_FLAG_EDNS          (1 << 8)
+#define ARES_FLAG_KERNEL_TIMESTAMPS (1 << 9)
+#define ARES_FLAG_BATCH_IO      (1 << 10)
+#define ARES_FLAG_ADAPTIVE_TIMEOUTS (1 << 11)
+#define ARES_FLAG_ADAPTIVE_SERVERS (1 << 12)
+#define ARES_FLAG_COALESCE      (1 << 13)
 
 /* Option mask values */
 #define ARES_OPT_FLAGS          (1 << 0)
@@ -159,6 +164,10 @@ extern "C" {
 #define ARES_OPT_ROTATE         (1 << 14)
 #define ARES_OPT_EDNSPSZ        (1 << 15)
 #define ARES_OPT_NOROTATE       (1 << 16)
+#define ARES_OPT_TCP_CONNS      (1 << 17)
+#define ARES_OPT_TIMEOUT_BOUNDS (1 << 18)
+#define ARES_OPT_HEDGE          (1 << 19)
+#define ARES_OPT_CACHE          (1 << 20)
 
 /* Nameinfo flag values */
 #define ARES_NI_NOFQDN                  (1 << 0)
@@ -227,6 +236,47 @@ typedef void (*ares_sock_state_cb)(void *data,
                                    int readable,
                                    int writable);
 
+/* A socket and what it's ready for, or what the channel wants to know
+   about it, for ares_get_socket_events() and ares_process_events() */
+#define ARES_SOCKET_EVENT_READ  (1 << 0)
+#define ARES_SOCKET_EVENT_WRITE (1 << 1)
+
+struct ares_socket_event {
+  ares_socket_t fd;
+  int events;
+};
+
+/* Counters kept by a channel, for ares_get_stats() */
+struct ares_stats {
+  /* UDP sends that had to wait for room in a socket's send buffer */
+  unsigned long udp_deferred_sends;
+  /* Datagrams the kernel dropped because a UDP socket's receive buffer
+   * was full */
+  unsigned long udp_rx_drops;
+  /* Completions of batched queries lost for lack of memory */
+  unsigned long completions_dropped;
+  /* Queries also sent to a second server with ARES_OPT_HEDGE */
+  unsigned long queries_hedged;
+  /* Queries answered from the cache kept with ARES_OPT_CACHE */
+  unsigned long cache_hits;
+  /* Queries that waited on an identical one with ARES_FLAG_COALESCE */
+  unsigned long queries_coalesced;
+};
+
+/* The same counters for one of the channel's servers, for
+ * ares_get_server_stats() */
+struct ares_server_stats {
+  unsigned long udp_deferred_sends;
+  unsigned long udp_rx_drops;
+  /* Smoothed round trip time and its variation, in microseconds, with
+   * ARES_FLAG_ADAPTIVE_TIMEOUTS or ARES_FLAG_ADAPTIVE_SERVERS; zero until
+   * the first answer */
+  long srtt;
+  long rttvar;
+  /* Smoothed fraction of queries that failed, in parts per million */
+  long loss;
+};
+
 struct apattern;
 
 /* NOTE about the ares_options struct to users and developers.
@@ -265,12 +315,19 @@ struct ares_options {
   struct apattern *sortlist;
   int nsort;
   int ednspsz;
+  int tcp_conns;
+  int timeout_min; /* in milliseconds */
+  int timeout_max; /* in milliseconds */
+  int hedge_percentile;
+  int hedge_budget; /* percent of queries */
+  int cache_size; /* bytes */
 };
 
 struct hostent;
 struct timeval;
 struct sockaddr;
 struct ares_channeldata;
+struct ares_addr_port_node;
 
 typedef struct ares_channeldata *ares_channel;
 
@@ -280,6 +337,63 @@ typedef void (*ares_callback)(void *arg,
                               unsigned char *abuf,
                               int alen);
 
+/* A wall clock time, in seconds and nanoseconds since the Epoch */
+struct ares_timestamp {
+  time_t sec;
+  long nsec;
+};
+
+/* When a query's last attempt was sent and its answer received, for
+ * ares_send_timed() and ares_send_to_timed() */
+struct ares_query_times {
+  struct ares_timestamp sent;
+  /* Zero if no answer was received */
+  struct ares_timestamp received;
+  /* Non-zero if received was taken by the kernel as the answer arrived,
+   * rather than by c-ares when it got around to reading it */
+  int kernel_received;
+};
+
+typedef void (*ares_timed_callback)(void *arg,
+                                    int status,
+                                    int timeouts,
+                                    unsigned char *abuf,
+                                    int alen,
+                                    const struct ares_query_times *times);
+
+/* A query answered through a completion queue, see ares_thread_send() */
+struct ares_thread_completion {
+  void *arg;
+  int status;
+  int timeouts;
+  /* The answer, to be freed with ares_free_string(); NULL if none */
+  unsigned char *abuf;
+  int alen;
+};
+
+typedef struct ares_completion_queuedata *ares_completion_queue;
+
+/* The outcome of a query sent with ares_send_batched() or
+ * ares_send_to_batched(), see ares_get_completions() */
+struct ares_completion {
+  void *arg;
+  int status;
+  int timeouts;
+  /* The answer's reply code, or -1 if there was no answer */
+  int rcode;
+  /* ARES_COMPLETION_* flags */
+  int flags;
+  /* Microseconds from the last attempt being sent to its answer
+   * arriving, or -1 if there was no answer */
+  long rtt;
+};
+
+/* Flags for struct ares_completion */
+#define ARES_COMPLETION_AA          (1 << 0)
+#define ARES_COMPLETION_TC          (1 << 1)
+#define ARES_COMPLETION_RA          (1 << 2)
+#define ARES_COMPLETION_KERNEL_TIME (1 << 3)
+
 typedef void (*ares_host_callback)(void *arg,
                                    int status,
                                    int timeouts,
@@ -362,6 +476,41 @@ CARES_EXTERN void ares_send(ares_channel channel,
                             ares_callback callback,
                             void *arg);
 
+CARES_EXTERN void ares_send_to(ares_channel channel,
+                               const struct ares_addr_port_node *dest,
+                               const unsigned char *qbuf,
+                               int qlen,
+                               ares_callback callback,
+                               void *arg);
+
+CARES_EXTERN void ares_send_timed(ares_channel channel,
+                                  const unsigned char *qbuf,
+                                  int qlen,
+                                  ares_timed_callback callback,
+                                  void *arg);
+
+CARES_EXTERN void ares_send_to_timed(ares_channel channel,
+                                     const struct ares_addr_port_node *dest,
+                                     const unsigned char *qbuf,
+                                     int qlen,
+                                     ares_timed_callback callback,
+                                     void *arg);
+
+CARES_EXTERN void ares_send_batched(ares_channel channel,
+                                    const unsigned char *qbuf,
+                                    int qlen,
+                                    void *arg);
+
+CARES_EXTERN void ares_send_to_batched(ares_channel channel,
+                                       const struct ares_addr_port_node *dest,
+                                       const unsigned char *qbuf,
+                                       int qlen,
+                                       void *arg);
+
+CARES_EXTERN int ares_get_completions(ares_channel channel,
+                                      struct ares_completion *completions,
+                                      int ncompletions);
+
 CARES_EXTERN void ares_query(ares_channel channel,
                              const char *name,
                              int dnsclass,
@@ -409,6 +558,17 @@ CARES_EXTERN int ares_getsock(ares_channel channel,
                               ares_socket_t *socks,
                               int numsocks);
 
+CARES_EXTERN int ares_get_socket_events(ares_channel channel,
+                                        struct ares_socket_event *events,
+                                        int nevents);
+
+CARES_EXTERN int ares_get_stats(ares_channel channel,
+                                struct ares_stats *stats);
+
+CARES_EXTERN int ares_get_server_stats(ares_channel channel,
+                                       int server,
+                                       struct ares_server_stats *stats);
+
 CARES_EXTERN struct timeval *ares_timeout(ares_channel channel,
                                           struct timeval *maxtv,
                                           struct timeval *tv);
@@ -421,6 +581,32 @@ CARES_EXTERN void ares_process_fd(ares_channel channel,
                                   ares_socket_t read_fd,
                                   ares_socket_t write_fd);
 
+CARES_EXTERN void ares_process_events(ares_channel channel,
+                                      const struct ares_socket_event *events,
+                                      int nevents);
+
+CARES_EXTERN int ares_thread_start(ares_channel channel,
+                                   int queue_size);
+
+CARES_EXTERN void ares_thread_stop(ares_channel channel);
+
+CARES_EXTERN int ares_thread_send(ares_channel channel,
+                                  const struct ares_addr_port_node *dest,
+                                  const unsigned char *qbuf,
+                                  int qlen,
+                                  ares_completion_queue cq,
+                                  void *arg);
+
+CARES_EXTERN int ares_completion_queue_create(ares_completion_queue *cq);
+
+CARES_EXTERN void ares_completion_queue_destroy(ares_completion_queue cq);
+
+CARES_EXTERN int ares_completion_queue_wait(
+                                   ares_completion_queue cq,
+                                   struct ares_thread_completion *completions,
+                                   int ncompletions,
+                                   int timeout_ms);
+
 CARES_EXTERN int ares_create_query(const char *name,
                                    int dnsclass,
                                    int type,
@@ -618,6 +804,13 @@ CARES_EXTERN int ares_set_servers_csv(ares_channel channel,
 CARES_EXTERN int ares_set_servers_ports_csv(ares_channel channel,
                                             const char* servers);
 
+/* Flags for ares_rebind_servers() */
+#define ARES_REBIND_KEEP_SOCKETS (1 << 0)
+
+CARES_EXTERN int ares_rebind_servers(ares_channel channel,
+                                     struct ares_addr_port_node *servers,
+                                     int flags);
+
 CARES_EXTERN int ares_get_servers(ares_channel channel,
                                   struct ares_addr_node **servers);
 CARES_EXTERN int ares_get_servers_ports(ares_channel channel,
@@ -0,0 +1,381 @@
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* Routines for the channel's cache of answers, used with ARES_OPT_CACHE.
+ * Answers are kept as they came off the wire, each in one allocation, in a
+ * hash table keyed by the question's name, type and class, and by the
+ * query's flags that change what the answer holds: recursion desired,
+ * checking disabled, and whether it had an EDNS OPT record and with it the
+ * DNSSEC OK bit. The name isn't
+ * stored apart from the answer: the question in the answer is compared
+ * with the one being asked.
+ *
+ * Answers are kept for as long as their records' TTLs allow, and negative
+ * answers as long as RFC 2308 allows, given by their SOA record. The cache
+ * holds no more than cache_size bytes, counting the entries' overhead; the
+ * least recently used answers make room for new ones.
+ */
+
+#ifndef T_OPT
+#  define T_OPT  41 /* EDNS0 option (meta-RR) */
+#endif
+
+/* A query's flags that are part of the key */
+#define KEY_RD   0x01
+#define KEY_CD   0x02
+#define KEY_EDNS 0x04
+#define KEY_DO   0x08
+
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_BUCKET_BYTES 512 /* of cache_size per hash bucket */
+
+struct cache_entry {
+  struct list_node lru;       /* in channel->cache_lru, most recent last */
+  struct cache_entry *next;   /* in the same hash bucket */
+  unsigned int hash;          /* of the question's name */
+  unsigned short type;
+  unsigned short dnsclass;
+  unsigned int key_flags;     /* KEY_* of the query */
+  time_t stored;              /* on ares__tvnow()'s clock */
+  time_t expires;
+  unsigned char *abuf;        /* follows the entry in its allocation */
+  int alen;
+};
+
+/* Finds the only question in a query or answer. Returns its name's hash,
+ * and a pointer to its type and class, or NULL if there isn't just one
+ * question or it's malformed. */
+static const unsigned char *find_question(const unsigned char *buf, int len,
+                                          unsigned int *hash)
+{
+  long enclen;
+  const unsigned char *p;
+
+  if (len < HFIXEDSZ || DNS_HEADER_QDCOUNT(buf) != 1)
+    return NULL;
+  p = buf + HFIXEDSZ;
+  if (ares__name_hash(p, buf, len, hash, &enclen) != ARES_SUCCESS)
+    return NULL;
+  p += enclen;
+  if (p + QFIXEDSZ > buf + len)
+    return NULL;
+  return p;
+}
+
+/* Skips the name at p, returning what follows it, or NULL if it's
+ * malformed or there isn't room after it for need more bytes. */
+static unsigned char *skip_name(unsigned char *p, const unsigned char *abuf,
+                                int alen, int need)
+{
+  unsigned int hash;
+  long enclen;
+
+  if (ares__name_hash(p, abuf, alen, &hash, &enclen) != ARES_SUCCESS)
+    return NULL;
+  p += enclen;
+  if (p + need > abuf + alen)
+    return NULL;
+  return p;
+}
+
+/* Returns the query's KEY_* flags, given its question as find_question()
+ * found it. */
+static unsigned int query_key_flags(const unsigned char *qbuf, int qlen,
+                                    const unsigned char *q)
+{
+  unsigned int flags = 0;
+  unsigned char *p = (unsigned char *)q + QFIXEDSZ;
+  int count = DNS_HEADER_ANCOUNT(qbuf) + DNS_HEADER_NSCOUNT(qbuf) +
+    DNS_HEADER_ARCOUNT(qbuf);
+  int i;
+
+  if (DNS_HEADER_RD(qbuf))
+    flags |= KEY_RD;
+  if (qbuf[3] & 0x10)
+    flags |= KEY_CD;
+  for (i = 0; i < count; i++)
+    {
+      p = skip_name(p, qbuf, qlen, RRFIXEDSZ);
+      if (!p)
+        break;
+      /* An OPT record's TTL field holds flags, DO the first of them. */
+      if (DNS_RR_TYPE(p) == T_OPT)
+        {
+          flags |= KEY_EDNS;
+          if (DNS_RR_TTL(p) & 0x8000)
+            flags |= KEY_DO;
+          break;
+        }
+      p += RRFIXEDSZ + DNS_RR_LEN(p);
+      if (p > qbuf + qlen)
+        break;
+    }
+  return flags;
+}
+
+/* Returns the first resource record in an answer with one question, or
+ * NULL if it's malformed. */
+static unsigned char *first_rr(unsigned char *abuf, int alen)
+{
+  unsigned char *p = skip_name(abuf + HFIXEDSZ, abuf, alen, QFIXEDSZ);
+
+  return p ? p + QFIXEDSZ : NULL;
+}
+
+/* Returns how many seconds an answer may be cached for, or 0 if it
+ * mustn't be: the least TTL of its answers, or for a negative answer, the
+ * lesser of its SOA record's TTL and minimum. */
+static long answer_ttl(unsigned char *abuf, int alen)
+{
+  int ancount = DNS_HEADER_ANCOUNT(abuf);
+  int nscount = DNS_HEADER_NSCOUNT(abuf);
+  int rcode = DNS_HEADER_RCODE(abuf);
+  unsigned char *p, *rdata;
+  long ttl = -1, rrttl, minimum;
+  int i, type, len;
+
+  if (DNS_HEADER_TC(abuf) || (rcode != NOERROR && rcode != NXDOMAIN) ||
+      (rcode == NXDOMAIN && ancount))
+    return 0;
+
+  p = first_rr(abuf, alen);
+  for (i = 0; p && i < ancount + nscount; i++)
+    {
+      p = skip_name(p, abuf, alen, RRFIXEDSZ);
+      if (!p)
+        return 0;
+      type = DNS_RR_TYPE(p);
+      rrttl = DNS_RR_TTL(p) & 0x7fffffffL;
+      len = DNS_RR_LEN(p);
+      rdata = p + RRFIXEDSZ;
+      p = rdata + len;
+      if (p > abuf + alen)
+        return 0;
+
+      if (i < ancount)
+        {
+          if (ttl < 0 || rrttl < ttl)
+            ttl = rrttl;
+        }
+      else if (!ancount && type == T_SOA)
+        {
+          /* The minimum is the last of five numbers after two names. */
+          rdata = skip_name(rdata, abuf, alen, 0);
+          if (rdata)
+            rdata = skip_name(rdata, abuf, alen, 20);
+          if (!rdata || rdata + 20 > p)
+            return 0;
+          minimum = DNS__32BIT(rdata + 16) & 0x7fffffffL;
+          return rrttl < minimum ? rrttl : minimum;
+        }
+    }
+  return ttl > 0 ? ttl : 0;
+}
+
+/* Takes age seconds off the TTLs of all the records in an answer. */
+static void age_answer(unsigned char *abuf, int alen, long age)
+{
+  int count = DNS_HEADER_ANCOUNT(abuf) + DNS_HEADER_NSCOUNT(abuf) +
+    DNS_HEADER_ARCOUNT(abuf);
+  unsigned char *p;
+  long ttl;
+  int i;
+
+  p = first_rr(abuf, alen);
+  for (i = 0; p && i < count; i++)
+    {
+      p = skip_name(p, abuf, alen, RRFIXEDSZ);
+      if (!p)
+        return;
+      /* An OPT record's TTL field holds flags instead. */
+      if (DNS_RR_TYPE(p) != T_OPT)
+        {
+          ttl = DNS_RR_TTL(p) & 0x7fffffffL;
+          DNS_RR_SET_TTL(p, ttl > age ? ttl - age : 0);
+        }
+      p += RRFIXEDSZ + DNS_RR_LEN(p);
+      if (p > abuf + alen)
+        return;
+    }
+}
+
+static struct cache_entry **cache_bucket(ares_channel channel,
+                                         unsigned int hash)
+{
+  return &channel->cache_buckets[hash & (channel->cache_nbuckets - 1)];
+}
+
+static void remove_entry(ares_channel channel, struct cache_entry *entry)
+{
+  struct cache_entry **pp = cache_bucket(channel, entry->hash);
+
+  while (*pp != entry)
+    pp = &(*pp)->next;
+  *pp = entry->next;
+  ares__remove_from_list(&entry->lru);
+  channel->cache_used -= sizeof(struct cache_entry) + entry->alen;
+  ares_free(entry);
+}
+
+/* Looks for a cached answer to the query in qbuf. If there's one, returns
+ * ARES_SUCCESS and a copy of it in *abuf, which the caller must free, with
+ * the query's id and its TTLs aged by how long it has been cached. */
+int ares__cache_fetch(ares_channel channel, const unsigned char *qbuf,
+                      int qlen, unsigned char **abuf, int *alen)
+{
+  struct cache_entry *entry;
+  const unsigned char *q;
+  unsigned int hash, key_flags;
+  struct timeval now;
+
+  if (!channel->cache_buckets)
+    return ARES_ENOTFOUND;
+  q = find_question(qbuf, qlen, &hash);
+  if (!q)
+    return ARES_ENOTFOUND;
+  key_flags = query_key_flags(qbuf, qlen, q);
+
+  for (entry = *cache_bucket(channel, hash); entry; entry = entry->next)
+    {
+      if (entry->hash == hash && entry->type == DNS_QUESTION_TYPE(q) &&
+          entry->dnsclass == DNS_QUESTION_CLASS(q) &&
+          entry->key_flags == key_flags &&
+          ares__name_equal(qbuf + HFIXEDSZ, qbuf, qlen,
+                           entry->abuf + HFIXEDSZ, entry->abuf, entry->alen))
+        break;
+    }
+  if (!entry)
+    return ARES_ENOTFOUND;
+
+  now = ares__tvnow();
+  if (now.tv_sec >= entry->expires)
+    {
+      remove_entry(channel, entry);
+      return ARES_ENOTFOUND;
+    }
+
+  *abuf = ares_malloc(entry->alen);
+  if (!*abuf)
+    return ARES_ENOMEM;
+  memcpy(*abuf, entry->abuf, entry->alen);
+  *alen = entry->alen;
+  DNS_HEADER_SET_QID(*abuf, DNS_HEADER_QID(qbuf));
+  age_answer(*abuf, *alen, (long)(now.tv_sec - entry->stored));
+
+  ares__remove_from_list(&entry->lru);
+  ares__insert_in_list(&entry->lru, &channel->cache_lru);
+  return ARES_SUCCESS;
+}
+
+/* Caches the answer to the query in qbuf, if it can be, replacing any
+ * answer already cached for it and making room by dropping the least
+ * recently used ones. */
+void ares__cache_insert(ares_channel channel, const unsigned char *qbuf,
+                        int qlen, const unsigned char *abuf, int alen)
+{
+  struct cache_entry *entry, **pp;
+  const unsigned char *q;
+  unsigned int hash, ahash;
+  size_t size = sizeof(struct cache_entry) + alen;
+  long ttl;
+  int i;
+
+  if (size > (size_t)channel->cache_size)
+    return;
+  q = find_question(qbuf, qlen, &hash);
+  if (!q || !find_question(abuf, alen, &ahash) || ahash != hash)
+    return;
+
+  if (!channel->cache_buckets)
+    {
+      channel->cache_nbuckets = CACHE_MIN_BUCKETS;
+      while (channel->cache_nbuckets <
+             channel->cache_size / CACHE_BUCKET_BYTES)
+        channel->cache_nbuckets *= 2;
+      channel->cache_buckets =
+        ares_malloc(channel->cache_nbuckets * sizeof(struct cache_entry *));
+      if (!channel->cache_buckets)
+        return;
+      for (i = 0; i < channel->cache_nbuckets; i++)
+        channel->cache_buckets[i] = NULL;
+    }
+
+  entry = ares_malloc(size);
+  if (!entry)
+    return;
+  entry->abuf = (unsigned char *)(entry + 1);
+  memcpy(entry->abuf, abuf, alen);
+  entry->alen = alen;
+  ttl = answer_ttl(entry->abuf, alen);
+  if (!ttl)
+    {
+      ares_free(entry);
+      return;
+    }
+  entry->hash = hash;
+  entry->type = (unsigned short)DNS_QUESTION_TYPE(q);
+  entry->dnsclass = (unsigned short)DNS_QUESTION_CLASS(q);
+  entry->key_flags = query_key_flags(qbuf, qlen, q);
+  entry->stored = ares__tvnow().tv_sec;
+  entry->expires = entry->stored + ttl;
+
+  /* Drop the answer this one replaces, then the least recently used. */
+  for (pp = cache_bucket(channel, hash); *pp; pp = &(*pp)->next)
+    {
+      if ((*pp)->hash == hash && (*pp)->type == entry->type &&
+          (*pp)->dnsclass == entry->dnsclass &&
+          (*pp)->key_flags == entry->key_flags &&
+          ares__name_equal(qbuf + HFIXEDSZ, qbuf, qlen,
+                           (*pp)->abuf + HFIXEDSZ, (*pp)->abuf, (*pp)->alen))
+        {
+          remove_entry(channel, *pp);
+          break;
+        }
+    }
+  while (channel->cache_used + size > (size_t)channel->cache_size)
+    remove_entry(channel, channel->cache_lru.next->data);
+
+  ares__init_list_node(&entry->lru, entry);
+  ares__insert_in_list(&entry->lru, &channel->cache_lru);
+  pp = cache_bucket(channel, hash);
+  entry->next = *pp;
+  *pp = entry;
+  channel->cache_used += size;
+}
+
+void ares__destroy_cache(ares_channel channel)
+{
+  while (!ares__is_list_empty(&channel->cache_lru))
+    remove_entry(channel, channel->cache_lru.next->data);
+  if (channel->cache_buckets)
+    ares_free(channel->cache_buckets);
+  channel->cache_buckets = NULL;
+}
@@ -22,40 +22,92 @@
 void ares__close_sockets(ares_channel channel, struct server_state *server)
 {
   struct send_request *sendreq;
+  struct tcp_connection *conn;
+  int i;
 
-  /* Free all pending output buffers. */
-  while (server->qhead)
+  for (i = 0; i < ARES_MAX_TCP_CONNS; i++)
     {
-      /* Advance server->qhead; pull out query as we go. */
-      sendreq = server->qhead;
-      server->qhead = sendreq->next;
-      if (sendreq->data_storage != NULL)
-        ares_free(sendreq->data_storage);
-      ares_free(sendreq);
+      conn = &server->tcp[i];
+
+      /* Free all pending output buffers. */
+      while (conn->qhead)
+        {
+          /* Advance conn->qhead; pull out query as we go. */
+          sendreq = conn->qhead;
+          conn->qhead = sendreq->next;
+          ares__free_sendreq(sendreq);
+        }
+      conn->qtail = NULL;
+
+      /* Reset any existing input buffer. */
+      if (conn->buffer)
+        ares_free(conn->buffer);
+      conn->buffer = NULL;
+      conn->buffer_len = 0;
+      conn->buffer_alloc = 0;
+
+      /* Close the TCP socket. */
+      if (conn->socket != ARES_SOCKET_BAD)
+        {
+          SOCK_STATE_CALLBACK(channel, conn->socket, 0, 0);
+          ares__remove_socket(channel, conn->socket);
+          sclose(conn->socket);
+          conn->socket = ARES_SOCKET_BAD;
+          conn->generation = ++channel->tcp_connection_generation;
+        }
     }
-  server->qtail = NULL;
 
-  /* Reset any existing input buffer. */
-  if (server->tcp_buffer)
-    ares_free(server->tcp_buffer);
-  server->tcp_buffer = NULL;
-  server->tcp_lenbuf_pos = 0;
+  /* Forget the queries waiting to go out on the UDP socket; they are still
+   * outstanding to this server, so they'll be sent again or time out. */
+  ares__clear_udp_pending(&server->udp_pending);
 
   /* Reset brokenness */
   server->is_broken = 0;
 
-  /* Close the TCP and UDP sockets. */
-  if (server->tcp_socket != ARES_SOCKET_BAD)
-    {
-      SOCK_STATE_CALLBACK(channel, server->tcp_socket, 0, 0);
-      sclose(server->tcp_socket);
-      server->tcp_socket = ARES_SOCKET_BAD;
-      server->tcp_connection_generation = ++channel->tcp_connection_generation;
-    }
+  /* Close the UDP socket. */
   if (server->udp_socket != ARES_SOCKET_BAD)
     {
       SOCK_STATE_CALLBACK(channel, server->udp_socket, 0, 0);
+      ares__remove_socket(channel, server->udp_socket);
       sclose(server->udp_socket);
       server->udp_socket = ARES_SOCKET_BAD;
     }
 }
+
+/* Close the UDP sockets shared by queries sent with ares_send_to(). */
+void ares__close_udp_pool(ares_channel channel)
+{
+  ares_socket_t *s;
+  int i;
+
+  for (i = 0; i < 2 * ARES_UDP_POOL_SIZE; i++)
+    {
+      s = ARES_POOL_SOCKET(channel, i);
+      ares__clear_udp_pending(ARES_POOL_PENDING(channel, i));
+      if (*s != ARES_SOCKET_BAD)
+        {
+          SOCK_STATE_CALLBACK(channel, *s, 0, 0);
+          ares__remove_socket(channel, *s);
+          sclose(*s);
+          *s = ARES_SOCKET_BAD;
+        }
+    }
+}
+
+/* Free a sendreq that has been taken off its server's queue, unlinking it
+ * from its owner query if it still has one.
+ */
+void ares__free_sendreq(struct send_request *sendreq)
+{
+  ares__remove_from_list(&(sendreq->owner_node));
+  if (sendreq->data_storage != NULL)
+    ares_free(sendreq->data_storage);
+  ares_free(sendreq);
+}
+
+/* Take every query off a queue of UDP sends waiting for buffer space. */
+void ares__clear_udp_pending(struct list_node *pending)
+{
+  while (!ares__is_list_empty(pending))
+    ares__remove_from_list(pending->next);
+}
@@ -0,0 +1,334 @@
+
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#ifdef HAVE_NETINET_IN_H
+#  include <netinet/in.h>
+#endif
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_dns.h"
+#include "ares_private.h"
+
+/* Routines for managing the channel's table of queries indexed directly by
+ * query id. Every possible qid has its own slot, so dispatching a response
+ * is a single array access. A slot only holds more than one query when the
+ * application reuses a qid that is still outstanding; those queries are
+ * chained through query->qid_next and told apart by their questions.
+ *
+ * Queries sent with ares_send_to() don't go in that table. Each of them
+ * has its own destination, so they are kept in a hash table keyed by
+ * destination and qid instead, which grows with the number of queries.
+ * Their qids are unique per destination, so a key finds at most one query.
+ *
+ * With ARES_FLAG_COALESCE, queries to the channel's servers are also kept
+ * in a table keyed by their question, so that a caller asking the same
+ * question while one is outstanding can wait on it instead.
+ */
+
+#define ARES_DEST_TABLE_MIN 256
+
+int ares__init_qid_table(ares_channel channel)
+{
+  channel->queries_by_qid =
+    ares_malloc(ARES_QID_TABLE_SIZE * sizeof(struct query *));
+  if (!channel->queries_by_qid)
+    return ARES_ENOMEM;
+  memset(channel->queries_by_qid, 0,
+         ARES_QID_TABLE_SIZE * sizeof(struct query *));
+  return ARES_SUCCESS;
+}
+
+void ares__destroy_qid_table(ares_channel channel)
+{
+  if (channel->queries_by_qid)
+    ares_free(channel->queries_by_qid);
+  channel->queries_by_qid = NULL;
+  if (channel->queries_by_dest)
+    ares_free(channel->queries_by_dest);
+  channel->queries_by_dest = NULL;
+  channel->dest_buckets = 0;
+  channel->ndest_queries = 0;
+  if (channel->queries_by_question)
+    ares_free(channel->queries_by_question);
+  channel->queries_by_question = NULL;
+}
+
+/* Returns the first query waiting for an answer with the given qid, or NULL
+ * if there is none. Further queries with the same qid follow via qid_next.
+ */
+struct query *ares__find_query_by_qid(ares_channel channel,
+                                      unsigned short qid)
+{
+  return channel->queries_by_qid[qid];
+}
+
+/* Adds the query to its qid's slot. Returns 1 if the slot already held an
+ * outstanding query with the same qid, 0 otherwise.
+ */
+int ares__insert_query_by_qid(ares_channel channel, struct query *query)
+{
+  struct query **slot = &channel->queries_by_qid[query->qid];
+  int duplicate = (*slot != NULL);
+
+  query->qid_next = *slot;
+  *slot = query;
+  return duplicate;
+}
+
+/* Removes the query from its qid's slot, if it's there */
+void ares__remove_query_by_qid(ares_channel channel, struct query *query)
+{
+  struct query **slot = &channel->queries_by_qid[query->qid];
+
+  for (; *slot; slot = &(*slot)->qid_next)
+    {
+      if (*slot == query)
+        {
+          *slot = query->qid_next;
+          break;
+        }
+    }
+  query->qid_next = NULL;
+}
+
+/* Returns true if two destinations have the same address and UDP port. */
+int ares__same_dest(const struct ares_addr *a, const struct ares_addr *b)
+{
+  if (a->family != b->family || a->udp_port != b->udp_port)
+    return 0;
+  if (a->family == AF_INET)
+    return memcmp(&a->addrV4, &b->addrV4, sizeof(a->addrV4)) == 0;
+  return memcmp(&a->addrV6, &b->addrV6, sizeof(a->addrV6)) == 0;
+}
+
+/* Hashes a destination's address and UDP port, along with a qid. */
+unsigned int ares__hash_dest(const struct ares_addr *dest,
+                             unsigned short qid)
+{
+  const unsigned char *p;
+  size_t len, i;
+  unsigned int h = 2166136261U; /* FNV-1a */
+
+  if (dest->family == AF_INET)
+    {
+      p = (const unsigned char *)&dest->addrV4;
+      len = sizeof(dest->addrV4);
+    }
+  else
+    {
+      p = (const unsigned char *)&dest->addrV6;
+      len = sizeof(dest->addrV6);
+    }
+  for (i = 0; i < len; i++)
+    h = (h ^ p[i]) * 16777619U;
+  h = (h ^ (unsigned int)(dest->udp_port & 0xffff)) * 16777619U;
+  h = (h ^ qid) * 16777619U;
+  return h;
+}
+
+/* Returns the query sent to the given destination with the given qid, or
+ * NULL if there is none. The destination's udp_port must be the one the
+ * query was actually sent to.
+ */
+struct query *ares__find_query_by_dest(ares_channel channel,
+                                       const struct ares_addr *dest,
+                                       unsigned short qid)
+{
+  struct query *query;
+
+  if (!channel->queries_by_dest)
+    return NULL;
+  query = channel->queries_by_dest[ares__hash_dest(dest, qid) &
+                                   (channel->dest_buckets - 1)];
+  for (; query; query = query->qid_next)
+    {
+      if (query->qid == qid && ares__same_dest(&query->dest, dest))
+        return query;
+    }
+  return NULL;
+}
+
+/* Resizes the destination table to the given number of buckets, which must
+ * be a power of two, rehashing the queries in it.
+ */
+static int resize_dest_table(ares_channel channel, int buckets)
+{
+  struct query **table;
+  struct query *query;
+  struct query *next;
+  unsigned int h;
+  int i;
+
+  table = ares_malloc(buckets * sizeof(struct query *));
+  if (!table)
+    return ARES_ENOMEM;
+  memset(table, 0, buckets * sizeof(struct query *));
+
+  for (i = 0; i < channel->dest_buckets; i++)
+    {
+      for (query = channel->queries_by_dest[i]; query; query = next)
+        {
+          next = query->qid_next;
+          h = ares__hash_dest(&query->dest, query->qid) & (buckets - 1);
+          query->qid_next = table[h];
+          table[h] = query;
+        }
+    }
+
+  if (channel->queries_by_dest)
+    ares_free(channel->queries_by_dest);
+  channel->queries_by_dest = table;
+  channel->dest_buckets = buckets;
+  return ARES_SUCCESS;
+}
+
+/* Adds a query with a destination to the destination table, growing it to
+ * keep the chains short. The caller makes sure no other query to the same
+ * destination has the same qid.
+ */
+int ares__insert_query_by_dest(ares_channel channel, struct query *query)
+{
+  struct query **slot;
+  int status;
+
+  if (channel->ndest_queries >= channel->dest_buckets)
+    {
+      status = resize_dest_table(channel, channel->dest_buckets ?
+                                 channel->dest_buckets * 2 :
+                                 ARES_DEST_TABLE_MIN);
+      /* A full table still works, just more slowly. */
+      if (status != ARES_SUCCESS && !channel->queries_by_dest)
+        return status;
+    }
+
+  slot = &channel->queries_by_dest[ares__hash_dest(&query->dest, query->qid) &
+                                   (channel->dest_buckets - 1)];
+  query->qid_next = *slot;
+  *slot = query;
+  channel->ndest_queries++;
+  return ARES_SUCCESS;
+}
+
+/* Removes the query from the destination table, if it's there */
+void ares__remove_query_by_dest(ares_channel channel, struct query *query)
+{
+  struct query **slot;
+
+  if (!channel->queries_by_dest)
+    return;
+  slot = &channel->queries_by_dest[ares__hash_dest(&query->dest, query->qid) &
+                                   (channel->dest_buckets - 1)];
+  for (; *slot; slot = &(*slot)->qid_next)
+    {
+      if (*slot == query)
+        {
+          *slot = query->qid_next;
+          channel->ndest_queries--;
+          break;
+        }
+    }
+  query->qid_next = NULL;
+}
+
+/* Returns an outstanding query that the one in qbuf can wait on instead of
+ * being sent: one with the same header flags and the same single question,
+ * asked the same way. Returns NULL if there is none. */
+struct query *ares__find_coalescable(ares_channel channel,
+                                     const unsigned char *qbuf, int qlen)
+{
+  struct query *query;
+  unsigned int qname_hash, hash;
+  long enclen, qenclen;
+
+  if (!channel->queries_by_question || qlen <= HFIXEDSZ ||
+      DNS_HEADER_QDCOUNT(qbuf) != 1 ||
+      ares__name_hash(qbuf + HFIXEDSZ, qbuf, qlen, &qname_hash, &enclen)
+        != ARES_SUCCESS)
+    return NULL;
+
+  for (query = channel->queries_by_question[qname_hash &
+                                            (ARES_COALESCE_TABLE_SIZE - 1)];
+       query; query = query->coalesce_next)
+    {
+      if (query->qname_hash != qname_hash || query->qlen != qlen ||
+          memcmp(query->qbuf + 2, qbuf + 2, HFIXEDSZ - 2) != 0)
+        continue;
+      if (ares__name_hash(query->qbuf + HFIXEDSZ, query->qbuf, query->qlen,
+                          &hash, &qenclen) != ARES_SUCCESS ||
+          qenclen != enclen)
+        continue;
+      /* The rest is the type and class, and any EDNS record. */
+      if (memcmp(query->qbuf + HFIXEDSZ + enclen, qbuf + HFIXEDSZ + enclen,
+                 qlen - HFIXEDSZ - enclen) == 0 &&
+          ares__name_equal(query->qbuf + HFIXEDSZ, query->qbuf, query->qlen,
+                           qbuf + HFIXEDSZ, qbuf, qlen))
+        return query;
+    }
+  return NULL;
+}
+
+/* Adds a query to the table of those that others can wait on. Without
+ * memory for the table, it just isn't added. */
+void ares__insert_coalescable(ares_channel channel, struct query *query)
+{
+  struct query **slot;
+
+  if (!channel->queries_by_question)
+    {
+      channel->queries_by_question =
+        ares_malloc(ARES_COALESCE_TABLE_SIZE * sizeof(struct query *));
+      if (!channel->queries_by_question)
+        return;
+      memset(channel->queries_by_question, 0,
+             ARES_COALESCE_TABLE_SIZE * sizeof(struct query *));
+    }
+
+  slot = &channel->queries_by_question[query->qname_hash &
+                                       (ARES_COALESCE_TABLE_SIZE - 1)];
+  query->coalesce_next = *slot;
+  *slot = query;
+  query->coalescable = 1;
+}
+
+/* Removes a query from the table of those that others can wait on, if it's
+ * there, so that nobody else waits on it */
+void ares__remove_coalescable(ares_channel channel, struct query *query)
+{
+  struct query **slot;
+
+  if (!query->coalescable)
+    return;
+  slot = &channel->queries_by_question[query->qname_hash &
+                                       (ARES_COALESCE_TABLE_SIZE - 1)];
+  for (; *slot; slot = &(*slot)->coalesce_next)
+    {
+      if (*slot == query)
+        {
+          *slot = query->coalesce_next;
+          break;
+        }
+    }
+  query->coalesce_next = NULL;
+  query->coalescable = 0;
+}
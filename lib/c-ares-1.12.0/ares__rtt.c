@@ -0,0 +1,268 @@
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Routines for estimating how long a server takes to answer, and working
+ * out from that how long to wait for it before trying again, as RFC 6298
+ * does for TCP retransmissions. They are used with
+ * ARES_FLAG_ADAPTIVE_TIMEOUTS; otherwise a query waits the channel's fixed
+ * timeout. With ARES_FLAG_ADAPTIVE_SERVERS, the estimates, along with how
+ * often each server fails, also decide which server a query goes to.
+ *
+ * Samples are only taken from answers to queries that were sent once, so
+ * that an answer is never mistaken for the answer to a later attempt.
+ */
+
+/* The granularity of the clock the samples are taken with, and the most
+ * times a server's timeout is doubled without an answer */
+#define CLOCK_GRANULARITY 1000 /* microseconds */
+#define MAX_BACKOFF 16
+
+/* Failures are averaged with the same weight as round trip times, so one
+ * timeout makes a server fail 1/8 of the time. Every PROBE_INTERVAL'th
+ * query goes to a server other than the best, so that we notice when they
+ * get better. */
+#define LOSS_SCALE 1000000L
+#define PROBE_INTERVAL 32
+
+/* With ARES_OPT_HEDGE, the hedging delay is worked out again every
+ * HEDGE_INTERVAL samples, once there are that many. Each query earns its
+ * share of a hedge, and at most HEDGE_BURST hedges can be saved up. */
+#define HEDGE_INTERVAL 16
+#define HEDGE_BURST 10
+
+/* Returns the estimate for the server or destination the query was last
+ * sent to. A destination that isn't in the cache gets an entry if create
+ * is set, taking over the slot of any other; otherwise it has none.
+ */
+struct rtt_estimate *ares__query_rtt(ares_channel channel,
+                                     struct query *query, int create)
+{
+  struct dest_rtt *entry;
+  int i;
+
+  if (!query->has_dest)
+    return &channel->servers[query->server].rtt;
+
+  if (!channel->dest_rtts)
+    {
+      if (!create)
+        return NULL;
+      channel->dest_rtts =
+        ares_malloc(ARES_DEST_RTT_SIZE * sizeof(struct dest_rtt));
+      if (!channel->dest_rtts)
+        return NULL;
+      for (i = 0; i < ARES_DEST_RTT_SIZE; i++)
+        channel->dest_rtts[i].dest.family = 0;
+    }
+
+  entry = &channel->dest_rtts[ares__hash_dest(&query->dest, 0) &
+                              (ARES_DEST_RTT_SIZE - 1)];
+  if (entry->dest.family && ares__same_dest(&entry->dest, &query->dest))
+    return &entry->rtt;
+  if (!create)
+    return NULL;
+  entry->dest = query->dest;
+  memset(&entry->rtt, 0, sizeof(entry->rtt));
+  return &entry->rtt;
+}
+
+void ares__destroy_dest_rtts(ares_channel channel)
+{
+  if (channel->dest_rtts)
+    ares_free(channel->dest_rtts);
+  channel->dest_rtts = NULL;
+}
+
+/* Updates an estimate with a measured round trip time. */
+void ares__rtt_sample(struct rtt_estimate *rtt, long usec)
+{
+  long delta;
+
+  if (usec < 0)
+    usec = 0;
+  if (!rtt->srtt)
+    {
+      rtt->srtt = usec ? usec : 1;
+      rtt->rttvar = usec / 2;
+    }
+  else
+    {
+      /* RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R */
+      delta = rtt->srtt - usec;
+      if (delta < 0)
+        delta = -delta;
+      rtt->rttvar += (delta - rtt->rttvar) / 4;
+      rtt->srtt += (usec - rtt->srtt) / 8;
+      if (rtt->srtt < 1)
+        rtt->srtt = 1;
+    }
+  rtt->backoff = 0;
+}
+
+static void add_outcome(struct rtt_estimate *rtt, int failed)
+{
+  rtt->loss += ((failed ? LOSS_SCALE : 0) - rtt->loss) / 8;
+}
+
+/* Notes that a query to the server timed out, so it gets longer to answer
+ * the next one. */
+void ares__rtt_timed_out(struct rtt_estimate *rtt)
+{
+  if (rtt->backoff < MAX_BACKOFF)
+    rtt->backoff++;
+  add_outcome(rtt, 1);
+}
+
+/* Notes that the server answered, refusing to if failed is set. */
+void ares__rtt_answered(struct rtt_estimate *rtt, int failed)
+{
+  add_outcome(rtt, failed);
+}
+
+/* Returns how long, in microseconds, we expect to wait on average for an
+ * answer from the server: its round trip time, plus the timeout for the
+ * share of queries that fail. A server we know nothing about costs
+ * nothing, so it gets tried. */
+static long server_cost(ares_channel channel, struct server_state *server)
+{
+  return server->rtt.srtt + (server->rtt.loss / 1000) * channel->timeout;
+}
+
+/* Chooses the server to send a new query to: the one expected to answer
+ * soonest, or now and then one of the others, in turn. */
+int ares__choose_server(ares_channel channel)
+{
+  struct server_state *server;
+  long cost, best_cost = 0;
+  int i, best = -1;
+
+  if (channel->nservers == 1)
+    return 0;
+
+  for (i = 0; i < channel->nservers; i++)
+    {
+      server = &channel->servers[i];
+      if (server->is_broken)
+        continue;
+      cost = server_cost(channel, server);
+      if (best == -1 || cost < best_cost)
+        {
+          best = i;
+          best_cost = cost;
+        }
+    }
+  if (best == -1)
+    best = 0;
+
+  /* The probe skips broken servers too, and if there's no other server
+   * that isn't, the best one is all there is. */
+  if (++channel->server_choices % PROBE_INTERVAL == 0)
+    {
+      for (i = 1; i <= channel->nservers; i++)
+        {
+          int next = (channel->last_server + i) % channel->nservers;
+          if (next != best && !channel->servers[next].is_broken)
+            {
+              channel->last_server = next;
+              return next;
+            }
+        }
+    }
+  return best;
+}
+
+/* Returns how many milliseconds to wait for an answer, given the estimate
+ * (or NULL if there is none) and how many times the query itself has gone
+ * around all the servers. */
+int ares__rtt_timeout(ares_channel channel, const struct rtt_estimate *rtt,
+                      int shift)
+{
+  long timeout;
+  long var;
+
+  if (rtt && rtt->srtt)
+    {
+      /* RTO = SRTT + max(G, 4 * RTTVAR) */
+      var = 4 * rtt->rttvar;
+      if (var < CLOCK_GRANULARITY)
+        var = CLOCK_GRANULARITY;
+      timeout = (rtt->srtt + var + 999) / 1000;
+    }
+  else
+    timeout = channel->timeout;
+
+  if (rtt && rtt->backoff > shift)
+    shift = rtt->backoff;
+  while (shift-- > 0 && timeout < channel->timeout_max)
+    timeout *= 2;
+
+  if (timeout < channel->timeout_min)
+    timeout = channel->timeout_min;
+  if (timeout > channel->timeout_max)
+    timeout = channel->timeout_max;
+  return (int)timeout;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Records the round trip time of a query to one of the servers, for
+ * working out when to hedge. */
+void ares__hedge_sample(ares_channel channel, long usec)
+{
+  long sorted[ARES_HEDGE_SAMPLES];
+  unsigned int n;
+
+  channel->hedge_samples[channel->hedge_nsamples % ARES_HEDGE_SAMPLES] =
+    usec > 0 ? usec : 1;
+  if (++channel->hedge_nsamples % HEDGE_INTERVAL)
+    return;
+
+  n = channel->hedge_nsamples;
+  if (n > ARES_HEDGE_SAMPLES)
+    n = ARES_HEDGE_SAMPLES;
+  memcpy(sorted, channel->hedge_samples, n * sizeof(long));
+  qsort(sorted, n, sizeof(long), compare_samples);
+  channel->hedge_delay = sorted[n * channel->hedge_percentile / 100];
+}
+
+/* Returns how many milliseconds a new query waits for its first server
+ * before it's sent to a second one too, or 0 if it isn't to be, and adds
+ * the query's share to the budget for hedging. */
+int ares__hedge_delay(ares_channel channel)
+{
+  channel->hedge_tokens += channel->hedge_budget;
+  if (channel->hedge_tokens > HEDGE_BURST * 100)
+    channel->hedge_tokens = HEDGE_BURST * 100;
+  return (int)((channel->hedge_delay + 999) / 1000);
+}
+
+/* Returns whether the budget allows a query to be hedged, taking its cost
+ * from the budget if so. */
+int ares__take_hedge(ares_channel channel)
+{
+  if (channel->hedge_tokens < 100)
+    return 0;
+  channel->hedge_tokens -= 100;
+  return 1;
+}
@@ -0,0 +1,180 @@
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Routines for managing the channel's table of open sockets, which maps a
+ * socket to the server (or shared UDP socket) it belongs to, so that a ready
+ * socket can be dispatched without looking through all the servers. It is
+ * an open-addressing hash table with linear probing; free slots have an fd
+ * of ARES_SOCKET_BAD. The table is kept at most half full.
+ *
+ * Each entry also remembers the interest last reported for it by
+ * ares_get_socket_events(). A closed socket whose interest was reported is
+ * kept on a separate list until its removal has been reported too.
+ */
+
+#define INITIAL_TABLE_SIZE 16
+
+static int slot_of(const ares_channel channel, ares_socket_t fd)
+{
+  /* Sockets are usually small consecutive integers, which multiplying by
+   * an odd constant spreads over the whole table. */
+  return (int)(((unsigned int)fd * 2654435761U) &
+               (unsigned int)(channel->sockets_alloc - 1));
+}
+
+static int resize_socket_table(ares_channel channel, int alloc)
+{
+  struct ares_socket_entry *old = channel->sockets;
+  int old_alloc = channel->sockets_alloc;
+  struct ares_socket_entry *table;
+  int i, j;
+
+  table = ares_malloc(alloc * sizeof(struct ares_socket_entry));
+  if (!table)
+    return ARES_ENOMEM;
+  for (i = 0; i < alloc; i++)
+    table[i].fd = ARES_SOCKET_BAD;
+
+  channel->sockets = table;
+  channel->sockets_alloc = alloc;
+  for (i = 0; i < old_alloc; i++)
+    {
+      if (old[i].fd == ARES_SOCKET_BAD)
+        continue;
+      for (j = slot_of(channel, old[i].fd); table[j].fd != ARES_SOCKET_BAD;
+           j = (j + 1) & (alloc - 1))
+        ;
+      table[j] = old[i];
+    }
+  if (old)
+    ares_free(old);
+  return ARES_SUCCESS;
+}
+
+void ares__destroy_socket_table(ares_channel channel)
+{
+  if (channel->sockets)
+    ares_free(channel->sockets);
+  channel->sockets = NULL;
+  channel->nsockets = 0;
+  channel->sockets_alloc = 0;
+  if (channel->closed_sockets)
+    ares_free(channel->closed_sockets);
+  channel->closed_sockets = NULL;
+  channel->nclosed_sockets = 0;
+  channel->closed_sockets_alloc = 0;
+}
+
+/* Returns the entry for the given socket, or NULL if it isn't one of the
+ * channel's sockets.
+ */
+struct ares_socket_entry *ares__find_socket(ares_channel channel,
+                                            ares_socket_t fd)
+{
+  int i;
+
+  if (!channel->nsockets || fd == ARES_SOCKET_BAD)
+    return NULL;
+  for (i = slot_of(channel, fd); channel->sockets[i].fd != ARES_SOCKET_BAD;
+       i = (i + 1) & (channel->sockets_alloc - 1))
+    {
+      if (channel->sockets[i].fd == fd)
+        return &channel->sockets[i];
+    }
+  return NULL;
+}
+
+/* Records a newly opened socket. kind is one of the ARES_SOCKET_* values,
+ * and index is the socket's server, or its position in the channel's pool of
+ * shared UDP sockets.
+ */
+int ares__add_socket(ares_channel channel, ares_socket_t fd, int kind,
+                     int index)
+{
+  int i;
+
+  if ((channel->nsockets + 1) * 2 > channel->sockets_alloc)
+    {
+      int status = resize_socket_table(channel, channel->sockets_alloc ?
+                                       channel->sockets_alloc * 2 :
+                                       INITIAL_TABLE_SIZE);
+      if (status != ARES_SUCCESS)
+        return status;
+    }
+
+  for (i = slot_of(channel, fd); channel->sockets[i].fd != ARES_SOCKET_BAD;
+       i = (i + 1) & (channel->sockets_alloc - 1))
+    ;
+  channel->sockets[i].fd = fd;
+  channel->sockets[i].kind = kind;
+  channel->sockets[i].index = index;
+  channel->sockets[i].reported = 0;
+  channel->nsockets++;
+  return ARES_SUCCESS;
+}
+
+/* Forgets a socket that is about to be closed. */
+void ares__remove_socket(ares_channel channel, ares_socket_t fd)
+{
+  struct ares_socket_entry *entry = ares__find_socket(channel, fd);
+  int mask = channel->sockets_alloc - 1;
+  int hole, i, home;
+
+  if (!entry)
+    return;
+
+  /* Remember to tell the application to stop watching the socket. If
+   * there's no memory for that, the socket being closed will still
+   * take it out of most event loops. */
+  if (entry->reported)
+    {
+      if (channel->nclosed_sockets == channel->closed_sockets_alloc)
+        {
+          int alloc = channel->closed_sockets_alloc ?
+            channel->closed_sockets_alloc * 2 : INITIAL_TABLE_SIZE;
+          ares_socket_t *closed =
+            ares_realloc(channel->closed_sockets,
+                         alloc * sizeof(ares_socket_t));
+          if (closed)
+            {
+              channel->closed_sockets = closed;
+              channel->closed_sockets_alloc = alloc;
+            }
+        }
+      if (channel->nclosed_sockets < channel->closed_sockets_alloc)
+        channel->closed_sockets[channel->nclosed_sockets++] = fd;
+    }
+
+  /* Shift later entries of the same probe run back into the hole, so that
+   * lookups never stop early at a free slot. */
+  hole = (int)(entry - channel->sockets);
+  channel->sockets[hole].fd = ARES_SOCKET_BAD;
+  for (i = (hole + 1) & mask; channel->sockets[i].fd != ARES_SOCKET_BAD;
+       i = (i + 1) & mask)
+    {
+      home = slot_of(channel, channel->sockets[i].fd);
+      /* Leave the entry alone if its home slot lies cyclically in
+       * (hole, i]. */
+      if (((i - home) & mask) < ((i - hole) & mask))
+        continue;
+      channel->sockets[hole] = channel->sockets[i];
+      channel->sockets[i].fd = ARES_SOCKET_BAD;
+      hole = i;
+    }
+  channel->nsockets--;
+}
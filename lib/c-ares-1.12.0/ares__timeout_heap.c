@@ -0,0 +1,146 @@
+
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+#include "ares.h"
+#include "ares_private.h"
+
+/* Routines for managing the channel's binary min-heap of query timeouts.
+ * The query that times out first is always at the top, so finding the next
+ * deadline is O(1), and adding, moving or removing a query is O(log n). Each
+ * query remembers its position in the heap in query->timeout_index (-1 when
+ * it isn't in the heap), so it can be moved or removed without a search.
+ */
+
+#define INITIAL_HEAP_SIZE 64
+
+/* return true if query a times out before query b */
+static int earlier(const struct query *a, const struct query *b)
+{
+  if (a->timeout.tv_sec != b->timeout.tv_sec)
+    return a->timeout.tv_sec < b->timeout.tv_sec;
+  return a->timeout.tv_usec < b->timeout.tv_usec;
+}
+
+static void place(ares_channel channel, int index, struct query *query)
+{
+  channel->timeouts[index] = query;
+  query->timeout_index = index;
+}
+
+static void sift_up(ares_channel channel, int index)
+{
+  struct query *query = channel->timeouts[index];
+  int parent;
+
+  while (index > 0)
+    {
+      parent = (index - 1) / 2;
+      if (!earlier(query, channel->timeouts[parent]))
+        break;
+      place(channel, index, channel->timeouts[parent]);
+      index = parent;
+    }
+  place(channel, index, query);
+}
+
+static void sift_down(ares_channel channel, int index)
+{
+  struct query *query = channel->timeouts[index];
+  int child;
+
+  for (;;)
+    {
+      child = 2 * index + 1;
+      if (child >= channel->ntimeouts)
+        break;
+      if (child + 1 < channel->ntimeouts &&
+          earlier(channel->timeouts[child + 1], channel->timeouts[child]))
+        child++;
+      if (!earlier(channel->timeouts[child], query))
+        break;
+      place(channel, index, channel->timeouts[child]);
+      index = child;
+    }
+  place(channel, index, query);
+}
+
+void ares__destroy_timeout_heap(ares_channel channel)
+{
+  if (channel->timeouts)
+    ares_free(channel->timeouts);
+  channel->timeouts = NULL;
+  channel->ntimeouts = 0;
+  channel->timeouts_alloc = 0;
+}
+
+/* Returns the query that times out first, or NULL if no query has a
+ * timeout.
+ */
+struct query *ares__next_timeout(ares_channel channel)
+{
+  return channel->ntimeouts ? channel->timeouts[0] : NULL;
+}
+
+/* Puts the query into the heap according to its (new) query->timeout, or
+ * moves it if it's there already.
+ */
+int ares__set_timeout(ares_channel channel, struct query *query)
+{
+  struct query **timeouts;
+  int alloc;
+
+  if (query->timeout_index >= 0)
+    {
+      sift_up(channel, query->timeout_index);
+      sift_down(channel, query->timeout_index);
+      return ARES_SUCCESS;
+    }
+
+  if (channel->ntimeouts == channel->timeouts_alloc)
+    {
+      alloc = channel->timeouts_alloc ? channel->timeouts_alloc * 2
+                                      : INITIAL_HEAP_SIZE;
+      timeouts = ares_realloc(channel->timeouts,
+                              alloc * sizeof(struct query *));
+      if (!timeouts)
+        return ARES_ENOMEM;
+      channel->timeouts = timeouts;
+      channel->timeouts_alloc = alloc;
+    }
+
+  place(channel, channel->ntimeouts++, query);
+  sift_up(channel, query->timeout_index);
+  return ARES_SUCCESS;
+}
+
+/* Removes the query from the heap, if it's there */
+void ares__remove_timeout(ares_channel channel, struct query *query)
+{
+  int index = query->timeout_index;
+  struct query *last;
+
+  if (index < 0)
+    return;
+  query->timeout_index = -1;
+  if (--channel->ntimeouts == index)
+    return;
+
+  /* Fill the hole with the last entry and restore the heap order */
+  last = channel->timeouts[channel->ntimeouts];
+  place(channel, index, last);
+  sift_up(channel, index);
+  sift_down(channel, last->timeout_index);
+}
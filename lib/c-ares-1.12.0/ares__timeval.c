@@ -95,6 +95,34 @@ struct timeval ares__tvnow(void)
 
 #endif
 
+/*
+ * Wall clock time, to nanoseconds where the system can tell. This is the
+ * clock the kernel timestamps received datagrams with, so the two can be
+ * compared.
+ */
+void ares__timestamp_now(struct ares_timestamp *ts)
+{
+#if defined(HAVE_CLOCK_GETTIME_MONOTONIC) && defined(CLOCK_REALTIME)
+  struct timespec tsnow;
+  if(0 == clock_gettime(CLOCK_REALTIME, &tsnow)) {
+    ts->sec = tsnow.tv_sec;
+    ts->nsec = tsnow.tv_nsec;
+    return;
+  }
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+  {
+    struct timeval now;
+    (void)gettimeofday(&now, NULL);
+    ts->sec = now.tv_sec;
+    ts->nsec = (long)now.tv_usec * 1000;
+  }
+#else
+  ts->sec = time(NULL);
+  ts->nsec = 0;
+#endif
+}
+
 #if 0 /* Not used */
 /*
  * Make sure that the first argument is the more recent time, as otherwise
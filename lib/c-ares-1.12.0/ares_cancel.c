@@ -44,12 +44,16 @@ void ares_cancel(ares_channel channel)
     list_head_copy.next->prev = &list_head_copy;
     list_head->prev = list_head;
     list_head->next = list_head;
+    /* Nor will new queries wait on the ones being cancelled. */
+    for (list_node = list_head_copy.next; list_node != &list_head_copy;
+         list_node = list_node->next)
+      ares__remove_coalescable(channel, list_node->data);
     for (list_node = list_head_copy.next; list_node != &list_head_copy; )
     {
       query = list_node->data;
       list_node = list_node->next;  /* since we're deleting the query */
-      query->callback(query->arg, ARES_ECANCELLED, 0, NULL, 0);
-      ares__free_query(query);
+      ares__query_callback(channel, query, ARES_ECANCELLED, 0, NULL, 0);
+      ares__free_query(channel, query);
     }
   }
   if (!(channel->flags & ARES_FLAG_STAYOPEN) && ares__is_list_empty(&(channel->all_queries)))
@@ -59,5 +63,6 @@ void ares_cancel(ares_channel channel)
       for (i = 0; i < channel->nservers; i++)
         ares__close_sockets(channel, &channel->servers[i]);
     }
+    ares__close_udp_pool(channel);
   }
 }
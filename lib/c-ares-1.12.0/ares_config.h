@@ -209,9 +209,15 @@
 /* Define to 1 if you have the recvfrom function. */
 #define HAVE_RECVFROM 1
 
+/* Define to 1 if you have the `recvmmsg' function. */
+#define HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the send function. */
 #define HAVE_SEND 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#define HAVE_SENDMMSG 1
+
 /* Define to 1 if you have the setsockopt function. */
 #define HAVE_SETSOCKOPT 1
 
@@ -48,13 +48,17 @@ void ares_destroy(ares_channel channel)
   if (!channel)
     return;
 
+  /* The channel is the I/O thread's until it stops. */
+  if (channel->io_thread)
+    ares_thread_stop(channel);
+
   list_head = &(channel->all_queries);
   for (list_node = list_head->next; list_node != list_head; )
     {
       query = list_node->data;
       list_node = list_node->next;  /* since we're deleting the query */
-      query->callback(query->arg, ARES_EDESTRUCTION, 0, NULL, 0);
-      ares__free_query(query);
+      ares__query_callback(channel, query, ARES_EDESTRUCTION, 0, NULL, 0);
+      ares__free_query(channel, query);
     }
 #ifndef NDEBUG
   /* Freeing the query should remove it from all the lists in which it sits,
@@ -63,15 +67,14 @@ void ares_destroy(ares_channel channel)
   assert(ares__is_list_empty(&(channel->all_queries)));
   for (i = 0; i < ARES_QID_TABLE_SIZE; i++)
     {
-      assert(ares__is_list_empty(&(channel->queries_by_qid[i])));
-    }
-  for (i = 0; i < ARES_TIMEOUT_TABLE_SIZE; i++)
-    {
-      assert(ares__is_list_empty(&(channel->queries_by_timeout[i])));
+      assert(channel->queries_by_qid[i] == NULL);
     }
+  assert(channel->ndest_queries == 0);
+  assert(channel->ntimeouts == 0);
 #endif
 
   ares__destroy_servers_state(channel);
+  ares__close_udp_pool(channel);
 
   if (channel->domains) {
     for (i = 0; i < channel->ndomains; i++)
@@ -85,6 +88,17 @@ void ares_destroy(ares_channel channel)
   if (channel->lookups)
     ares_free(channel->lookups);
 
+  ares__destroy_qid_table(channel);
+  ares__destroy_timeout_heap(channel);
+  ares__destroy_socket_table(channel);
+
+  if (channel->udp_batch_bufs)
+    ares_free(channel->udp_batch_bufs);
+  if (channel->completions)
+    ares_free(channel->completions);
+  ares__destroy_dest_rtts(channel);
+  ares__destroy_cache(channel);
+
   ares_free(channel);
 }
 
@@ -203,3 +203,103 @@ int ares__expand_name_for_response(const unsigned char *encoded,
     status = ARES_EBADRESP;
   return status;
 }
+
+/* Find the label at *encoded, following any indirection pointers in place.
+ * On success *encoded points at the label's length byte, which is returned.
+ * Returns -1 if the encoding is invalid or an indirection loop is detected
+ * (*indir counts the pointers followed so far).
+ */
+static int next_label(const unsigned char **encoded,
+                      const unsigned char *abuf, int alen, int *indir)
+{
+  const unsigned char *p = *encoded;
+  int offset;
+
+  for (;;)
+    {
+      if (p >= abuf + alen)
+        return -1;
+      switch (*p & INDIR_MASK)
+        {
+        case INDIR_MASK:
+          if (p + 1 >= abuf + alen)
+            return -1;
+          offset = (*p & ~INDIR_MASK) << 8 | *(p + 1);
+          if (offset >= alen || ++(*indir) > alen)
+            return -1;
+          p = abuf + offset;
+          break;
+        case 0x00:
+          if (*p && p + *p + 1 >= abuf + alen)
+            return -1;
+          *encoded = p;
+          return *p;
+        default:
+          return -1;
+        }
+    }
+}
+
+#define NAME_TOLOWER(c) \
+  ((unsigned char)(((c) >= 'A' && (c) <= 'Z') ? (c) - 'A' + 'a' : (c)))
+
+/* Hash an RFC1035-encoded domain name without expanding it.  The hash
+ * ignores ASCII case, so names that ares__name_equal() considers equal hash
+ * to the same value.  *enclen is set the same way ares_expand_name() sets
+ * it.  Returns ARES_EBADNAME if the encoding is invalid.
+ */
+int ares__name_hash(const unsigned char *encoded, const unsigned char *abuf,
+                    int alen, unsigned int *hash, long *enclen)
+{
+  const unsigned char *p = encoded;
+  unsigned int h = 2166136261U; /* FNV-1a */
+  int len, indir = 0;
+
+  *enclen = -1;
+  for (;;)
+    {
+      const unsigned char *label = p;
+      len = next_label(&label, abuf, alen, &indir);
+      if (len < 0)
+        return ARES_EBADNAME;
+      if (label != p && *enclen < 0)
+        *enclen = aresx_uztosl(p + 2U - encoded);
+      if (len == 0)
+        break;
+      h = (h ^ (unsigned int)len) * 16777619U;
+      for (p = label + 1; p <= label + len; p++)
+        h = (h ^ NAME_TOLOWER(*p)) * 16777619U;
+    }
+  if (*enclen < 0)
+    *enclen = aresx_uztosl(p + 1U - encoded);
+  *hash = h;
+  return ARES_SUCCESS;
+}
+
+/* Compare two RFC1035-encoded domain names, each given with its containing
+ * message, label by label and ignoring ASCII case.  Compression pointers are
+ * followed in place, so nothing is allocated.  Returns 1 if the names are
+ * equal and 0 if they differ or either one is invalid.
+ */
+int ares__name_equal(const unsigned char *name1, const unsigned char *buf1,
+                     int len1, const unsigned char *name2,
+                     const unsigned char *buf2, int len2)
+{
+  int indir1 = 0, indir2 = 0, len, i;
+
+  for (;;)
+    {
+      len = next_label(&name1, buf1, len1, &indir1);
+      if (len < 0 || next_label(&name2, buf2, len2, &indir2) != len)
+        return 0;
+      if (len == 0)
+        return 1;
+      for (i = 1; i <= len; i++)
+        {
+          if (NAME_TOLOWER(name1[i]) != NAME_TOLOWER(name2[i]))
+            return 0;
+        }
+      name1 += len + 1;
+      name2 += len + 1;
+    }
+}
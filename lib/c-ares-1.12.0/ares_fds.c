@@ -23,8 +23,10 @@
 int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
 {
   struct server_state *server;
+  struct tcp_connection *conn;
   ares_socket_t nfds;
-  int i;
+  ares_socket_t s;
+  int i, j;
 
   /* Are there any active queries? */
   int active_queries = !ares__is_list_empty(&(channel->all_queries));
@@ -39,6 +41,9 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
       if (active_queries && server->udp_socket != ARES_SOCKET_BAD)
         {
           FD_SET(server->udp_socket, read_fds);
+          /* Queries are waiting for room in the send buffer */
+          if (!ares__is_list_empty(&server->udp_pending))
+            FD_SET(server->udp_socket, write_fds);
           if (server->udp_socket >= nfds)
             nfds = server->udp_socket + 1;
         }
@@ -46,14 +51,30 @@ int ares_fds(ares_channel channel, fd_set *read_fds, fd_set *write_fds)
        * when the other side closes the connection, so we don't waste
        * time trying to use a broken connection.
        */
-      if (server->tcp_socket != ARES_SOCKET_BAD)
+      for (j = 0; j < channel->tcp_conns; j++)
        {
-         FD_SET(server->tcp_socket, read_fds);
-         if (server->qhead)
-           FD_SET(server->tcp_socket, write_fds);
-         if (server->tcp_socket >= nfds)
-           nfds = server->tcp_socket + 1;
-	}
+         conn = &server->tcp[j];
+         if (conn->socket == ARES_SOCKET_BAD)
+           continue;
+         FD_SET(conn->socket, read_fds);
+         if (conn->qhead)
+           FD_SET(conn->socket, write_fds);
+         if (conn->socket >= nfds)
+           nfds = conn->socket + 1;
+       }
+    }
+  /* The same goes for the sockets shared by ares_send_to() queries. */
+  for (i = 0; active_queries && i < 2 * ARES_UDP_POOL_SIZE; i++)
+    {
+      s = *ARES_POOL_SOCKET(channel, i);
+      if (s != ARES_SOCKET_BAD)
+        {
+          FD_SET(s, read_fds);
+          if (!ares__is_list_empty(ARES_POOL_PENDING(channel, i)))
+            FD_SET(s, write_fds);
+          if (s >= nfds)
+            nfds = s + 1;
+        }
     }
   return (int)nfds;
 }
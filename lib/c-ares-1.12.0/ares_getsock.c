@@ -22,7 +22,8 @@ int ares_getsock(ares_channel channel,
                  int numsocks) /* size of the 'socks' array */
 {
   struct server_state *server;
-  int i;
+  struct tcp_connection *conn;
+  int i, j;
   int sockindex=0;
   int bitmap = 0;
   unsigned int setbits = 0xffffffff;
@@ -42,25 +43,98 @@ int ares_getsock(ares_channel channel,
             break;
           socks[sockindex] = server->udp_socket;
           bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
+          if (!ares__is_list_empty(&server->udp_pending))
+            /* queries are waiting for room in the send buffer */
+            bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
           sockindex++;
         }
       /* We always register for TCP events, because we want to know
        * when the other side closes the connection, so we don't waste
        * time trying to use a broken connection.
        */
-      if (server->tcp_socket != ARES_SOCKET_BAD)
+      for (j = 0; j < channel->tcp_conns; j++)
        {
+         conn = &server->tcp[j];
+         if (conn->socket == ARES_SOCKET_BAD)
+           continue;
          if(sockindex >= numsocks || sockindex >= ARES_GETSOCK_MAXNUM)
-           break;
-         socks[sockindex] = server->tcp_socket;
+           return bitmap;
+         socks[sockindex] = conn->socket;
          bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
 
-         if (server->qhead && active_queries)
+         if (conn->qhead && active_queries)
            /* then the tcp socket is also writable! */
            bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
 
          sockindex++;
        }
     }
+  /* The same goes for the sockets shared by ares_send_to() queries. */
+  for (i = 0; active_queries && i < 2 * ARES_UDP_POOL_SIZE; i++)
+    {
+      ares_socket_t s = *ARES_POOL_SOCKET(channel, i);
+      if (s == ARES_SOCKET_BAD)
+        continue;
+      if(sockindex >= numsocks || sockindex >= ARES_GETSOCK_MAXNUM)
+        break;
+      socks[sockindex] = s;
+      bitmap |= ARES_GETSOCK_READABLE(setbits, sockindex);
+      if (!ares__is_list_empty(ARES_POOL_PENDING(channel, i)))
+        bitmap |= ARES_GETSOCK_WRITABLE(setbits, sockindex);
+      sockindex++;
+    }
   return bitmap;
 }
+
+/* The events the channel wants for the socket: every socket is watched for
+ * reading while it's open, and for writing while it has data queued.
+ */
+static int socket_interest(ares_channel channel,
+                           const struct ares_socket_entry *entry)
+{
+  int events = ARES_SOCKET_EVENT_READ;
+
+  if (entry->kind == ARES_SOCKET_TCP &&
+      ARES_TCP_CONN(channel, entry->index)->qhead)
+    events |= ARES_SOCKET_EVENT_WRITE;
+  else if (entry->kind == ARES_SOCKET_UDP &&
+           !ares__is_list_empty(&channel->servers[entry->index].udp_pending))
+    events |= ARES_SOCKET_EVENT_WRITE;
+  else if (entry->kind == ARES_SOCKET_POOL &&
+           !ares__is_list_empty(ARES_POOL_PENDING(channel, entry->index)))
+    events |= ARES_SOCKET_EVENT_WRITE;
+  return events;
+}
+
+int ares_get_socket_events(ares_channel channel,
+                           struct ares_socket_event *events,
+                           int nevents)
+{
+  struct ares_socket_entry *entry;
+  int n = 0;
+  int i, interest;
+
+  /* Closed sockets go first, so that a new socket reusing the same fd is
+   * reported after the old one is gone. */
+  while (n < nevents && channel->nclosed_sockets > 0)
+    {
+      events[n].fd = channel->closed_sockets[--channel->nclosed_sockets];
+      events[n].events = 0;
+      n++;
+    }
+
+  for (i = 0; i < channel->sockets_alloc && n < nevents; i++)
+    {
+      entry = &channel->sockets[i];
+      if (entry->fd == ARES_SOCKET_BAD)
+        continue;
+      interest = socket_interest(channel, entry);
+      if (interest == entry->reported)
+        continue;
+      events[n].fd = entry->fd;
+      events[n].events = interest;
+      entry->reported = interest;
+      n++;
+    }
+  return n;
+}
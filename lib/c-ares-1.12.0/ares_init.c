@@ -112,7 +112,6 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
   ares_channel channel;
   int i;
   int status = ARES_SUCCESS;
-  struct timeval now;
 
 #ifdef CURLDEBUG
   const char *env = getenv("CARES_MEMDEBUG");
@@ -137,8 +136,6 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
     return ARES_ENOMEM;
   }
 
-  now = ares__tvnow();
-
   /* Set everything to distinguished values so we know they haven't
    * been set yet.
    */
@@ -150,6 +147,12 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
   channel->udp_port = -1;
   channel->tcp_port = -1;
   channel->ednspsz = -1;
+  channel->tcp_conns = -1;
+  channel->timeout_min = -1;
+  channel->timeout_max = -1;
+  channel->hedge_percentile = -1;
+  channel->hedge_budget = -1;
+  channel->cache_size = -1;
   channel->socket_send_buffer_size = -1;
   channel->socket_receive_buffer_size = -1;
   channel->nservers = -1;
@@ -160,6 +163,11 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
   channel->domains = NULL;
   channel->sortlist = NULL;
   channel->servers = NULL;
+  channel->queries_by_qid = NULL;
+  channel->queries_by_dest = NULL;
+  channel->dest_buckets = 0;
+  channel->queries_by_question = NULL;
+  channel->ndest_queries = 0;
   channel->sock_state_cb = NULL;
   channel->sock_state_cb_data = NULL;
   channel->sock_create_cb = NULL;
@@ -168,7 +176,41 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
   channel->sock_config_cb_data = NULL;
 
   channel->last_server = 0;
-  channel->last_timeout_processed = (time_t)now.tv_sec;
+  channel->server_choices = 0;
+  channel->hedge_nsamples = 0;
+  channel->hedge_delay = 0;
+  channel->hedge_tokens = 0;
+  channel->cache_buckets = NULL;
+  channel->cache_nbuckets = 0;
+  ares__init_list_head(&channel->cache_lru);
+  channel->cache_used = 0;
+  channel->timeouts = NULL;
+  channel->ntimeouts = 0;
+  channel->timeouts_alloc = 0;
+  for (i = 0; i < ARES_UDP_POOL_SIZE; i++)
+    {
+      channel->udp_pool[0][i] = ARES_SOCKET_BAD;
+      channel->udp_pool[1][i] = ARES_SOCKET_BAD;
+      ares__init_list_head(&channel->udp_pool_pending[0][i]);
+      ares__init_list_head(&channel->udp_pool_pending[1][i]);
+      channel->udp_pool_drops_seen[0][i] = 0;
+      channel->udp_pool_drops_seen[1][i] = 0;
+    }
+  memset(&channel->stats, 0, sizeof(channel->stats));
+  channel->udp_batch_bufs = NULL;
+  channel->completions = NULL;
+  channel->completions_head = 0;
+  channel->ncompletions = 0;
+  channel->completions_alloc = 0;
+  channel->io_thread = NULL;
+  channel->dest_rtts = NULL;
+  channel->udp_pool_next = 0;
+  channel->sockets = NULL;
+  channel->nsockets = 0;
+  channel->sockets_alloc = 0;
+  channel->closed_sockets = NULL;
+  channel->nclosed_sockets = 0;
+  channel->closed_sockets_alloc = 0;
 
   memset(&channel->local_dev_name, 0, sizeof(channel->local_dev_name));
   channel->local_ip4 = 0;
@@ -176,14 +218,9 @@ int ares_init_options(ares_channel *channelptr, struct ares_options *options,
 
   /* Initialize our lists of queries */
   ares__init_list_head(&(channel->all_queries));
-  for (i = 0; i < ARES_QID_TABLE_SIZE; i++)
-    {
-      ares__init_list_head(&(channel->queries_by_qid[i]));
-    }
-  for (i = 0; i < ARES_TIMEOUT_TABLE_SIZE; i++)
-    {
-      ares__init_list_head(&(channel->queries_by_timeout[i]));
-    }
+  status = ares__init_qid_table(channel);
+  if (status != ARES_SUCCESS)
+    goto done;
 
   /* Initialize configuration by each of the four sources, from highest
    * precedence to lowest.
@@ -243,6 +280,7 @@ done:
         ares_free(channel->sortlist);
       if(channel->lookups)
         ares_free(channel->lookups);
+      ares__destroy_qid_table(channel);
       ares_free(channel);
       return status;
     }
@@ -346,8 +384,13 @@ int ares_save_options(ares_channel channel, struct ares_options *options,
   (*optmask) = (ARES_OPT_FLAGS|ARES_OPT_TRIES|ARES_OPT_NDOTS|
                 ARES_OPT_UDP_PORT|ARES_OPT_TCP_PORT|ARES_OPT_SOCK_STATE_CB|
                 ARES_OPT_SERVERS|ARES_OPT_DOMAINS|ARES_OPT_LOOKUPS|
-                ARES_OPT_SORTLIST|ARES_OPT_TIMEOUTMS);
+                ARES_OPT_SORTLIST|ARES_OPT_TIMEOUTMS|ARES_OPT_TCP_CONNS|
+                ARES_OPT_TIMEOUT_BOUNDS);
   (*optmask) |= (channel->rotate ? ARES_OPT_ROTATE : ARES_OPT_NOROTATE);
+  if (channel->hedge_percentile)
+    (*optmask) |= ARES_OPT_HEDGE;
+  if (channel->cache_size)
+    (*optmask) |= ARES_OPT_CACHE;
 
   /* Copy easy stuff */
   options->flags   = channel->flags;
@@ -361,6 +404,12 @@ int ares_save_options(ares_channel channel, struct ares_options *options,
   options->tcp_port = ntohs(aresx_sitous(channel->tcp_port));
   options->sock_state_cb     = channel->sock_state_cb;
   options->sock_state_cb_data = channel->sock_state_cb_data;
+  options->tcp_conns = channel->tcp_conns;
+  options->timeout_min = channel->timeout_min;
+  options->timeout_max = channel->timeout_max;
+  options->hedge_percentile = channel->hedge_percentile;
+  options->hedge_budget = channel->hedge_budget;
+  options->cache_size = channel->cache_size;
 
   /* Copy IPv4 servers that use the default port */
   if (channel->nservers) {
@@ -463,6 +512,34 @@ static int init_by_options(ares_channel channel,
 
   if ((optmask & ARES_OPT_EDNSPSZ) && channel->ednspsz == -1)
     channel->ednspsz = options->ednspsz;
+  if ((optmask & ARES_OPT_TCP_CONNS) && channel->tcp_conns == -1)
+    {
+      channel->tcp_conns = options->tcp_conns;
+      if (channel->tcp_conns < 1)
+        channel->tcp_conns = 1;
+      else if (channel->tcp_conns > ARES_MAX_TCP_CONNS)
+        channel->tcp_conns = ARES_MAX_TCP_CONNS;
+    }
+  if ((optmask & ARES_OPT_TIMEOUT_BOUNDS) && channel->timeout_min == -1)
+    {
+      channel->timeout_min = options->timeout_min;
+      channel->timeout_max = options->timeout_max;
+      if (channel->timeout_min < 1)
+        channel->timeout_min = 1;
+      if (channel->timeout_max < channel->timeout_min)
+        channel->timeout_max = channel->timeout_min;
+    }
+  if ((optmask & ARES_OPT_HEDGE) && channel->hedge_percentile == -1)
+    {
+      channel->hedge_percentile = options->hedge_percentile;
+      channel->hedge_budget = options->hedge_budget;
+      if (channel->hedge_percentile < 1 || channel->hedge_percentile > 99)
+        channel->hedge_percentile = DEFAULT_HEDGE_PERCENTILE;
+      if (channel->hedge_budget < 1 || channel->hedge_budget > 100)
+        channel->hedge_budget = DEFAULT_HEDGE_BUDGET;
+    }
+  if ((optmask & ARES_OPT_CACHE) && channel->cache_size == -1)
+    channel->cache_size = options->cache_size > 0 ? options->cache_size : 0;
 
   /* Copy the IPv4 servers, if given. */
   if ((optmask & ARES_OPT_SERVERS) && channel->nservers == -1)
@@ -1451,6 +1528,24 @@ static int init_by_defaults(ares_channel channel)
   if (channel->ednspsz == -1)
     channel->ednspsz = EDNSPACKETSZ;
 
+  if (channel->tcp_conns == -1)
+    channel->tcp_conns = 1;
+
+  if (channel->timeout_min == -1)
+    {
+      channel->timeout_min = DEFAULT_TIMEOUT_MIN;
+      channel->timeout_max = DEFAULT_TIMEOUT_MAX;
+    }
+
+  if (channel->hedge_percentile == -1)
+    {
+      channel->hedge_percentile = 0;
+      channel->hedge_budget = 0;
+    }
+
+  if (channel->cache_size == -1)
+    channel->cache_size = 0;
+
   if (channel->nservers == -1) {
     /* If nobody specified servers, try a local named. */
     channel->servers = ares_malloc(sizeof(struct server_state));
@@ -2124,23 +2219,36 @@ int ares_set_sortlist(ares_channel channel, const char *sortstr)
 
 void ares__init_servers_state(ares_channel channel)
 {
-  struct server_state *server;
   int i;
 
   for (i = 0; i < channel->nservers; i++)
+    ares__init_server_state(channel, &channel->servers[i]);
+}
+
+void ares__init_server_state(ares_channel channel,
+                             struct server_state *server)
+{
+  struct tcp_connection *conn;
+  int i;
+
+  server->udp_socket = ARES_SOCKET_BAD;
+  for (i = 0; i < ARES_MAX_TCP_CONNS; i++)
     {
-      server = &channel->servers[i];
-      server->udp_socket = ARES_SOCKET_BAD;
-      server->tcp_socket = ARES_SOCKET_BAD;
-      server->tcp_connection_generation = ++channel->tcp_connection_generation;
-      server->tcp_lenbuf_pos = 0;
-      server->tcp_buffer_pos = 0;
-      server->tcp_buffer = NULL;
-      server->tcp_length = 0;
-      server->qhead = NULL;
-      server->qtail = NULL;
-      ares__init_list_head(&server->queries_to_server);
-      server->channel = channel;
-      server->is_broken = 0;
+      conn = &server->tcp[i];
+      conn->socket = ARES_SOCKET_BAD;
+      conn->buffer = NULL;
+      conn->buffer_len = 0;
+      conn->buffer_alloc = 0;
+      conn->qhead = NULL;
+      conn->qtail = NULL;
+      conn->generation = ++channel->tcp_connection_generation;
     }
+  server->tcp_next = 0;
+  ares__init_list_head(&server->queries_to_server);
+  ares__init_list_head(&server->udp_pending);
+  server->udp_drops_seen = 0;
+  memset(&server->stats, 0, sizeof(server->stats));
+  memset(&server->rtt, 0, sizeof(server->rtt));
+  server->channel = channel;
+  server->is_broken = 0;
 }
@@ -238,6 +238,114 @@ int ares_set_servers_ports(ares_channel channel,
   return ARES_SUCCESS;
 }
 
+/* Point an idle channel at a new set of name servers, keeping everything
+ * else about it: its configuration, its query id key and (with
+ * ARES_REBIND_KEEP_SOCKETS) its UDP sockets, which are reconnected to the
+ * new servers.  Unlike ares_set_servers_ports(), the server state is only
+ * reallocated when the number of servers changes.
+ */
+int ares_rebind_servers(ares_channel channel,
+                        struct ares_addr_port_node *servers, int flags)
+{
+  struct ares_addr_port_node *srvr;
+  struct server_state *server;
+  ares_socket_t udp_socket;
+  unsigned int udp_drops_seen;
+  int num_srvrs = 0;
+  int i;
+
+  if (ares_library_initialized() != ARES_SUCCESS)
+    return ARES_ENOTINITIALIZED;  /* LCOV_EXCL_LINE: n/a on non-WinSock */
+
+  if (!channel)
+    return ARES_ENODATA;
+
+  /* The queries hold per-server state, so only an idle channel can have its
+   * servers swapped.
+   */
+  if (!ares__is_list_empty(&(channel->all_queries)))
+    return ARES_ENOTIMP;
+
+  for (srvr = servers; srvr; srvr = srvr->next)
+    {
+      if (srvr->family != AF_INET && srvr->family != AF_INET6)
+        return ARES_EBADFAMILY;
+      num_srvrs++;
+    }
+  if (num_srvrs == 0)
+    return ARES_ENODATA;
+
+  if (num_srvrs != channel->nservers)
+    {
+      for (i = num_srvrs; i < channel->nservers; i++)
+        ares__close_sockets(channel, &channel->servers[i]);
+      server = ares_realloc(channel->servers,
+                            num_srvrs * sizeof(struct server_state));
+      if (!server)
+        {
+          ares__destroy_servers_state(channel);
+          return ARES_ENOMEM;
+        }
+      channel->servers = server;
+      /* The servers we kept have moved, and their list heads with them.
+       * Those lists are all empty, the channel being idle. */
+      for (i = 0; i < num_srvrs && i < channel->nservers; i++)
+        {
+          ares__init_list_head(&channel->servers[i].queries_to_server);
+          ares__init_list_head(&channel->servers[i].udp_pending);
+        }
+      for (i = (channel->nservers > 0) ? channel->nservers : 0;
+           i < num_srvrs; i++)
+        ares__init_server_state(channel, &channel->servers[i]);
+      channel->nservers = num_srvrs;
+    }
+
+  for (i = 0, srvr = servers; srvr; i++, srvr = srvr->next)
+    {
+      server = &channel->servers[i];
+
+      /* Hold on to the UDP socket if we can reuse it; everything else about
+       * the old server goes.
+       */
+      udp_socket = ARES_SOCKET_BAD;
+      udp_drops_seen = 0;
+      if ((flags & ARES_REBIND_KEEP_SOCKETS) &&
+          server->udp_socket != ARES_SOCKET_BAD &&
+          server->addr.family == srvr->family)
+        {
+          udp_socket = server->udp_socket;
+          udp_drops_seen = server->udp_drops_seen;
+          server->udp_socket = ARES_SOCKET_BAD;
+        }
+      ares__close_sockets(channel, server);
+      ares__init_server_state(channel, server);
+
+      server->addr.family = srvr->family;
+      server->addr.udp_port = htons((unsigned short)srvr->udp_port);
+      server->addr.tcp_port = htons((unsigned short)srvr->tcp_port);
+      if (srvr->family == AF_INET)
+        memcpy(&server->addr.addrV4, &srvr->addrV4, sizeof(srvr->addrV4));
+      else
+        memcpy(&server->addr.addrV6, &srvr->addrV6, sizeof(srvr->addrV6));
+
+      if (udp_socket != ARES_SOCKET_BAD)
+        {
+          server->udp_socket = udp_socket;
+          server->udp_drops_seen = udp_drops_seen;
+          if (ares__connect_udp_socket(channel, server) == -1)
+            {
+              SOCK_STATE_CALLBACK(channel, udp_socket, 0, 0);
+              ares__remove_socket(channel, udp_socket);
+              sclose(udp_socket);
+              server->udp_socket = ARES_SOCKET_BAD;
+            }
+        }
+    }
+
+  channel->last_server = 0;
+  return ARES_SUCCESS;
+}
+
 /* Incomming string format: host[:port][,host[:port]]... */
 /* IPv6 addresses with ports require square brackets [fe80::1%lo0]:53 */
 static int set_servers_csv(ares_channel channel,
@@ -400,3 +508,25 @@ int ares_set_servers_ports_csv(ares_channel channel,
   return set_servers_csv(channel, _csv, TRUE);
 }
 
+
+int ares_get_stats(ares_channel channel, struct ares_stats *stats)
+{
+  if (!channel || !stats)
+    return ARES_ENODATA;
+
+  *stats = channel->stats;
+  return ARES_SUCCESS;
+}
+
+int ares_get_server_stats(ares_channel channel, int server,
+                          struct ares_server_stats *stats)
+{
+  if (!channel || !stats || server < 0 || server >= channel->nservers)
+    return ARES_ENODATA;
+
+  *stats = channel->servers[server].stats;
+  stats->srtt = channel->servers[server].rtt.srtt;
+  stats->rttvar = channel->servers[server].rtt.rttvar;
+  stats->loss = channel->servers[server].rtt.loss;
+  return ARES_SUCCESS;
+}
@@ -39,6 +39,10 @@
 
 #define DEFAULT_TIMEOUT         5000 /* milliseconds */
 #define DEFAULT_TRIES           4
+#define DEFAULT_TIMEOUT_MIN     50    /* milliseconds, with adaptive timeouts */
+#define DEFAULT_TIMEOUT_MAX     60000 /* milliseconds, with adaptive timeouts */
+#define DEFAULT_HEDGE_PERCENTILE 95
+#define DEFAULT_HEDGE_BUDGET    5     /* percent of queries */
 #ifndef INADDR_NONE
 #define INADDR_NONE 0xffffffff
 #endif
@@ -131,6 +135,19 @@ struct ares_addr {
 
 struct query;
 
+/* What an open socket is used for, in the channel's socket table */
+#define ARES_SOCKET_UDP  0  /* index is the server */
+#define ARES_SOCKET_TCP  1  /* index is ARES_TCP_INDEX(server, connection) */
+#define ARES_SOCKET_POOL 2  /* index is the position in channel->udp_pool */
+
+struct ares_socket_entry {
+  ares_socket_t fd;
+  int kind;
+  int index;
+  /* ARES_SOCKET_EVENT_* interest last given by ares_get_socket_events() */
+  int reported;
+};
+
 struct send_request {
   /* Remaining data to send */
   const unsigned char *data;
@@ -138,6 +155,10 @@ struct send_request {
 
   /* The query for which we're sending this data */
   struct query* owner_query;
+  /* Link in the owner query's list of pending sendreqs */
+  struct list_node owner_node;
+  /* The server on whose queue this sendreq sits */
+  struct server_state *server;
   /* The buffer we're using, if we have our own copy of the packet */
   unsigned char *data_storage;
 
@@ -145,21 +166,17 @@ struct send_request {
   struct send_request *next;
 };
 
-struct server_state {
-  struct ares_addr addr;
-  ares_socket_t udp_socket;
-  ares_socket_t tcp_socket;
-
-  /* Mini-buffer for reading the length word */
-  unsigned char tcp_lenbuf[2];
-  int tcp_lenbuf_pos;
-  int tcp_length;
+/* One of a server's TCP connections */
+struct tcp_connection {
+  ares_socket_t socket;
 
-  /* Buffer for reading actual TCP data */
-  unsigned char *tcp_buffer;
-  int tcp_buffer_pos;
+  /* What has been read of the stream of length-prefixed answers, kept
+   * from one answer to the next */
+  unsigned char *buffer;
+  int buffer_len;
+  int buffer_alloc;
 
-  /* TCP output queue */
+  /* Output queue */
   struct send_request *qhead;
   struct send_request *qtail;
 
@@ -167,11 +184,68 @@ struct server_state {
    * retransmit requests into the very same socket, but if the server
    * closes on us and we re-open the connection, then we do want to
    * re-send. */
-  int tcp_connection_generation;
+  int generation;
+};
+
+/* The most TCP connections a channel may keep open to each server, the
+ * socket table index of one of them, and the connection at an index */
+#define ARES_MAX_TCP_CONNS 16
+#define ARES_TCP_INDEX(server, conn) ((server) * ARES_MAX_TCP_CONNS + (conn))
+#define ARES_TCP_CONN(channel, i) \
+  (&(channel)->servers[(i) / ARES_MAX_TCP_CONNS].tcp[(i) % ARES_MAX_TCP_CONNS])
+
+/* A round trip time estimate, as in RFC 6298, used to work out timeouts
+ * with ARES_FLAG_ADAPTIVE_TIMEOUTS and to choose servers with
+ * ARES_FLAG_ADAPTIVE_SERVERS. Times are in microseconds. */
+struct rtt_estimate {
+  long srtt;   /* 0 until the first sample */
+  long rttvar;
+  int backoff; /* how many times the timeout has doubled since a sample */
+  long loss;   /* moving average of failures, in parts per million */
+};
+
+/* The estimate for a destination of ares_send_to(), in the channel's
+ * cache of them */
+struct dest_rtt {
+  struct ares_addr dest;  /* family is 0 if the entry is free */
+  struct rtt_estimate rtt;
+};
+
+/* An answer in the channel's cache, in ares__cache.c */
+struct cache_entry;
+
+/* A caller waiting on a query that asked the same question first, with
+ * ARES_FLAG_COALESCE. A batched caller has neither kind of callback. */
+struct query_waiter {
+  struct query_waiter *next;
+  unsigned short qid;
+  ares_callback callback;
+  ares_timed_callback timed_callback;
+  void *arg;
+};
+
+struct server_state {
+  struct ares_addr addr;
+  ares_socket_t udp_socket;
+
+  /* TCP connections (channel->tcp_conns of them are used), and the one
+   * the next query goes out on */
+  struct tcp_connection tcp[ARES_MAX_TCP_CONNS];
+  int tcp_next;
 
   /* Circular, doubly-linked list of outstanding queries to this server */
   struct list_node queries_to_server;
 
+  /* Queries waiting for room in the UDP socket's send buffer, in order */
+  struct list_node udp_pending;
+
+  /* The UDP socket's drop count when we last saw it, and our counters */
+  unsigned int udp_drops_seen;
+  struct ares_server_stats stats;
+
+  /* How quickly the server answers */
+  struct rtt_estimate rtt;
+
   /* Link back to owning channel */
   ares_channel channel;
 
@@ -186,6 +260,39 @@ struct query {
   /* Query ID from qbuf, for faster lookup, and current timeout */
   unsigned short qid;
   struct timeval timeout;
+  /* When the current attempt went out, for measuring round trip times
+   * with ARES_FLAG_ADAPTIVE_TIMEOUTS */
+  struct timeval attempt_start;
+  /* Whether the current timeout is for sending the query to a second
+   * server (ARES_OPT_HEDGE), and when the attempt really times out */
+  int hedge_armed;
+  struct timeval hedge_deadline;
+  /* The server a hedged query went to first, and when, or -1; its answer
+   * may still come, and is for that first attempt */
+  int hedged_from;
+  struct timeval hedge_start;
+
+  /* The qid the caller gave us, if we had to send the query with another
+   * one (ares_send_to() queries only) */
+  unsigned short user_qid;
+
+  /* Next query in the same bucket of the channel's qid or destination
+   * table */
+  struct query *qid_next;
+
+  /* Next query in the same bucket of the channel's table of queries that
+   * others can wait on, whether the query is in that table, and the
+   * callers waiting on it, in the order they came (ARES_FLAG_COALESCE) */
+  struct query *coalesce_next;
+  int coalescable;
+  struct query_waiter *waiters;
+  struct query_waiter **waiters_tail;
+
+  /* Hash of the first question's name, for quickly rejecting answers */
+  unsigned int qname_hash;
+
+  /* Position in the channel's timeout heap, or -1 if not in it */
+  int timeout_index;
 
   /*
    * Links for the doubly-linked lists in which we insert a query.
@@ -193,10 +300,14 @@ struct query {
    * the attributes we care about, help making most important
    * operations O(1).
    */
-  struct list_node queries_by_qid;    /* hopefully in same cache line as qid */
-  struct list_node queries_by_timeout;
+  struct list_node queries_timed_out;
   struct list_node queries_to_server;
   struct list_node all_queries;
+  struct list_node queries_udp_pending;
+
+  /* Sendreqs still queued to go out on TCP connections that point into
+   * this query's tcpbuf, so they can be detached when the query ends: */
+  struct list_node sendreqs;
 
   /* Query buf with length at beginning, for TCP transmission */
   unsigned char *tcpbuf;
@@ -206,7 +317,20 @@ struct query {
   const unsigned char *qbuf;
   int qlen;
   ares_callback callback;
+  /* Used instead of callback if set, to also pass the times below */
+  ares_timed_callback timed_callback;
+  /* When the current attempt was sent and its answer received */
+  struct ares_query_times times;
   void *arg;
+  /* Set for queries from ares_send_batched() and ares_send_to_batched(),
+   * which have no callback; their outcome goes to the channel's ring of
+   * completions instead */
+  int batched;
+
+  /* Destination given to ares_send_to(). Such queries are sent over UDP
+   * on the channel's shared sockets, and don't use channel->servers. */
+  int has_dest;
+  struct ares_addr dest;
 
   /* Query status */
   int try_count; /* Number of times we tried this query already. */
@@ -267,6 +391,12 @@ struct ares_channeldata {
   int nsort;
   char *lookups;
   int ednspsz;
+  int tcp_conns;
+  int timeout_min; /* in milliseconds */
+  int timeout_max; /* in milliseconds */
+  int hedge_percentile; /* 0 if queries aren't hedged */
+  int hedge_budget;
+  int cache_size; /* 0 if answers aren't cached */
 
   /* For binding to local devices and/or IP addresses.  Leave
    * them null/zero for no binding.
@@ -289,22 +419,105 @@ struct ares_channeldata {
   /* Generation number to use for the next TCP socket open/close */
   int tcp_connection_generation;
 
-  /* The time at which we last called process_timeouts(). Uses integer seconds
-     just to draw the line somewhere. */
-  time_t last_timeout_processed;
-
-  /* Last server we sent a query to. */
+  /* Round trip times of the last ARES_HEDGE_SAMPLES queries to the
+   * servers, in microseconds, how long a query waits before it's hedged, or
+   * 0 if there aren't enough of them yet, and how many hundredths of a
+   * hedge we can afford: */
+#define ARES_HEDGE_SAMPLES 128
+  long hedge_samples[ARES_HEDGE_SAMPLES];
+  unsigned int hedge_nsamples;
+  long hedge_delay;
+  int hedge_tokens;
+
+  /* Last server we sent a query to. With ARES_FLAG_ADAPTIVE_SERVERS, the
+   * last one we probed instead, and how many queries we've chosen a server
+   * for. */
   int last_server;
+  unsigned int server_choices;
 
   /* Circular, doubly-linked list of queries, bucketed various ways.... */
   /* All active queries in a single list: */
   struct list_node all_queries;
-  /* Queries bucketed by qid, for quickly dispatching DNS responses: */
-#define ARES_QID_TABLE_SIZE 2048
-  struct list_node queries_by_qid[ARES_QID_TABLE_SIZE];
-  /* Queries bucketed by timeout, for quickly handling timeouts: */
-#define ARES_TIMEOUT_TABLE_SIZE 1024
-  struct list_node queries_by_timeout[ARES_TIMEOUT_TABLE_SIZE];
+  /* Queries indexed directly by qid, for quickly dispatching DNS responses.
+   * Queries sharing a qid are chained through query->qid_next: */
+#define ARES_QID_TABLE_SIZE 65536
+  struct query **queries_by_qid;
+  /* Queries sent with ares_send_to(), hashed by destination address, port
+   * and qid, and chained through query->qid_next. Each destination has its
+   * own space of qids, so there's no limit on queries across destinations: */
+  struct query **queries_by_dest;
+  int dest_buckets;
+  int ndest_queries;
+  /* Queries that others asking the same question can wait on, with
+   * ARES_FLAG_COALESCE, hashed by their question's name and chained through
+   * query->coalesce_next; allocated when first needed: */
+#define ARES_COALESCE_TABLE_SIZE 4096
+  struct query **queries_by_question;
+  /* Binary min-heap of queries ordered by timeout, for quickly handling
+   * timeouts and finding the next one: */
+  struct query **timeouts;
+  int ntimeouts;
+  int timeouts_alloc;
+
+  /* Unconnected UDP sockets shared by queries sent with ares_send_to(),
+   * for IPv4 ([0]) and IPv6 ([1]) destinations, and the next one to use: */
+#define ARES_UDP_POOL_SIZE 4
+#define ARES_POOL_SOCKET(channel, i) \
+  (&(channel)->udp_pool[(i) / ARES_UDP_POOL_SIZE][(i) % ARES_UDP_POOL_SIZE])
+#define ARES_POOL_PENDING(channel, i) \
+  (&(channel)->udp_pool_pending[(i) / ARES_UDP_POOL_SIZE] \
+                               [(i) % ARES_UDP_POOL_SIZE])
+#define ARES_POOL_DROPS_SEEN(channel, i) \
+  (&(channel)->udp_pool_drops_seen[(i) / ARES_UDP_POOL_SIZE] \
+                                  [(i) % ARES_UDP_POOL_SIZE])
+  ares_socket_t udp_pool[2][ARES_UDP_POOL_SIZE];
+  int udp_pool_next;
+  /* Queries waiting for room in each of those sockets' send buffers: */
+  struct list_node udp_pool_pending[2][ARES_UDP_POOL_SIZE];
+  /* Each socket's drop count when we last saw it: */
+  unsigned int udp_pool_drops_seen[2][ARES_UDP_POOL_SIZE];
+
+  /* Hash table of all the sockets above, for dispatching ready sockets: */
+  struct ares_socket_entry *sockets;
+  int nsockets;
+  int sockets_alloc;
+
+  /* Closed sockets that ares_get_socket_events() still has to report: */
+  ares_socket_t *closed_sockets;
+  int nclosed_sockets;
+  int closed_sockets_alloc;
+
+  /* Buffers for reading a batch of UDP answers with one call, when
+   * ARES_FLAG_BATCH_IO is set; allocated the first time they're needed: */
+  unsigned char *udp_batch_bufs;
+
+  /* Counters returned by ares_get_stats() */
+  struct ares_stats stats;
+
+  /* Cached answers (ARES_OPT_CACHE), in a hash table of cache_nbuckets
+   * buckets, a power of two, allocated when first needed, and in order of
+   * use; and how many bytes they take up: */
+  struct cache_entry **cache_buckets;
+  int cache_nbuckets;
+  struct list_node cache_lru;
+  size_t cache_used;
+
+  /* Round trip time estimates for destinations of ares_send_to(), in a
+   * direct-mapped cache of ARES_DEST_RTT_SIZE entries, allocated when
+   * first needed: */
+#define ARES_DEST_RTT_SIZE 4096
+  struct dest_rtt *dest_rtts;
+
+  /* Completions of batched queries waiting for ares_get_completions(), in a
+   * ring of completions_alloc entries (a power of two) starting at
+   * completions_head: */
+  struct ares_completion *completions;
+  int completions_head;
+  int ncompletions;
+  int completions_alloc;
+
+  /* The I/O thread started by ares_thread_start(), if any */
+  struct ares_io_thread *io_thread;
 
   ares_sock_state_cb sock_state_cb;
   void *sock_state_cb_data;
@@ -328,15 +541,76 @@ int ares__timedout(struct timeval *now,
 void ares__send_query(ares_channel channel, struct query *query,
                       struct timeval *now);
 void ares__close_sockets(ares_channel channel, struct server_state *server);
+int ares__connect_udp_socket(ares_channel channel,
+                             struct server_state *server);
+void ares__free_sendreq(struct send_request *sendreq);
+void ares__clear_udp_pending(struct list_node *pending);
+void ares__close_udp_pool(ares_channel channel);
+void ares__destroy_socket_table(ares_channel channel);
+struct ares_socket_entry *ares__find_socket(ares_channel channel,
+                                            ares_socket_t fd);
+int ares__add_socket(ares_channel channel, ares_socket_t fd, int kind,
+                     int index);
+void ares__remove_socket(ares_channel channel, ares_socket_t fd);
 int ares__get_hostent(FILE *fp, int family, struct hostent **host);
 int ares__read_line(FILE *fp, char **buf, size_t *bufsize);
-void ares__free_query(struct query *query);
+void ares__free_query(ares_channel channel, struct query *query);
+int ares__init_qid_table(ares_channel channel);
+void ares__destroy_qid_table(ares_channel channel);
+struct query *ares__find_query_by_qid(ares_channel channel,
+                                      unsigned short qid);
+int ares__insert_query_by_qid(ares_channel channel, struct query *query);
+void ares__remove_query_by_qid(ares_channel channel, struct query *query);
+struct query *ares__find_query_by_dest(ares_channel channel,
+                                       const struct ares_addr *dest,
+                                       unsigned short qid);
+int ares__insert_query_by_dest(ares_channel channel, struct query *query);
+int ares__same_dest(const struct ares_addr *a, const struct ares_addr *b);
+unsigned int ares__hash_dest(const struct ares_addr *dest,
+                             unsigned short qid);
+struct rtt_estimate *ares__query_rtt(ares_channel channel,
+                                     struct query *query, int create);
+void ares__rtt_sample(struct rtt_estimate *rtt, long usec);
+void ares__rtt_timed_out(struct rtt_estimate *rtt);
+void ares__rtt_answered(struct rtt_estimate *rtt, int failed);
+int ares__choose_server(ares_channel channel);
+void ares__hedge_sample(ares_channel channel, long usec);
+int ares__hedge_delay(ares_channel channel);
+int ares__take_hedge(ares_channel channel);
+int ares__cache_fetch(ares_channel channel, const unsigned char *qbuf,
+                      int qlen, unsigned char **abuf, int *alen);
+void ares__cache_insert(ares_channel channel, const unsigned char *qbuf,
+                        int qlen, const unsigned char *abuf, int alen);
+void ares__destroy_cache(ares_channel channel);
+int ares__rtt_timeout(ares_channel channel, const struct rtt_estimate *rtt,
+                      int shift);
+void ares__destroy_dest_rtts(ares_channel channel);
+void ares__remove_query_by_dest(ares_channel channel, struct query *query);
+struct query *ares__find_coalescable(ares_channel channel,
+                                     const unsigned char *qbuf, int qlen);
+void ares__insert_coalescable(ares_channel channel, struct query *query);
+void ares__remove_coalescable(ares_channel channel, struct query *query);
+void ares__destroy_timeout_heap(ares_channel channel);
+struct query *ares__next_timeout(ares_channel channel);
+int ares__set_timeout(ares_channel channel, struct query *query);
+void ares__remove_timeout(ares_channel channel, struct query *query);
 unsigned short ares__generate_new_id(rc4_key* key);
 struct timeval ares__tvnow(void);
+void ares__timestamp_now(struct ares_timestamp *ts);
+void ares__query_callback(ares_channel channel, struct query *query,
+                          int status, int timeouts,
+                          unsigned char *abuf, int alen);
 int ares__expand_name_for_response(const unsigned char *encoded,
                                    const unsigned char *abuf, int alen,
                                    char **s, long *enclen);
+int ares__name_hash(const unsigned char *encoded, const unsigned char *abuf,
+                    int alen, unsigned int *hash, long *enclen);
+int ares__name_equal(const unsigned char *name1, const unsigned char *buf1,
+                     int len1, const unsigned char *name2,
+                     const unsigned char *buf2, int len2);
 void ares__init_servers_state(ares_channel channel);
+void ares__init_server_state(ares_channel channel,
+                             struct server_state *server);
 void ares__destroy_servers_state(ares_channel channel);
 #if 0 /* Not used */
 long ares__tvdiff(struct timeval t1, struct timeval t2);
@@ -15,6 +15,10 @@
  * without express or implied warranty.
  */
 
+#ifndef _GNU_SOURCE
+/* for recvmmsg() and sendmmsg() */
+#  define _GNU_SOURCE
+#endif
 #include "ares_setup.h"
 
 #ifdef HAVE_SYS_UIO_H
@@ -57,20 +61,57 @@
 #include "ares_private.h"
 
 
+union udp_sockaddr {
+  struct sockaddr     sa;
+  struct sockaddr_in  sa4;
+  struct sockaddr_in6 sa6;
+};
+
+/* With ARES_FLAG_BATCH_IO, answers are read and queued queries sent up to
+ * this many at a time, where the system can do that in one call. A batch
+ * is read with the same message headers as a single recvmsg(), which is
+ * used where the kernel counts drops. */
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && defined(SO_RXQ_OVFL)
+#  define USE_MMSG
+#endif
+#define UDP_BATCH 16
+
+/* Starting size of a TCP connection's read buffer, which holds several
+ * typical answers */
+#define TCP_BUFFER_SIZE 4096
+
+/* A datagram read from a UDP socket, and what the kernel said about it */
+struct udp_datagram {
+  unsigned char *buf;           /* MAXENDSSZ + 1 bytes */
+  ssize_t len;
+  union udp_sockaddr from;
+  unsigned int drops;           /* the socket's drop count, 0 if not given */
+  struct ares_timestamp rxtime; /* when it arrived, 0 if not known */
+};
+
 static int try_again(int errnum);
-static void write_tcp_data(ares_channel channel, fd_set *write_fds,
-                           ares_socket_t write_fd, struct timeval *now);
-static void read_tcp_data(ares_channel channel, fd_set *read_fds,
-                          ares_socket_t read_fd, struct timeval *now);
-static void read_udp_packets(ares_channel channel, fd_set *read_fds,
-                             ares_socket_t read_fd, struct timeval *now);
-static void advance_tcp_send_queue(ares_channel channel, int whichserver,
+static void write_tcp_data(ares_channel channel, int index,
+                           struct timeval *now);
+static void read_tcp_data(ares_channel channel, int index,
+                          struct timeval *now);
+static void read_udp_packets(ares_channel channel, int whichserver,
+                             struct timeval *now);
+static void read_pool_packets(ares_channel channel, int index,
+                              struct timeval *now);
+static void process_socket(ares_channel channel, ares_socket_t fd,
+                           int writable, struct timeval *now);
+static void process_ready_sockets(ares_channel channel, fd_set *fds,
+                                  int writable, struct timeval *now);
+static void advance_tcp_send_queue(ares_channel channel,
+                                   struct tcp_connection *conn,
                                    ssize_t num_bytes);
 static void process_timeouts(ares_channel channel, struct timeval *now);
 static void process_broken_connections(ares_channel channel,
                                        struct timeval *now);
 static void process_answer(ares_channel channel, unsigned char *abuf,
                            int alen, int whichserver, int tcp,
+                           struct sockaddr *from,
+                           const struct ares_timestamp *rxtime,
                            struct timeval *now);
 static void handle_error(ares_channel channel, int whichserver,
                          struct timeval *now);
@@ -78,13 +119,43 @@ static void skip_server(ares_channel channel, struct query *query,
                         int whichserver);
 static void next_server(ares_channel channel, struct query *query,
                         struct timeval *now);
-static int open_tcp_socket(ares_channel channel, struct server_state *server);
+static int configure_socket(ares_socket_t s, int family, ares_channel channel);
+static void configure_udp_socket(ares_socket_t s, ares_channel channel);
+static int udp_buffers(ares_channel channel, struct udp_datagram *d,
+                       unsigned char *buf);
+static int recv_udp(ares_socket_t s, struct udp_datagram *d, int n);
+static void mark_sent(struct query *query);
+static long answer_usec(struct query *query,
+                        const struct ares_timestamp *rxtime);
+static void count_udp_drops(ares_channel channel, unsigned int *seen,
+                            unsigned int drops,
+                            struct ares_server_stats *stats);
+static int open_tcp_socket(ares_channel channel, struct server_state *server,
+                           int whichconn);
 static int open_udp_socket(ares_channel channel, struct server_state *server);
 static int same_questions(const unsigned char *qbuf, int qlen,
                           const unsigned char *abuf, int alen);
 static int same_address(struct sockaddr *sa, struct ares_addr *aa);
+static int sockaddr_to_addr(struct sockaddr *sa, struct ares_addr *addr);
+static ares_socklen_t fill_sockaddr(ares_channel channel,
+                                    const struct ares_addr *addr,
+                                    union udp_sockaddr *saddr);
+static void send_to_dest(ares_channel channel, struct query *query,
+                         struct timeval *now);
+static void queue_udp_send(ares_channel channel, ares_socket_t s,
+                           struct list_node *pending, struct query *query);
+static void defer_udp_send(ares_channel channel, ares_socket_t s,
+                           struct list_node *pending, struct query *query);
+static void flush_udp_pending(ares_channel channel, ares_socket_t s,
+                              struct list_node *pending, struct timeval *now);
+static int send_udp(ares_channel channel, ares_socket_t s,
+                    struct list_node *pending);
+static int set_query_timeout(ares_channel channel, struct query *query,
+                             struct timeval *now);
 static void end_query(ares_channel channel, struct query *query, int status,
                       unsigned char *abuf, int alen);
+static void hedge_query(ares_channel channel, struct query *query,
+                        struct timeval *now);
 
 /* return true if now is exactly check time or later */
 int ares__timedout(struct timeval *now,
@@ -122,9 +193,14 @@ static void processfds(ares_channel channel,
 {
   struct timeval now = ares__tvnow();
 
-  write_tcp_data(channel, write_fds, write_fd, &now);
-  read_tcp_data(channel, read_fds, read_fd, &now);
-  read_udp_packets(channel, read_fds, read_fd, &now);
+  if (write_fds)
+    process_ready_sockets(channel, write_fds, 1, &now);
+  else if (write_fd != ARES_SOCKET_BAD)
+    process_socket(channel, write_fd, 1, &now);
+  if (read_fds)
+    process_ready_sockets(channel, read_fds, 0, &now);
+  else if (read_fd != ARES_SOCKET_BAD)
+    process_socket(channel, read_fd, 0, &now);
   process_timeouts(channel, &now);
   process_broken_connections(channel, &now);
 }
@@ -148,6 +224,30 @@ void ares_process_fd(ares_channel channel,
   processfds(channel, NULL, read_fd, NULL, write_fd);
 }
 
+/* Handle a batch of ready sockets, as returned by an event loop such as
+ * epoll, then any timeouts.
+ */
+void ares_process_events(ares_channel channel,
+                         const struct ares_socket_event *events,
+                         int nevents)
+{
+  struct timeval now = ares__tvnow();
+  int i;
+
+  for (i = 0; i < nevents; i++)
+    {
+      if (events[i].events & ARES_SOCKET_EVENT_WRITE)
+        process_socket(channel, events[i].fd, 1, &now);
+    }
+  for (i = 0; i < nevents; i++)
+    {
+      if (events[i].events & ARES_SOCKET_EVENT_READ)
+        process_socket(channel, events[i].fd, 0, &now);
+    }
+  process_timeouts(channel, &now);
+  process_broken_connections(channel, &now);
+}
+
 
 /* Return 1 if the specified error number describes a readiness error, or 0
  * otherwise. This is mostly for HP-UX, which could return EAGAIN or
@@ -175,117 +275,92 @@ static int try_again(int errnum)
   return 0;
 }
 
-/* If any TCP sockets select true for writing, write out queued data
- * we have for them.
+/* Write out queued data we have for one of a server's TCP connections,
+ * which is ready for writing. index is the connection's ARES_TCP_INDEX().
  */
-static void write_tcp_data(ares_channel channel,
-                           fd_set *write_fds,
-                           ares_socket_t write_fd,
+static void write_tcp_data(ares_channel channel, int index,
                            struct timeval *now)
 {
-  struct server_state *server;
+  int whichserver = index / ARES_MAX_TCP_CONNS;
+  struct server_state *server = &channel->servers[whichserver];
+  struct tcp_connection *conn = ARES_TCP_CONN(channel, index);
   struct send_request *sendreq;
   struct iovec *vec;
-  int i;
   ssize_t scount;
   ssize_t wcount;
   size_t n;
 
-  if(!write_fds && (write_fd == ARES_SOCKET_BAD))
-    /* no possible action */
+  /* Make sure the connection has data to send. */
+  if (!conn->qhead || server->is_broken)
     return;
 
-  for (i = 0; i < channel->nservers; i++)
-    {
-      /* Make sure server has data to send and is selected in write_fds or
-         write_fd. */
-      server = &channel->servers[i];
-      if (!server->qhead || server->tcp_socket == ARES_SOCKET_BAD ||
-          server->is_broken)
-        continue;
-
-      if(write_fds) {
-        if(!FD_ISSET(server->tcp_socket, write_fds))
-          continue;
-      }
-      else {
-        if(server->tcp_socket != write_fd)
-          continue;
-      }
-
-      if(write_fds)
-        /* If there's an error and we close this socket, then open
-         * another with the same fd to talk to another server, then we
-         * don't want to think that it was the new socket that was
-         * ready. This is not disastrous, but is likely to result in
-         * extra system calls and confusion. */
-        FD_CLR(server->tcp_socket, write_fds);
+  /* Count the number of send queue items. */
+  n = 0;
+  for (sendreq = conn->qhead; sendreq; sendreq = sendreq->next)
+    n++;
 
-      /* Count the number of send queue items. */
+  /* Allocate iovecs so we can send all our data at once. */
+  vec = ares_malloc(n * sizeof(struct iovec));
+  if (vec)
+    {
+      /* Fill in the iovecs and send. */
       n = 0;
-      for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
-        n++;
-
-      /* Allocate iovecs so we can send all our data at once. */
-      vec = ares_malloc(n * sizeof(struct iovec));
-      if (vec)
+      for (sendreq = conn->qhead; sendreq; sendreq = sendreq->next)
         {
-          /* Fill in the iovecs and send. */
-          n = 0;
-          for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
-            {
-              vec[n].iov_base = (char *) sendreq->data;
-              vec[n].iov_len = sendreq->len;
-              n++;
-            }
-          wcount = (ssize_t)writev(server->tcp_socket, vec, (int)n);
-          ares_free(vec);
-          if (wcount < 0)
-            {
-              if (!try_again(SOCKERRNO))
-                handle_error(channel, i, now);
-              continue;
-            }
-
-          /* Advance the send queue by as many bytes as we sent. */
-          advance_tcp_send_queue(channel, i, wcount);
+          vec[n].iov_base = (char *) sendreq->data;
+          vec[n].iov_len = sendreq->len;
+          n++;
         }
-      else
+      wcount = (ssize_t)writev(conn->socket, vec, (int)n);
+      ares_free(vec);
+      if (wcount < 0)
         {
-          /* Can't allocate iovecs; just send the first request. */
-          sendreq = server->qhead;
+          if (!try_again(SOCKERRNO))
+            handle_error(channel, whichserver, now);
+          return;
+        }
 
-          scount = swrite(server->tcp_socket, sendreq->data, sendreq->len);
-          if (scount < 0)
-            {
-              if (!try_again(SOCKERRNO))
-                handle_error(channel, i, now);
-              continue;
-            }
+      /* Advance the send queue by as many bytes as we sent. */
+      advance_tcp_send_queue(channel, conn, wcount);
+    }
+  else
+    {
+      /* Can't allocate iovecs; just send the first request. */
+      sendreq = conn->qhead;
 
-          /* Advance the send queue by as many bytes as we sent. */
-          advance_tcp_send_queue(channel, i, scount);
+      scount = swrite(conn->socket, sendreq->data, sendreq->len);
+      if (scount < 0)
+        {
+          if (!try_again(SOCKERRNO))
+            handle_error(channel, whichserver, now);
+          return;
         }
+
+      /* Advance the send queue by as many bytes as we sent. */
+      advance_tcp_send_queue(channel, conn, scount);
     }
 }
 
-/* Consume the given number of bytes from the head of the TCP send queue. */
-static void advance_tcp_send_queue(ares_channel channel, int whichserver,
+/* Consume the given number of bytes from the head of the TCP send queue.
+ * A query whose latest request has been written in full has gone out. */
+static void advance_tcp_send_queue(ares_channel channel,
+                                   struct tcp_connection *conn,
                                    ssize_t num_bytes)
 {
   struct send_request *sendreq;
-  struct server_state *server = &channel->servers[whichserver];
+  struct query *query;
   while (num_bytes > 0) {
-    sendreq = server->qhead;
+    sendreq = conn->qhead;
     if ((size_t)num_bytes >= sendreq->len) {
       num_bytes -= sendreq->len;
-      server->qhead = sendreq->next;
-      if (sendreq->data_storage)
-        ares_free(sendreq->data_storage);
-      ares_free(sendreq);
-      if (server->qhead == NULL) {
-        SOCK_STATE_CALLBACK(channel, server->tcp_socket, 1, 0);
-        server->qtail = NULL;
+      conn->qhead = sendreq->next;
+      query = sendreq->owner_query;
+      if (query && query->sendreqs.prev == &sendreq->owner_node)
+        mark_sent(query);
+      ares__free_sendreq(sendreq);
+      if (conn->qhead == NULL) {
+        SOCK_STATE_CALLBACK(channel, conn->socket, 1, 0);
+        conn->qtail = NULL;
 
         /* qhead is NULL so we cannot continue this loop */
         break;
@@ -299,230 +374,488 @@ static void advance_tcp_send_queue(ares_channel channel, int whichserver,
   }
 }
 
-/* If any TCP socket selects true for reading, read some data,
- * allocate a buffer if we finish reading the length word, and process
- * a packet if we finish reading one.
+/* Make room in a TCP connection's read buffer for at least size bytes */
+static int grow_tcp_buffer(struct tcp_connection *conn, int size)
+{
+  unsigned char *buffer;
+  int alloc = conn->buffer_alloc ? conn->buffer_alloc : TCP_BUFFER_SIZE;
+
+  if (size <= conn->buffer_alloc)
+    return ARES_SUCCESS;
+  while (alloc < size)
+    alloc *= 2;
+  buffer = ares_realloc(conn->buffer, alloc);
+  if (!buffer)
+    return ARES_ENOMEM;
+  conn->buffer = buffer;
+  conn->buffer_alloc = alloc;
+  return ARES_SUCCESS;
+}
+
+/* One of a server's TCP connections is ready for reading: read what it
+ * has, and process every whole answer that gives us. The buffer is kept
+ * for the next answers, and only grows if one doesn't fit.
  */
-static void read_tcp_data(ares_channel channel, fd_set *read_fds,
-                          ares_socket_t read_fd, struct timeval *now)
+static void read_tcp_data(ares_channel channel, int index,
+                          struct timeval *now)
 {
-  struct server_state *server;
-  int i;
+  int whichserver = index / ARES_MAX_TCP_CONNS;
+  struct server_state *server = &channel->servers[whichserver];
+  struct tcp_connection *conn = ARES_TCP_CONN(channel, index);
+  int generation = conn->generation;
   ssize_t count;
+  int pos, length, room;
 
-  if(!read_fds && (read_fd == ARES_SOCKET_BAD))
-    /* no possible action */
+  if (server->is_broken)
     return;
 
-  for (i = 0; i < channel->nservers; i++)
+  for (;;)
     {
-      /* Make sure the server has a socket and is selected in read_fds. */
-      server = &channel->servers[i];
-      if (server->tcp_socket == ARES_SOCKET_BAD || server->is_broken)
-        continue;
-
-      if(read_fds) {
-        if(!FD_ISSET(server->tcp_socket, read_fds))
-          continue;
-      }
-      else {
-        if(server->tcp_socket != read_fd)
-          continue;
-      }
-
-      if(read_fds)
-        /* If there's an error and we close this socket, then open another
-         * with the same fd to talk to another server, then we don't want to
-         * think that it was the new socket that was ready. This is not
-         * disastrous, but is likely to result in extra system calls and
-         * confusion. */
-        FD_CLR(server->tcp_socket, read_fds);
-
-      if (server->tcp_lenbuf_pos != 2)
+      if (grow_tcp_buffer(conn, conn->buffer_len + 1) != ARES_SUCCESS)
         {
-          /* We haven't yet read a length word, so read that (or
-           * what's left to read of it).
-           */
-          count = sread(server->tcp_socket,
-                        server->tcp_lenbuf + server->tcp_lenbuf_pos,
-                        2 - server->tcp_lenbuf_pos);
-          if (count <= 0)
-            {
-              if (!(count == -1 && try_again(SOCKERRNO)))
-                handle_error(channel, i, now);
-              continue;
-            }
-
-          server->tcp_lenbuf_pos += (int)count;
-          if (server->tcp_lenbuf_pos == 2)
-            {
-              /* We finished reading the length word.  Decode the
-               * length and allocate a buffer for the data.
-               */
-              server->tcp_length = server->tcp_lenbuf[0] << 8
-                | server->tcp_lenbuf[1];
-              server->tcp_buffer = ares_malloc(server->tcp_length);
-              if (!server->tcp_buffer) {
-                handle_error(channel, i, now);
-                return; /* bail out on malloc failure. TODO: make this
-                           function return error codes */
-              }
-              server->tcp_buffer_pos = 0;
-            }
+          handle_error(channel, whichserver, now);
+          return;
         }
-      else
+      room = conn->buffer_alloc - conn->buffer_len;
+      count = sread(conn->socket, conn->buffer + conn->buffer_len, room);
+      if (count <= 0)
         {
-          /* Read data into the allocated buffer. */
-          count = sread(server->tcp_socket,
-                        server->tcp_buffer + server->tcp_buffer_pos,
-                        server->tcp_length - server->tcp_buffer_pos);
-          if (count <= 0)
-            {
-              if (!(count == -1 && try_again(SOCKERRNO)))
-                handle_error(channel, i, now);
-              continue;
-            }
+          if (!(count == -1 && try_again(SOCKERRNO)))
+            handle_error(channel, whichserver, now);
+          return;
+        }
+      conn->buffer_len += (int)count;
 
-          server->tcp_buffer_pos += (int)count;
-          if (server->tcp_buffer_pos == server->tcp_length)
-            {
-              /* We finished reading this answer; process it and
-               * prepare to read another length word.
-               */
-              process_answer(channel, server->tcp_buffer, server->tcp_length,
-                             i, 1, now);
-              ares_free(server->tcp_buffer);
-              server->tcp_buffer = NULL;
-              server->tcp_lenbuf_pos = 0;
-              server->tcp_buffer_pos = 0;
-            }
+      /* Each answer comes with a two-byte length. */
+      pos = 0;
+      length = 0;
+      while (conn->buffer_len - pos >= 2)
+        {
+          length = conn->buffer[pos] << 8 | conn->buffer[pos + 1];
+          if (conn->buffer_len - pos - 2 < length)
+            break;
+          process_answer(channel, conn->buffer + pos + 2, length,
+                         whichserver, 1, NULL, NULL, now);
+          /* Ending the query may have closed the connection. */
+          if (conn->generation != generation)
+            return;
+          pos += 2 + length;
+        }
+
+      /* Keep the start of the next answer, making room for the rest. */
+      conn->buffer_len -= pos;
+      memmove(conn->buffer, conn->buffer + pos, conn->buffer_len);
+      if (conn->buffer_len >= 2 &&
+          grow_tcp_buffer(conn, 2 + length) != ARES_SUCCESS)
+        {
+          handle_error(channel, whichserver, now);
+          return;
         }
+
+      /* A short read means there's nothing more for now. */
+      if (count < room)
+        return;
     }
 }
 
-/* If any UDP sockets select true for reading, process them. */
-static void read_udp_packets(ares_channel channel, fd_set *read_fds,
-                             ares_socket_t read_fd, struct timeval *now)
+/* The server's UDP socket is ready for reading; process what it has. */
+static void read_udp_packets(ares_channel channel, int whichserver,
+                             struct timeval *now)
 {
-  struct server_state *server;
-  int i;
-  ssize_t count;
+  struct server_state *server = &channel->servers[whichserver];
   unsigned char buf[MAXENDSSZ + 1];
+  struct udp_datagram d[UDP_BATCH];
+  int batch, count, i;
+
+  if (server->is_broken)
+    return;
+
+  /* To reduce event loop overhead, read and process as many
+   * packets as we can. */
+  batch = udp_buffers(channel, d, buf);
+  for (;;) {
+    if (server->udp_socket == ARES_SOCKET_BAD)
+      count = 0;
+    else
+      count = recv_udp(server->udp_socket, d, batch);
+
+    if (count == -1 && try_again(SOCKERRNO))
+      return;
+    else if (count <= 0) {
+      handle_error(channel, whichserver, now);
+      return;
+    }
+
+    for (i = 0; i < count; i++) {
+      if (d[i].drops)
+        count_udp_drops(channel, &server->udp_drops_seen, d[i].drops,
+                        &server->stats);
+      if (d[i].len == 0) {
+        handle_error(channel, whichserver, now);
+        return;
+      }
 #ifdef HAVE_RECVFROM
-  ares_socklen_t fromlen;
-  union {
-    struct sockaddr     sa;
-    struct sockaddr_in  sa4;
-    struct sockaddr_in6 sa6;
-  } from;
+      if (!same_address(&d[i].from.sa, &server->addr))
+        /* The address the response comes from does not match the address
+         * we sent the request to. Someone may be attempting to perform a
+         * cache poisoning attack. The rest of the batch may be genuine. */
+        continue;
 #endif
+      process_answer(channel, d[i].buf, (int)d[i].len, whichserver, 0, NULL,
+                     &d[i].rxtime, now);
+    }
+  }
+}
 
-  if(!read_fds && (read_fd == ARES_SOCKET_BAD))
-    /* no possible action */
-    return;
+/* Point the datagrams at buffers to read into, and return how many of them
+ * to read at once: a batch if the channel has ARES_FLAG_BATCH_IO set and the
+ * system can do that, otherwise just one, into buf.
+ */
+static int udp_buffers(ares_channel channel, struct udp_datagram *d,
+                       unsigned char *buf)
+{
+#ifdef USE_MMSG
+  int i;
 
-  for (i = 0; i < channel->nservers; i++)
+  if ((channel->flags & ARES_FLAG_BATCH_IO) && !channel->udp_batch_bufs)
+    channel->udp_batch_bufs = ares_malloc(UDP_BATCH * (MAXENDSSZ + 1));
+  /* Without the memory, read one at a time. */
+  if ((channel->flags & ARES_FLAG_BATCH_IO) && channel->udp_batch_bufs)
     {
-      /* Make sure the server has a socket and is selected in read_fds. */
-      server = &channel->servers[i];
+      for (i = 0; i < UDP_BATCH; i++)
+        d[i].buf = channel->udp_batch_bufs + i * (MAXENDSSZ + 1);
+      return UDP_BATCH;
+    }
+#else
+  (void)channel;
+#endif
+  d[0].buf = buf;
+  return 1;
+}
+
+#ifdef SO_RXQ_OVFL
+/* Room for what we ask the kernel to attach to each datagram */
+union udp_control {
+  struct cmsghdr align;
+  char buf[CMSG_SPACE(sizeof(unsigned int)) +
+           CMSG_SPACE(sizeof(struct timespec))];
+};
+
+static void init_udp_msghdr(struct msghdr *msg, struct iovec *iov,
+                            union udp_control *control,
+                            struct udp_datagram *d)
+{
+  iov->iov_base = d->buf;
+  iov->iov_len = MAXENDSSZ + 1;
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_name = &d->from;
+  msg->msg_namelen = sizeof(d->from);
+  msg->msg_iov = iov;
+  msg->msg_iovlen = 1;
+  msg->msg_control = control;
+  msg->msg_controllen = sizeof(*control);
+}
+
+static void read_udp_cmsgs(struct msghdr *msg, struct udp_datagram *d)
+{
+  struct cmsghdr *cmsg;
+  struct timespec ts;
 
-      if (server->udp_socket == ARES_SOCKET_BAD || server->is_broken)
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET)
         continue;
+      if (cmsg->cmsg_type == SO_RXQ_OVFL)
+        memcpy(&d->drops, CMSG_DATA(cmsg), sizeof(d->drops));
+#ifdef SCM_TIMESTAMPNS
+      else if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+          memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+          d->rxtime.sec = ts.tv_sec;
+          d->rxtime.nsec = ts.tv_nsec;
+        }
+#endif
+    }
+}
+#endif
 
-      if(read_fds) {
-        if(!FD_ISSET(server->udp_socket, read_fds))
-          continue;
-      }
-      else {
-        if(server->udp_socket != read_fd)
-          continue;
-      }
+/* Read up to n datagrams from a UDP socket, more than one only with
+ * recvmmsg(). Returns how many were read, or -1 with SOCKERRNO set. Where
+ * the kernel keeps count of the datagrams it has dropped on the socket for
+ * lack of receive buffer space (SO_RXQ_OVFL), the running total comes with
+ * each datagram. If the kernel timestamped a datagram as it arrived
+ * (SO_TIMESTAMPNS), the time comes with it too.
+ */
+static int recv_udp(ares_socket_t s, struct udp_datagram *d, int n)
+{
+#ifdef SO_RXQ_OVFL
+  struct msghdr msg;
+  struct iovec iov;
+  union udp_control control;
+#elif defined(HAVE_RECVFROM)
+  ares_socklen_t fromlen;
+#endif
+#ifdef USE_MMSG
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  union udp_control controls[UDP_BATCH];
+#endif
+  ssize_t count;
+  int i;
 
-      if(read_fds)
-        /* If there's an error and we close this socket, then open
-         * another with the same fd to talk to another server, then we
-         * don't want to think that it was the new socket that was
-         * ready. This is not disastrous, but is likely to result in
-         * extra system calls and confusion. */
-        FD_CLR(server->udp_socket, read_fds);
-
-      /* To reduce event loop overhead, read and process as many
-       * packets as we can. */
-      do {
-        if (server->udp_socket == ARES_SOCKET_BAD)
-          count = 0;
-
-        else {
-#ifdef HAVE_RECVFROM
-          if (server->addr.family == AF_INET)
-            fromlen = sizeof(from.sa4);
-          else
-            fromlen = sizeof(from.sa6);
-          count = (ssize_t)recvfrom(server->udp_socket, (void *)buf,
-                                    sizeof(buf), 0, &from.sa, &fromlen);
+  for (i = 0; i < n; i++)
+    {
+      d[i].drops = 0;
+      d[i].rxtime.sec = 0;
+      d[i].rxtime.nsec = 0;
+    }
+
+#ifdef USE_MMSG
+  if (n > 1)
+    {
+      for (i = 0; i < n; i++)
+        init_udp_msghdr(&msgs[i].msg_hdr, &iovs[i], &controls[i], &d[i]);
+      n = recvmmsg(s, msgs, (unsigned int)n, 0, NULL);
+      for (i = 0; i < n; i++)
+        {
+          d[i].len = (ssize_t)msgs[i].msg_len;
+          read_udp_cmsgs(&msgs[i].msg_hdr, &d[i]);
+        }
+      return n;
+    }
+#endif
+
+#ifdef SO_RXQ_OVFL
+  init_udp_msghdr(&msg, &iov, &control, d);
+  count = (ssize_t)recvmsg(s, &msg, 0);
+  if (count >= 0)
+    read_udp_cmsgs(&msg, d);
+#elif defined(HAVE_RECVFROM)
+  fromlen = sizeof(d->from);
+  count = (ssize_t)recvfrom(s, (void *)d->buf, MAXENDSSZ + 1, 0,
+                            &d->from.sa, &fromlen);
 #else
-          count = sread(server->udp_socket, buf, sizeof(buf));
+  count = sread(s, d->buf, MAXENDSSZ + 1);
 #endif
-        }
+  if (count < 0)
+    return -1;
+  d->len = count;
+  return 1;
+}
 
-        if (count == -1 && try_again(SOCKERRNO))
-          continue;
-        else if (count <= 0)
-          handle_error(channel, i, now);
+/* Add whatever a UDP socket has dropped since we last looked to the
+ * channel's counters, and to the server's if the socket is the server's own.
+ */
+static void count_udp_drops(ares_channel channel, unsigned int *seen,
+                            unsigned int drops,
+                            struct ares_server_stats *stats)
+{
+  /* The kernel's count wraps around, and so does this difference. */
+  unsigned int n = drops - *seen;
+
+  if (!n)
+    return;
+  *seen = drops;
+  channel->stats.udp_rx_drops += n;
+  if (stats)
+    stats->udp_rx_drops += n;
+}
+
+/* One of the sockets shared by ares_send_to() queries is ready for reading.
+ * Answers arrive on it from whichever address the query went to.
+ */
+static void read_pool_packets(ares_channel channel, int index,
+                              struct timeval *now)
+{
 #ifdef HAVE_RECVFROM
-        else if (!same_address(&from.sa, &server->addr))
-          /* The address the response comes from does not match the address we
-           * sent the request to. Someone may be attempting to perform a cache
-           * poisoning attack. */
-          break;
+  ares_socket_t *s = ARES_POOL_SOCKET(channel, index);
+  unsigned int *seen = ARES_POOL_DROPS_SEEN(channel, index);
+  unsigned char buf[MAXENDSSZ + 1];
+  struct udp_datagram d[UDP_BATCH];
+  int batch = udp_buffers(channel, d, buf);
+  int count, i;
+
+  do {
+    count = recv_udp(*s, d, batch);
+    for (i = 0; i < count; i++)
+      {
+        /* The socket is shared by all destinations, so its drops can't be
+         * put down to any one of them. */
+        if (d[i].drops)
+          count_udp_drops(channel, seen, d[i].drops, NULL);
+        process_answer(channel, d[i].buf, (int)d[i].len, -1, 0,
+                       &d[i].from.sa, &d[i].rxtime, now);
+      }
+    if (count == -1 && !try_again(SOCKERRNO))
+      {
+        /* Queries still waiting on this socket will time out and be
+         * resent on a fresh one. */
+        ares__clear_udp_pending(ARES_POOL_PENDING(channel, index));
+        SOCK_STATE_CALLBACK(channel, *s, 0, 0);
+        ares__remove_socket(channel, *s);
+        sclose(*s);
+        *s = ARES_SOCKET_BAD;
+      }
+  } while (count > 0 && *s != ARES_SOCKET_BAD);
+#else
+  (void)channel;
+  (void)index;
+  (void)now;
 #endif
-        else
-          process_answer(channel, buf, (int)count, i, 0, now);
-       } while (count > 0);
+}
+
+/* Handle one of the channel's sockets being ready for reading or writing.
+ * The socket table says what it's for, so this doesn't depend on the number
+ * of servers.
+ */
+static void process_socket(ares_channel channel, ares_socket_t fd,
+                           int writable, struct timeval *now)
+{
+  struct ares_socket_entry *entry = ares__find_socket(channel, fd);
+
+  if (!entry)
+    return;
+
+  if (writable)
+    {
+      switch (entry->kind)
+        {
+          case ARES_SOCKET_TCP:
+            write_tcp_data(channel, entry->index, now);
+            break;
+          case ARES_SOCKET_UDP:
+            flush_udp_pending(channel, fd,
+                              &channel->servers[entry->index].udp_pending,
+                              now);
+            break;
+          case ARES_SOCKET_POOL:
+            flush_udp_pending(channel, fd,
+                              ARES_POOL_PENDING(channel, entry->index), now);
+            break;
+        }
+      return;
+    }
+
+  switch (entry->kind)
+    {
+      case ARES_SOCKET_TCP:
+        read_tcp_data(channel, entry->index, now);
+        break;
+      case ARES_SOCKET_UDP:
+        read_udp_packets(channel, entry->index, now);
+        break;
+      case ARES_SOCKET_POOL:
+        read_pool_packets(channel, entry->index, now);
+        break;
     }
 }
 
+/* Handle all of the channel's sockets that are set in fds. */
+static void process_ready_sockets(ares_channel channel, fd_set *fds,
+                                  int writable, struct timeval *now)
+{
+  ares_socket_t local[32];
+  ares_socket_t *ready = local;
+  int maxready = 32;
+  int nready = 0;
+  int i;
+
+  if (channel->nsockets > maxready)
+    {
+      ready = ares_malloc(channel->nsockets * sizeof(ares_socket_t));
+      if (ready)
+        maxready = channel->nsockets;
+      else
+        ready = local;  /* The rest will still be ready next time. */
+    }
+
+  /* Find the ready sockets first, since handling one may open or close
+   * others.
+   */
+  for (i = 0; i < channel->sockets_alloc && nready < maxready; i++)
+    {
+      ares_socket_t fd = channel->sockets[i].fd;
+
+      if (fd == ARES_SOCKET_BAD || !FD_ISSET(fd, fds))
+        continue;
+      /* If there's an error and we close this socket, then open
+       * another with the same fd to talk to another server, then we
+       * don't want to think that it was the new socket that was
+       * ready. This is not disastrous, but is likely to result in
+       * extra system calls and confusion. */
+      FD_CLR(fd, fds);
+      ready[nready++] = fd;
+    }
+
+  for (i = 0; i < nready; i++)
+    process_socket(channel, ready[i], writable, now);
+
+  if (ready != local)
+    ares_free(ready);
+}
+
 /* If any queries have timed out, note the timeout and move them on. */
 static void process_timeouts(ares_channel channel, struct timeval *now)
 {
-  time_t t;  /* the time of the timeouts we're processing */
   struct query *query;
-  struct list_node* list_head;
+  struct rtt_estimate *rtt;
+  struct list_node timed_out;
   struct list_node* list_node;
 
-  /* Process all the timeouts that have fired since the last time we processed
-   * timeouts. If things are going well, then we'll have hundreds/thousands of
-   * queries that fall into future buckets, and only a handful of requests
-   * that fall into the "now" bucket, so this should be quite quick.
+  /* Take every query that has timed out off the top of the timeout heap
+   * first, so that the work done here is proportional to the number of
+   * expired queries, and so that a query re-armed by next_server() below
+   * can't be seen again in this pass.
    */
-  for (t = channel->last_timeout_processed; t <= now->tv_sec; t++)
+  ares__init_list_head(&timed_out);
+  while ((query = ares__next_timeout(channel)) != NULL &&
+         ares__timedout(now, &query->timeout))
     {
-      list_head = &(channel->queries_by_timeout[t % ARES_TIMEOUT_TABLE_SIZE]);
-      for (list_node = list_head->next; list_node != list_head; )
+      ares__remove_timeout(channel, query);
+      ares__insert_in_list(&(query->queries_timed_out), &timed_out);
+    }
+
+  /* Handling one query may end others, which removes them from this list,
+   * so always take the next one from the head.
+   */
+  while (!ares__is_list_empty(&timed_out))
+    {
+      list_node = timed_out.next;
+      query = list_node->data;
+      ares__remove_from_list(list_node);
+      if (query->hedge_armed)
         {
-          query = list_node->data;
-          list_node = list_node->next;  /* in case the query gets deleted */
-          if (query->timeout.tv_sec && ares__timedout(now, &query->timeout))
-            {
-              query->error_status = ARES_ETIMEOUT;
-              ++query->timeouts;
-              next_server(channel, query, now);
-            }
+          hedge_query(channel, query, now);
+          continue;
         }
-     }
-  channel->last_timeout_processed = now->tv_sec;
+      query->error_status = ARES_ETIMEOUT;
+      ++query->timeouts;
+      if (channel->flags &
+          (ARES_FLAG_ADAPTIVE_TIMEOUTS | ARES_FLAG_ADAPTIVE_SERVERS))
+        {
+          rtt = ares__query_rtt(channel, query, 1);
+          if (rtt)
+            ares__rtt_timed_out(rtt);
+        }
+      next_server(channel, query, now);
+    }
 }
 
 /* Handle an answer from a server. */
 static void process_answer(ares_channel channel, unsigned char *abuf,
                            int alen, int whichserver, int tcp,
+                           struct sockaddr *from,
+                           const struct ares_timestamp *rxtime,
                            struct timeval *now)
 {
-  int tc, rcode, packetsz;
+  int tc, rcode, packetsz, have_hash;
   unsigned short id;
+  unsigned int qname_hash;
+  long enclen;
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
+  struct rtt_estimate *rtt;
+  long usec, first_usec;
+  int sampled;
 
   /* If there's no room in the answer for a header, we can't do much
    * with it. */
@@ -534,26 +867,92 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
   tc = DNS_HEADER_TC(abuf);
   rcode = DNS_HEADER_RCODE(abuf);
 
-  /* Find the query corresponding to this packet. The queries are
-   * hashed/bucketed by query id, so this lookup should be quick.  Note that
+  /* Find the query corresponding to this packet. The queries are indexed
+   * directly by query id, so this lookup is a single table access.  Note that
    * both the query id and the questions must be the same; when the query id
    * wraps around we can have multiple outstanding queries with the same query
    * id, so we need to check both the id and question.
+   *
+   * A whichserver of -1 means the answer came in on the shared sockets used
+   * by ares_send_to(), so it can only be for such a query. Those are found
+   * by the address and port the answer came from along with the query id,
+   * which together identify at most one query.
    */
-  query = NULL;
-  list_head = &(channel->queries_by_qid[id % ARES_QID_TABLE_SIZE]);
-  for (list_node = list_head->next; list_node != list_head;
-       list_node = list_node->next)
+  if (whichserver < 0)
     {
-      struct query *q = list_node->data;
-      if ((q->qid == id) && same_questions(q->qbuf, q->qlen, abuf, alen))
+      struct ares_addr addr;
+
+      if (!sockaddr_to_addr(from, &addr))
+        return;
+      query = ares__find_query_by_dest(channel, &addr, id);
+      if (!query || !same_questions(query->qbuf, query->qlen, abuf, alen))
+        return;
+    }
+  else
+    {
+      have_hash = DNS_HEADER_QDCOUNT(abuf) == 1 &&
+        ares__name_hash(abuf + HFIXEDSZ, abuf, alen, &qname_hash, &enclen)
+          == ARES_SUCCESS;
+      for (query = ares__find_query_by_qid(channel, id); query;
+           query = query->qid_next)
         {
-          query = q;
-          break;
+          /* With a single question, a differing name hash is enough to
+           * tell this answer isn't for this query. */
+          if (have_hash && query->qname_hash != qname_hash)
+            continue;
+          if (same_questions(query->qbuf, query->qlen, abuf, alen))
+            break;
         }
+      if (!query)
+        return;
     }
-  if (!query)
-    return;
+
+  /* Note when the answer arrived, if the caller wants to know */
+  if (query->timed_callback || query->batched)
+    {
+      if (rxtime && rxtime->sec)
+        {
+          query->times.received = *rxtime;
+          query->times.kernel_received = 1;
+        }
+      else
+        {
+          ares__timestamp_now(&query->times.received);
+          query->times.kernel_received = 0;
+        }
+    }
+
+  /* Learn how quickly and how well the server answers. Only an answer to
+   * a query sent once to each server can't be the answer to some other
+   * attempt: one sent to a single server, or one hedged to a second. The
+   * answer is the server's it came from, which for a hedged query may be
+   * the first one's; the time until the first answer to a hedged query
+   * counts from its first attempt. */
+  usec = answer_usec(query, rxtime);
+  first_usec = usec;
+  sampled = query->try_count == 0;
+  if (query->try_count == 1 && query->hedged_from >= 0)
+    {
+      sampled = 1;
+      first_usec = usec +
+        (query->attempt_start.tv_sec - query->hedge_start.tv_sec) * 1000000L +
+        (query->attempt_start.tv_usec - query->hedge_start.tv_usec);
+      if (whichserver == query->hedged_from)
+        usec = first_usec;
+    }
+  if (channel->flags &
+      (ARES_FLAG_ADAPTIVE_TIMEOUTS | ARES_FLAG_ADAPTIVE_SERVERS))
+    {
+      rtt = query->has_dest ? ares__query_rtt(channel, query, 1) :
+        &channel->servers[whichserver].rtt;
+      if (rtt && !tcp && sampled)
+        ares__rtt_sample(rtt, usec);
+      if (rtt)
+        ares__rtt_answered(rtt, rcode == SERVFAIL || rcode == NOTIMP ||
+                                rcode == REFUSED);
+    }
+  if (channel->hedge_percentile && !tcp && !query->has_dest && sampled)
+    ares__hedge_sample(channel, first_usec);
 
   packetsz = PACKETSZ;
   /* If we use EDNS and server answers with one of these RCODES, the protocol
@@ -581,9 +980,11 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
 
   /* If we got a truncated UDP packet and are not ignoring truncation,
    * don't accept the packet, and switch the query to TCP if we hadn't
-   * done so already.
+   * done so already. Queries with their own destination never use TCP, so
+   * they take the truncated answer.
    */
-  if ((tc || alen > packetsz) && !tcp && !(channel->flags & ARES_FLAG_IGNTC))
+  if ((tc || alen > packetsz) && !tcp && !query->has_dest &&
+      !(channel->flags & ARES_FLAG_IGNTC))
     {
       if (!query->using_tcp)
         {
@@ -606,6 +1007,11 @@ static void process_answer(ares_channel channel, unsigned char *abuf,
     {
       if (rcode == SERVFAIL || rcode == NOTIMP || rcode == REFUSED)
         {
+          if (query->has_dest)
+            {
+              next_server(channel, query, now);
+              return;
+            }
           skip_server(channel, query, whichserver);
           if (query->server == whichserver)
             next_server(channel, query, now);
@@ -715,6 +1121,18 @@ static void next_server(ares_channel channel, struct query *query,
    * servers to try. In total, we need to do channel->nservers * channel->tries
    * attempts. Use query->try to remember how many times we already attempted
    * this query. Use modular arithmetic to find the next server to try. */
+  if (query->has_dest)
+    {
+      /* There's only the one destination to try. */
+      if (++(query->try_count) < channel->tries)
+        {
+          ares__send_query(channel, query, now);
+          return;
+        }
+      end_query(channel, query, query->error_status, NULL, 0);
+      return;
+    }
+
   while (++(query->try_count) < (channel->nservers * channel->tries))
     {
       struct server_state *server;
@@ -726,13 +1144,13 @@ static void next_server(ares_channel channel, struct query *query,
       /* We don't want to use this server if (1) we decided this connection is
        * broken, and thus about to be closed, (2) we've decided to skip this
        * server because of earlier errors we encountered, or (3) we already
-       * sent this query over this exact connection.
+       * sent this query over the exact connection it would go out on.
        */
       if (!server->is_broken &&
            !query->server_info[query->server].skip_server &&
            !(query->using_tcp &&
              (query->server_info[query->server].tcp_connection_generation ==
-              server->tcp_connection_generation)))
+              server->tcp[server->tcp_next].generation)))
         {
            ares__send_query(channel, query, now);
            return;
@@ -755,17 +1173,37 @@ void ares__send_query(ares_channel channel, struct query *query,
 {
   struct send_request *sendreq;
   struct server_state *server;
-  int timeplus;
+  struct tcp_connection *conn;
+  int whichconn;
+
+  /* A query still waiting to go out from an earlier attempt won't be sent
+   * for that attempt any more. */
+  ares__remove_from_list(&(query->queries_udp_pending));
+
+  /* Once a hedged query goes back to its first server, an answer from it
+   * could be for either attempt. */
+  if (query->server == query->hedged_from)
+    query->hedged_from = -1;
+
+  if (query->has_dest)
+    {
+      send_to_dest(channel, query, now);
+      return;
+    }
 
   server = &channel->servers[query->server];
   if (query->using_tcp)
     {
-      /* Make sure the TCP socket for this server is set up and queue
-       * a send request.
+      /* Take the server's connections in turn, so that the queries are
+       * pipelined over all of them. Make sure the TCP socket for this
+       * one is set up and queue a send request.
        */
-      if (server->tcp_socket == ARES_SOCKET_BAD)
+      whichconn = server->tcp_next;
+      server->tcp_next = (server->tcp_next + 1) % channel->tcp_conns;
+      conn = &server->tcp[whichconn];
+      if (conn->socket == ARES_SOCKET_BAD)
         {
-          if (open_tcp_socket(channel, server) == -1)
+          if (open_tcp_socket(channel, server, whichconn) == -1)
             {
               skip_server(channel, query, query->server);
               next_server(channel, query, now);
@@ -789,17 +1227,20 @@ void ares__send_query(ares_channel channel, struct query *query,
       sendreq->data = query->tcpbuf;
       sendreq->len = query->tcplen;
       sendreq->owner_query = query;
+      sendreq->server = server;
       sendreq->next = NULL;
-      if (server->qtail)
-        server->qtail->next = sendreq;
+      ares__init_list_node(&(sendreq->owner_node), sendreq);
+      ares__insert_in_list(&(sendreq->owner_node), &(query->sendreqs));
+      if (conn->qtail)
+        conn->qtail->next = sendreq;
       else
         {
-          SOCK_STATE_CALLBACK(channel, server->tcp_socket, 1, 1);
-          server->qhead = sendreq;
+          SOCK_STATE_CALLBACK(channel, conn->socket, 1, 1);
+          conn->qhead = sendreq;
         }
-      server->qtail = sendreq;
+      conn->qtail = sendreq;
       query->server_info[query->server].tcp_connection_generation =
-        server->tcp_connection_generation;
+        conn->generation;
     }
   else
     {
@@ -812,26 +1253,37 @@ void ares__send_query(ares_channel channel, struct query *query,
               return;
             }
         }
-      if (swrite(server->udp_socket, query->qbuf, query->qlen) == -1)
+      /* Once one query has had to wait for room in the send buffer, the
+       * ones after it wait in line too, so they go out in order. A full
+       * send buffer doesn't mean the server is bad, so don't skip it.
+       * With ARES_FLAG_BATCH_IO every query waits, and all those sent
+       * before the socket is next writable go out together.
+       */
+      if (channel->flags & ARES_FLAG_BATCH_IO)
+        queue_udp_send(channel, server->udp_socket, &server->udp_pending,
+                       query);
+      else if (!ares__is_list_empty(&server->udp_pending))
+        defer_udp_send(channel, server->udp_socket, &server->udp_pending,
+                       query);
+      else if (swrite(server->udp_socket, query->qbuf, query->qlen) == -1)
         {
-          /* FIXME: Handle EAGAIN here since it likely can happen. */
-          skip_server(channel, query, query->server);
-          next_server(channel, query, now);
-          return;
+          if (!try_again(SOCKERRNO))
+            {
+              skip_server(channel, query, query->server);
+              next_server(channel, query, now);
+              return;
+            }
+          defer_udp_send(channel, server->udp_socket, &server->udp_pending,
+                         query);
         }
+      else
+        mark_sent(query);
     }
-    timeplus = channel->timeout << (query->try_count / channel->nservers);
-    timeplus = (timeplus * (9 + (rand () & 7))) / 16;
-    query->timeout = *now;
-    timeadd(&query->timeout, timeplus);
-    /* Keep track of queries bucketed by timeout, so we can process
-     * timeout events quickly.
-     */
-    ares__remove_from_list(&(query->queries_by_timeout));
-    ares__insert_in_list(
-        &(query->queries_by_timeout),
-        &(channel->queries_by_timeout[query->timeout.tv_sec %
-                                      ARES_TIMEOUT_TABLE_SIZE]));
+    if (set_query_timeout(channel, query, now) != ARES_SUCCESS)
+      {
+        end_query(channel, query, ARES_ENOMEM, NULL, 0);
+        return;
+      }
 
     /* Keep track of queries bucketed by server, so we can process server
      * errors quickly.
@@ -841,6 +1293,338 @@ void ares__send_query(ares_channel channel, struct query *query,
                          &(server->queries_to_server));
 }
 
+/* Work out when the query's current attempt times out, and keep track of
+ * queries ordered by timeout, so we can process timeout events quickly.
+ */
+static int set_query_timeout(ares_channel channel, struct query *query,
+                             struct timeval *now)
+{
+  int nservers = query->has_dest ? 1 : channel->nservers;
+  int timeplus, hedge;
+
+  if (channel->flags & ARES_FLAG_ADAPTIVE_TIMEOUTS)
+    timeplus = ares__rtt_timeout(channel, ares__query_rtt(channel, query, 0),
+                                 query->try_count / nservers);
+  else
+    {
+      timeplus = channel->timeout << (query->try_count / nservers);
+      timeplus = (timeplus * (9 + (rand () & 7))) / 16;
+    }
+  query->timeout = *now;
+  timeadd(&query->timeout, timeplus);
+
+  /* With ARES_OPT_HEDGE, a query's first attempt that takes longer than
+   * most is sent to another server too, if that's before it times out. */
+  query->hedge_armed = 0;
+  if (channel->hedge_percentile && !query->has_dest && !query->using_tcp &&
+      query->try_count == 0 && channel->nservers > 1)
+    {
+      hedge = ares__hedge_delay(channel);
+      if (hedge > 0 && hedge < timeplus)
+        {
+          query->hedge_deadline = query->timeout;
+          query->timeout = *now;
+          timeadd(&query->timeout, hedge);
+          query->hedge_armed = 1;
+        }
+    }
+  return ares__set_timeout(channel, query);
+}
+
+/* Sends a query that has waited longer than most for an answer to the next
+ * server as well, if the hedging budget allows, without giving up on the
+ * first: the query takes whichever answer comes first, and the other then
+ * matches no query and is dropped. Otherwise the query goes on waiting
+ * until its attempt times out.
+ */
+static void hedge_query(ares_channel channel, struct query *query,
+                        struct timeval *now)
+{
+  int i, next;
+
+  query->hedge_armed = 0;
+  for (i = 1; i < channel->nservers; i++)
+    {
+      next = (query->server + i) % channel->nservers;
+      if (!channel->servers[next].is_broken &&
+          !query->server_info[next].skip_server)
+        break;
+    }
+  if (i < channel->nservers && ares__take_hedge(channel))
+    {
+      channel->stats.queries_hedged++;
+      query->hedged_from = query->server;
+      query->hedge_start = query->attempt_start;
+      query->try_count++;
+      query->server = next;
+      ares__send_query(channel, query, now);
+      return;
+    }
+
+  query->timeout = query->hedge_deadline;
+  if (ares__set_timeout(channel, query) != ARES_SUCCESS)
+    end_query(channel, query, ARES_ENOMEM, NULL, 0);
+}
+
+/* Returns the position of one of the channel's shared UDP sockets for the
+ * given family, opening it if need be, or -1 if it can't be opened. The
+ * sockets are used in turn, so that answers are spread over several receive
+ * buffers.
+ */
+static int pool_socket(ares_channel channel, int family)
+{
+  int index;
+  ares_socket_t fd;
+
+  index = (family == AF_INET6) * ARES_UDP_POOL_SIZE + channel->udp_pool_next;
+  channel->udp_pool_next = (channel->udp_pool_next + 1) % ARES_UDP_POOL_SIZE;
+  if (*ARES_POOL_SOCKET(channel, index) != ARES_SOCKET_BAD)
+    return index;
+
+  fd = socket(family, SOCK_DGRAM, 0);
+  if (fd == ARES_SOCKET_BAD)
+    return -1;
+
+  if (configure_socket(fd, family, channel) < 0)
+    {
+      sclose(fd);
+      return -1;
+    }
+  configure_udp_socket(fd, channel);
+
+  if (channel->sock_config_cb &&
+      channel->sock_config_cb(fd, SOCK_DGRAM,
+                              channel->sock_config_cb_data) < 0)
+    {
+      sclose(fd);
+      return -1;
+    }
+
+  if (channel->sock_create_cb &&
+      channel->sock_create_cb(fd, SOCK_DGRAM,
+                              channel->sock_create_cb_data) < 0)
+    {
+      sclose(fd);
+      return -1;
+    }
+
+  if (ares__add_socket(channel, fd, ARES_SOCKET_POOL, index) != ARES_SUCCESS)
+    {
+      sclose(fd);
+      return -1;
+    }
+
+  SOCK_STATE_CALLBACK(channel, fd, 1, 0);
+  *ARES_POOL_SOCKET(channel, index) = fd;
+  *ARES_POOL_DROPS_SEEN(channel, index) = 0;
+  return index;
+}
+
+/* Send a query given to ares_send_to() over one of the shared UDP sockets. */
+static void send_to_dest(ares_channel channel, struct query *query,
+                         struct timeval *now)
+{
+  union udp_sockaddr saddr;
+  ares_socklen_t salen;
+  struct list_node *pending;
+  ares_socket_t s;
+  int index;
+
+  index = pool_socket(channel, query->dest.family);
+  if (index < 0)
+    {
+      next_server(channel, query, now);
+      return;
+    }
+  s = *ARES_POOL_SOCKET(channel, index);
+  pending = ARES_POOL_PENDING(channel, index);
+
+  salen = fill_sockaddr(channel, &query->dest, &saddr);
+  if (channel->flags & ARES_FLAG_BATCH_IO)
+    queue_udp_send(channel, s, pending, query);
+  else if (!ares__is_list_empty(pending))
+    defer_udp_send(channel, s, pending, query);
+  else if (sendto(s, (void *)query->qbuf, (size_t)query->qlen, 0,
+                  &saddr.sa, salen) == -1)
+    {
+      if (!try_again(SOCKERRNO))
+        {
+          next_server(channel, query, now);
+          return;
+        }
+      defer_udp_send(channel, s, pending, query);
+    }
+  else
+    mark_sent(query);
+
+  if (set_query_timeout(channel, query, now) != ARES_SUCCESS)
+    end_query(channel, query, ARES_ENOMEM, NULL, 0);
+}
+
+/* Note when the query's current attempt went out, which may be well after
+ * it was queued if it had to wait for room in the send buffer, and tell the
+ * caller too if they want to know. Any answer to an earlier attempt no
+ * longer counts.
+ */
+static void mark_sent(struct query *query)
+{
+  query->attempt_start = ares__tvnow();
+  if (!query->timed_callback && !query->batched)
+    return;
+  ares__timestamp_now(&query->times.sent);
+  query->times.received.sec = 0;
+  query->times.received.nsec = 0;
+  query->times.kernel_received = 0;
+}
+
+/* How long the server took to answer the query's current attempt, in
+ * microseconds. It's the time between the send and receive timestamps the
+ * caller wants anyway, if there are both. Otherwise it's measured from when
+ * the query went out until now, less however long the answer waited in the
+ * receive buffer if the kernel stamped it, since the ares_process() call
+ * that read it may have started a while before.
+ */
+static long answer_usec(struct query *query,
+                        const struct ares_timestamp *rxtime)
+{
+  struct timeval now;
+  struct ares_timestamp ts;
+  long usec;
+
+  if ((query->timed_callback || query->batched) && query->times.sent.sec)
+    return (long)(query->times.received.sec - query->times.sent.sec) *
+      1000000L + (query->times.received.nsec - query->times.sent.nsec) / 1000;
+
+  now = ares__tvnow();
+  usec = (now.tv_sec - query->attempt_start.tv_sec) * 1000000L +
+    (now.tv_usec - query->attempt_start.tv_usec);
+  if (rxtime && rxtime->sec)
+    {
+      ares__timestamp_now(&ts);
+      usec -= (long)(ts.sec - rxtime->sec) * 1000000L +
+        (ts.nsec - rxtime->nsec) / 1000;
+    }
+  return usec > 0 ? usec : 0;
+}
+
+/* Queue a query to be sent once the UDP socket is writable, and ask to be
+ * told when it is.
+ */
+static void queue_udp_send(ares_channel channel, ares_socket_t s,
+                           struct list_node *pending, struct query *query)
+{
+  if (ares__is_list_empty(pending))
+    SOCK_STATE_CALLBACK(channel, s, 1, 1);
+  ares__insert_in_list(&(query->queries_udp_pending), pending);
+}
+
+/* Queue a query that has to wait for room in the UDP socket's send buffer */
+static void defer_udp_send(ares_channel channel, ares_socket_t s,
+                           struct list_node *pending, struct query *query)
+{
+  queue_udp_send(channel, s, pending, query);
+  channel->stats.udp_deferred_sends++;
+  if (!query->has_dest)
+    channel->servers[query->server].stats.udp_deferred_sends++;
+}
+
+/* The UDP socket is writable, so send the queries waiting for it in order,
+ * until its send buffer fills up again.
+ */
+static void flush_udp_pending(ares_channel channel, ares_socket_t s,
+                              struct list_node *pending, struct timeval *now)
+{
+  struct query *query;
+  int sent;
+
+  /* The queries that were waiting may all have ended since */
+  if (ares__is_list_empty(pending))
+    SOCK_STATE_CALLBACK(channel, s, 1, 0);
+
+  while (!ares__is_list_empty(pending))
+    {
+      sent = send_udp(channel, s, pending);
+      if (sent == -1 && try_again(SOCKERRNO))
+        return;
+
+      if (sent == -1)
+        {
+          query = pending->next->data;
+          ares__remove_from_list(&(query->queries_udp_pending));
+          if (ares__is_list_empty(pending))
+            SOCK_STATE_CALLBACK(channel, s, 1, 0);
+          /* Trying again may close the socket and clear the queue, which
+           * ends the loop. */
+          if (!query->has_dest)
+            skip_server(channel, query, query->server);
+          next_server(channel, query, now);
+          continue;
+        }
+
+      while (sent-- > 0)
+        {
+          query = pending->next->data;
+          ares__remove_from_list(&(query->queries_udp_pending));
+          mark_sent(query);
+        }
+      if (ares__is_list_empty(pending))
+        SOCK_STATE_CALLBACK(channel, s, 1, 0);
+    }
+}
+
+/* Send the query at the head of a UDP socket's queue, or with
+ * ARES_FLAG_BATCH_IO as many from the head as sendmmsg() takes at once.
+ * Returns how many were sent, or -1 with SOCKERRNO set if the first
+ * couldn't be.
+ */
+static int send_udp(ares_channel channel, ares_socket_t s,
+                    struct list_node *pending)
+{
+  union udp_sockaddr saddr;
+  ares_socklen_t salen;
+  struct query *query;
+  ssize_t rc;
+#ifdef USE_MMSG
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iovs[UDP_BATCH];
+  union udp_sockaddr saddrs[UDP_BATCH];
+  struct list_node *node;
+  int n = 0;
+
+  if (channel->flags & ARES_FLAG_BATCH_IO)
+    {
+      memset(msgs, 0, sizeof(msgs));
+      for (node = pending->next; node != pending && n < UDP_BATCH;
+           node = node->next, n++)
+        {
+          query = node->data;
+          iovs[n].iov_base = (void *)query->qbuf;
+          iovs[n].iov_len = (size_t)query->qlen;
+          msgs[n].msg_hdr.msg_iov = &iovs[n];
+          msgs[n].msg_hdr.msg_iovlen = 1;
+          if (query->has_dest)
+            {
+              msgs[n].msg_hdr.msg_name = &saddrs[n];
+              msgs[n].msg_hdr.msg_namelen =
+                fill_sockaddr(channel, &query->dest, &saddrs[n]);
+            }
+        }
+      return sendmmsg(s, msgs, (unsigned int)n, 0);
+    }
+#endif
+
+  query = pending->next->data;
+  if (query->has_dest)
+    {
+      salen = fill_sockaddr(channel, &query->dest, &saddr);
+      rc = (ssize_t)sendto(s, (void *)query->qbuf, (size_t)query->qlen, 0,
+                           &saddr.sa, salen);
+    }
+  else
+    rc = swrite(s, query->qbuf, query->qlen);
+  return rc == -1 ? -1 : 1;
+}
+
 /*
  * setsocknonblock sets the given socket to either blocking or non-blocking
  * mode based on the 'nonblock' boolean argument. This function is highly
@@ -959,8 +1743,32 @@ static int configure_socket(ares_socket_t s, int family, ares_channel channel)
   return 0;
 }
 
-static int open_tcp_socket(ares_channel channel, struct server_state *server)
+/* Ask the kernel to tell us, with each datagram, how many it has dropped on
+ * the socket for lack of receive buffer space, and if the channel wants
+ * them, when it arrived. Not every system can, which only means the drops
+ * go uncounted and the times are taken when the datagram is read.
+ */
+static void configure_udp_socket(ares_socket_t s, ares_channel channel)
+{
+  int on = 1;
+
+#ifdef SO_RXQ_OVFL
+  (void)setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, (void *)&on, sizeof(on));
+#endif
+#if defined(SO_RXQ_OVFL) && defined(SO_TIMESTAMPNS)
+  if (channel->flags & ARES_FLAG_KERNEL_TIMESTAMPS)
+    (void)setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, (void *)&on,
+                     sizeof(on));
+#endif
+  (void)s;
+  (void)channel;
+  (void)on;
+}
+
+static int open_tcp_socket(ares_channel channel, struct server_state *server,
+                           int whichconn)
 {
+  struct tcp_connection *conn = &server->tcp[whichconn];
   ares_socket_t s;
   int opt;
   ares_socklen_t salen;
@@ -1064,54 +1872,49 @@ static int open_tcp_socket(ares_channel channel, struct server_state *server)
         }
     }
 
+  if (ares__add_socket(channel, s, ARES_SOCKET_TCP,
+                       ARES_TCP_INDEX((int)(server - channel->servers),
+                                      whichconn)) != ARES_SUCCESS)
+    {
+      sclose(s);
+      return -1;
+    }
+
   SOCK_STATE_CALLBACK(channel, s, 1, 0);
-  server->tcp_buffer_pos = 0;
-  server->tcp_socket = s;
-  server->tcp_connection_generation = ++channel->tcp_connection_generation;
+  conn->buffer_len = 0;
+  conn->socket = s;
+  conn->generation = ++channel->tcp_connection_generation;
   return 0;
 }
 
-static int open_udp_socket(ares_channel channel, struct server_state *server)
+/* Connect the server's UDP socket to the server's address. This is also
+ * used to point an already connected socket at a different server.
+ */
+int ares__connect_udp_socket(ares_channel channel, struct server_state *server)
 {
-  ares_socket_t s;
+  union udp_sockaddr saddr;
   ares_socklen_t salen;
-  union {
-    struct sockaddr_in  sa4;
-    struct sockaddr_in6 sa6;
-  } saddr;
-  struct sockaddr *sa;
 
-  switch (server->addr.family)
+  salen = fill_sockaddr(channel, &server->addr, &saddr);
+  if (salen == 0)
+    return -1;  /* LCOV_EXCL_LINE */
+
+  if (connect(server->udp_socket, &saddr.sa, salen) == -1)
     {
-      case AF_INET:
-        sa = (void *)&saddr.sa4;
-        salen = sizeof(saddr.sa4);
-        memset(sa, 0, salen);
-        saddr.sa4.sin_family = AF_INET;
-        if (server->addr.udp_port) {
-          saddr.sa4.sin_port = aresx_sitous(server->addr.udp_port);
-        } else {
-          saddr.sa4.sin_port = aresx_sitous(channel->udp_port);
-        }
-        memcpy(&saddr.sa4.sin_addr, &server->addr.addrV4,
-               sizeof(server->addr.addrV4));
-        break;
-      case AF_INET6:
-        sa = (void *)&saddr.sa6;
-        salen = sizeof(saddr.sa6);
-        memset(sa, 0, salen);
-        saddr.sa6.sin6_family = AF_INET6;
-        if (server->addr.udp_port) {
-          saddr.sa6.sin6_port = aresx_sitous(server->addr.udp_port);
-        } else {
-          saddr.sa6.sin6_port = aresx_sitous(channel->udp_port);
-        }
-        memcpy(&saddr.sa6.sin6_addr, &server->addr.addrV6,
-               sizeof(server->addr.addrV6));
-        break;
-      default:
-        return -1;  /* LCOV_EXCL_LINE */
+      int err = SOCKERRNO;
+
+      if (err != EINPROGRESS && err != EWOULDBLOCK)
+        return -1;
     }
+  return 0;
+}
+
+static int open_udp_socket(ares_channel channel, struct server_state *server)
+{
+  ares_socket_t s;
+
+  if (server->addr.family != AF_INET && server->addr.family != AF_INET6)
+    return -1;  /* LCOV_EXCL_LINE */
 
   /* Acquire a socket. */
   s = socket(server->addr.family, SOCK_DGRAM, 0);
@@ -1124,6 +1927,7 @@ static int open_udp_socket(ares_channel channel, struct server_state *server)
        sclose(s);
        return -1;
     }
+  configure_udp_socket(s, channel);
 
   if (channel->sock_config_cb)
     {
@@ -1137,15 +1941,13 @@ static int open_udp_socket(ares_channel channel, struct server_state *server)
     }
 
   /* Connect to the server. */
-  if (connect(s, sa, salen) == -1)
+  server->udp_socket = s;
+  server->udp_drops_seen = 0;
+  if (ares__connect_udp_socket(channel, server) == -1)
     {
-      int err = SOCKERRNO;
-
-      if (err != EINPROGRESS && err != EWOULDBLOCK)
-        {
-          sclose(s);
-          return -1;
-        }
+      server->udp_socket = ARES_SOCKET_BAD;
+      sclose(s);
+      return -1;
     }
 
   if (channel->sock_create_cb)
@@ -1154,14 +1956,22 @@ static int open_udp_socket(ares_channel channel, struct server_state *server)
                                         channel->sock_create_cb_data);
       if (err < 0)
         {
+          server->udp_socket = ARES_SOCKET_BAD;
           sclose(s);
           return err;
         }
     }
 
+  if (ares__add_socket(channel, s, ARES_SOCKET_UDP,
+                       (int)(server - channel->servers)) != ARES_SUCCESS)
+    {
+      server->udp_socket = ARES_SOCKET_BAD;
+      sclose(s);
+      return -1;
+    }
+
   SOCK_STATE_CALLBACK(channel, s, 1, 0);
 
-  server->udp_socket = s;
   return 0;
 }
 
@@ -1171,8 +1981,9 @@ static int same_questions(const unsigned char *qbuf, int qlen,
   struct {
     const unsigned char *p;
     int qdcount;
-    char *name;
+    const unsigned char *name;
     long namelen;
+    unsigned int hash;
     int type;
     int dnsclass;
   } q, a;
@@ -1187,20 +1998,20 @@ static int same_questions(const unsigned char *qbuf, int qlen,
   if (q.qdcount != a.qdcount)
     return 0;
 
-  /* For each question in qbuf, find it in abuf. */
+  /* For each question in qbuf, find it in abuf. The names are compared in
+   * their wire format, so nothing needs to be allocated here.
+   */
   q.p = qbuf + HFIXEDSZ;
   for (i = 0; i < q.qdcount; i++)
     {
-      /* Decode the question in the query. */
-      if (ares_expand_name(q.p, qbuf, qlen, &q.name, &q.namelen)
+      /* Locate the question in the query. */
+      q.name = q.p;
+      if (ares__name_hash(q.p, qbuf, qlen, &q.hash, &q.namelen)
           != ARES_SUCCESS)
         return 0;
       q.p += q.namelen;
       if (q.p + QFIXEDSZ > qbuf + qlen)
-        {
-          ares_free(q.name);
-          return 0;
-        }
+        return 0;
       q.type = DNS_QUESTION_TYPE(q.p);
       q.dnsclass = DNS_QUESTION_CLASS(q.p);
       q.p += QFIXEDSZ;
@@ -1209,41 +2020,91 @@ static int same_questions(const unsigned char *qbuf, int qlen,
       a.p = abuf + HFIXEDSZ;
       for (j = 0; j < a.qdcount; j++)
         {
-          /* Decode the question in the answer. */
-          if (ares_expand_name(a.p, abuf, alen, &a.name, &a.namelen)
+          /* Locate the question in the answer. */
+          a.name = a.p;
+          if (ares__name_hash(a.p, abuf, alen, &a.hash, &a.namelen)
               != ARES_SUCCESS)
-            {
-              ares_free(q.name);
-              return 0;
-            }
+            return 0;
           a.p += a.namelen;
           if (a.p + QFIXEDSZ > abuf + alen)
-            {
-              ares_free(q.name);
-              ares_free(a.name);
-              return 0;
-            }
+            return 0;
           a.type = DNS_QUESTION_TYPE(a.p);
           a.dnsclass = DNS_QUESTION_CLASS(a.p);
           a.p += QFIXEDSZ;
 
-          /* Compare the decoded questions. */
-          if (strcasecmp(q.name, a.name) == 0 && q.type == a.type
-              && q.dnsclass == a.dnsclass)
-            {
-              ares_free(a.name);
-              break;
-            }
-          ares_free(a.name);
+          /* Compare the questions, looking at the names label by label only
+           * if everything else matches. */
+          if (q.hash == a.hash && q.type == a.type
+              && q.dnsclass == a.dnsclass
+              && ares__name_equal(q.name, qbuf, qlen, a.name, abuf, alen))
+            break;
         }
 
-      ares_free(q.name);
       if (j == a.qdcount)
         return 0;
     }
   return 1;
 }
 
+/* Fill in the socket address for sending UDP to the given address, using
+ * the channel's port if the address doesn't have one. Returns the length of
+ * the socket address, or 0 for an unknown family.
+ */
+static ares_socklen_t fill_sockaddr(ares_channel channel,
+                                    const struct ares_addr *addr,
+                                    union udp_sockaddr *saddr)
+{
+  switch (addr->family)
+    {
+      case AF_INET:
+        memset(&saddr->sa4, 0, sizeof(saddr->sa4));
+        saddr->sa4.sin_family = AF_INET;
+        if (addr->udp_port) {
+          saddr->sa4.sin_port = aresx_sitous(addr->udp_port);
+        } else {
+          saddr->sa4.sin_port = aresx_sitous(channel->udp_port);
+        }
+        memcpy(&saddr->sa4.sin_addr, &addr->addrV4, sizeof(addr->addrV4));
+        return sizeof(saddr->sa4);
+      case AF_INET6:
+        memset(&saddr->sa6, 0, sizeof(saddr->sa6));
+        saddr->sa6.sin6_family = AF_INET6;
+        if (addr->udp_port) {
+          saddr->sa6.sin6_port = aresx_sitous(addr->udp_port);
+        } else {
+          saddr->sa6.sin6_port = aresx_sitous(channel->udp_port);
+        }
+        memcpy(&saddr->sa6.sin6_addr, &addr->addrV6, sizeof(addr->addrV6));
+        return sizeof(saddr->sa6);
+      default:
+        return 0;  /* LCOV_EXCL_LINE */
+    }
+}
+
+/* Fill in the address and port the socket address refers to. Returns 0
+ * for an unknown family.
+ */
+static int sockaddr_to_addr(struct sockaddr *sa, struct ares_addr *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->family = sa->sa_family;
+  switch (sa->sa_family)
+    {
+      case AF_INET:
+        memcpy(&addr->addrV4, &((struct sockaddr_in *)sa)->sin_addr,
+               sizeof(addr->addrV4));
+        addr->udp_port = ((struct sockaddr_in *)sa)->sin_port;
+        return 1;
+      case AF_INET6:
+        memcpy(&addr->addrV6, &((struct sockaddr_in6 *)sa)->sin6_addr,
+               sizeof(addr->addrV6));
+        addr->udp_port = ((struct sockaddr_in6 *)sa)->sin6_port;
+        return 1;
+      default:
+        return 0;  /* LCOV_EXCL_LINE */
+    }
+}
+
 static int same_address(struct sockaddr *sa, struct ares_addr *aa)
 {
   void *addr1;
@@ -1272,64 +2133,84 @@ static int same_address(struct sockaddr *sa, struct ares_addr *aa)
   return 0; /* different */
 }
 
+/* Detach all of the query's queued sendreqs from its tcpbuf, which is
+ * about to be freed.  With copy set, each sendreq gets its own copy of the
+ * remaining data if possible; otherwise its server's connection is marked as
+ * broken.
+ */
+static void detach_sendreqs(struct query *query, int copy)
+{
+  struct send_request *sendreq;
+  struct list_node* list_node;
+
+  while (!ares__is_list_empty(&(query->sendreqs)))
+    {
+      list_node = query->sendreqs.next;
+      sendreq = list_node->data;
+      ares__remove_from_list(list_node);
+      sendreq->owner_query = NULL;
+      assert(sendreq->data_storage == NULL);
+      if (copy)
+        {
+          /* We got a reply for this query, but this queued sendreq
+           * points into this soon-to-be-gone query's tcpbuf. Probably
+           * this means we timed out and queued the query for
+           * retransmission, then received a response before actually
+           * retransmitting. This is perfectly fine, so we want to keep
+           * the connection running smoothly if we can. But in the worst
+           * case we may have sent only some prefix of the query, with
+           * some suffix of the query left to send. Also, the buffer may
+           * be queued on multiple queues. To prevent dangling pointers
+           * to the query's tcpbuf and handle these cases, we just give
+           * such sendreqs their own copy of the query packet.
+           */
+          sendreq->data_storage = ares_malloc(sendreq->len);
+          if (sendreq->data_storage != NULL)
+            {
+              memcpy(sendreq->data_storage, sendreq->data, sendreq->len);
+              sendreq->data = sendreq->data_storage;
+            }
+        }
+      if (!copy || (sendreq->data_storage == NULL))
+        {
+          /* We encountered an error (probably a timeout, suggesting the
+           * DNS server we're talking to is probably unreachable,
+           * wedged, or severely overloaded) or we couldn't copy the
+           * request, so mark the connection as broken. When we get to
+           * process_broken_connections() we'll close the connection and
+           * try to re-send requests to another server.
+           */
+          sendreq->server->is_broken = 1;
+          /* Just to be paranoid, zero out this sendreq... */
+          sendreq->data = NULL;
+          sendreq->len = 0;
+        }
+    }
+}
+
 static void end_query (ares_channel channel, struct query *query, int status,
                        unsigned char *abuf, int alen)
 {
   int i;
 
   /* First we check to see if this query ended while one of our send
-   * queues still has pointers to it.
+   * queues still has pointers to it. The query keeps a list of those
+   * sendreqs, so this doesn't need to look through the queues.
    */
-  for (i = 0; i < channel->nservers; i++)
-    {
-      struct server_state *server = &channel->servers[i];
-      struct send_request *sendreq;
-      for (sendreq = server->qhead; sendreq; sendreq = sendreq->next)
-        if (sendreq->owner_query == query)
-          {
-            sendreq->owner_query = NULL;
-            assert(sendreq->data_storage == NULL);
-            if (status == ARES_SUCCESS)
-              {
-                /* We got a reply for this query, but this queued sendreq
-                 * points into this soon-to-be-gone query's tcpbuf. Probably
-                 * this means we timed out and queued the query for
-                 * retransmission, then received a response before actually
-                 * retransmitting. This is perfectly fine, so we want to keep
-                 * the connection running smoothly if we can. But in the worst
-                 * case we may have sent only some prefix of the query, with
-                 * some suffix of the query left to send. Also, the buffer may
-                 * be queued on multiple queues. To prevent dangling pointers
-                 * to the query's tcpbuf and handle these cases, we just give
-                 * such sendreqs their own copy of the query packet.
-                 */
-               sendreq->data_storage = ares_malloc(sendreq->len);
-               if (sendreq->data_storage != NULL)
-                 {
-                   memcpy(sendreq->data_storage, sendreq->data, sendreq->len);
-                   sendreq->data = sendreq->data_storage;
-                 }
-              }
-            if ((status != ARES_SUCCESS) || (sendreq->data_storage == NULL))
-              {
-                /* We encountered an error (probably a timeout, suggesting the
-                 * DNS server we're talking to is probably unreachable,
-                 * wedged, or severely overloaded) or we couldn't copy the
-                 * request, so mark the connection as broken. When we get to
-                 * process_broken_connections() we'll close the connection and
-                 * try to re-send requests to another server.
-                 */
-               server->is_broken = 1;
-               /* Just to be paranoid, zero out this sendreq... */
-               sendreq->data = NULL;
-               sendreq->len = 0;
-             }
-          }
-    }
+  detach_sendreqs(query, status == ARES_SUCCESS);
+
+  /* Give the caller back the qid they asked for */
+  if (abuf && query->qid != query->user_qid)
+    DNS_HEADER_SET_QID(abuf, query->user_qid);
+
+  /* Keep the answer for the next time it's asked for, if we can. */
+  if (channel->cache_size && status == ARES_SUCCESS && abuf &&
+      !query->has_dest)
+    ares__cache_insert(channel, query->qbuf, query->qlen, abuf, alen);
 
   /* Invoke the callback */
-  query->callback(query->arg, status, query->timeouts, abuf, alen);
-  ares__free_query(query);
+  ares__query_callback(channel, query, status, query->timeouts, abuf, alen);
+  ares__free_query(channel, query);
 
   /* Simple cleanup policy: if no queries are remaining, close all network
    * sockets unless STAYOPEN is set.
@@ -1339,16 +2220,25 @@ static void end_query (ares_channel channel, struct query *query, int status,
     {
       for (i = 0; i < channel->nservers; i++)
         ares__close_sockets(channel, &channel->servers[i]);
+      ares__close_udp_pool(channel);
     }
 }
 
-void ares__free_query(struct query *query)
+void ares__free_query(ares_channel channel, struct query *query)
 {
   /* Remove the query from all the lists in which it is linked */
-  ares__remove_from_list(&(query->queries_by_qid));
-  ares__remove_from_list(&(query->queries_by_timeout));
+  if (query->has_dest)
+    ares__remove_query_by_dest(channel, query);
+  else
+    ares__remove_query_by_qid(channel, query);
+  ares__remove_coalescable(channel, query);
+  ares__remove_timeout(channel, query);
+  ares__remove_from_list(&(query->queries_timed_out));
   ares__remove_from_list(&(query->queries_to_server));
   ares__remove_from_list(&(query->all_queries));
+  ares__remove_from_list(&(query->queries_udp_pending));
+  /* Don't leave any queued sendreqs pointing at the freed tcpbuf */
+  detach_sendreqs(query, 0);
   /* Zero out some important stuff, to help catch bugs */
   query->callback = NULL;
   query->arg = NULL;
@@ -32,46 +32,217 @@
 #include "ares_dns.h"
 #include "ares_private.h"
 
-void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
-               ares_callback callback, void *arg)
+#define INITIAL_COMPLETIONS 64
+
+/* Add a batched query's outcome to the channel's ring of completions,
+ * growing it if it's full. */
+static void add_completion(ares_channel channel, void *arg, int status,
+                           int timeouts, unsigned char *abuf, int alen,
+                           const struct ares_query_times *times)
+{
+  struct ares_completion *completion;
+
+  if (channel->ncompletions == channel->completions_alloc)
+    {
+      int alloc = channel->completions_alloc ?
+        channel->completions_alloc * 2 : INITIAL_COMPLETIONS;
+      struct ares_completion *ring =
+        ares_malloc(alloc * sizeof(struct ares_completion));
+      int i;
+
+      if (!ring)
+        {
+          channel->stats.completions_dropped++;
+          return;
+        }
+      /* Unwrap the ring so that it starts at the beginning again. */
+      for (i = 0; i < channel->ncompletions; i++)
+        ring[i] = channel->completions[(channel->completions_head + i) &
+                                       (channel->completions_alloc - 1)];
+      if (channel->completions)
+        ares_free(channel->completions);
+      channel->completions = ring;
+      channel->completions_alloc = alloc;
+      channel->completions_head = 0;
+    }
+
+  completion = &channel->completions[(channel->completions_head +
+                                      channel->ncompletions) &
+                                     (channel->completions_alloc - 1)];
+  channel->ncompletions++;
+  completion->arg = arg;
+  completion->status = status;
+  completion->timeouts = timeouts;
+  completion->rcode = -1;
+  completion->flags = 0;
+  completion->rtt = -1;
+  if (abuf && alen >= HFIXEDSZ)
+    {
+      completion->rcode = DNS_HEADER_RCODE(abuf);
+      if (DNS_HEADER_AA(abuf))
+        completion->flags |= ARES_COMPLETION_AA;
+      if (DNS_HEADER_TC(abuf))
+        completion->flags |= ARES_COMPLETION_TC;
+      if (DNS_HEADER_RA(abuf))
+        completion->flags |= ARES_COMPLETION_RA;
+    }
+  if (times && times->received.sec)
+    {
+      completion->rtt = (long)(times->received.sec - times->sent.sec) *
+        1000000L + (times->received.nsec - times->sent.nsec) / 1000;
+      if (times->kernel_received)
+        completion->flags |= ARES_COMPLETION_KERNEL_TIME;
+    }
+}
+
+/* Tell the caller that their query failed before it could be sent. A
+ * query with neither kind of callback is a batched one. */
+static void send_failed(ares_channel channel, ares_callback callback,
+                        ares_timed_callback timed_callback, void *arg,
+                        int status)
+{
+  struct ares_query_times times;
+
+  if (timed_callback)
+    {
+      memset(&times, 0, sizeof(times));
+      timed_callback(arg, status, 0, NULL, 0, &times);
+    }
+  else if (callback)
+    callback(arg, status, 0, NULL, 0);
+  else
+    add_completion(channel, arg, status, 0, NULL, 0, NULL);
+}
+
+/* Give the caller a cached answer to their query. */
+static void send_cached(ares_channel channel, ares_callback callback,
+                        ares_timed_callback timed_callback, void *arg,
+                        unsigned char *abuf, int alen)
+{
+  struct ares_query_times times;
+
+  channel->stats.cache_hits++;
+  memset(&times, 0, sizeof(times));
+  ares__timestamp_now(&times.sent);
+  times.received = times.sent;
+  if (timed_callback)
+    timed_callback(arg, ARES_SUCCESS, 0, abuf, alen, &times);
+  else if (callback)
+    callback(arg, ARES_SUCCESS, 0, abuf, alen);
+  else
+    add_completion(channel, arg, ARES_SUCCESS, 0, abuf, alen, &times);
+  ares_free(abuf);
+}
+
+/* Have the caller wait on an outstanding query asking the same question.
+ * Returns 0 if there's no memory to. */
+static int add_waiter(ares_channel channel, struct query *query,
+                      const unsigned char *qbuf, ares_callback callback,
+                      ares_timed_callback timed_callback, void *arg)
+{
+  struct query_waiter *waiter = ares_malloc(sizeof(struct query_waiter));
+
+  if (!waiter)
+    return 0;
+  waiter->next = NULL;
+  waiter->qid = (unsigned short)DNS_HEADER_QID(qbuf);
+  waiter->callback = callback;
+  waiter->timed_callback = timed_callback;
+  waiter->arg = arg;
+  *query->waiters_tail = waiter;
+  query->waiters_tail = &waiter->next;
+  channel->stats.queries_coalesced++;
+  return 1;
+}
+
+static void send_query(ares_channel channel,
+                       const struct ares_addr_port_node *dest,
+                       const unsigned char *qbuf, int qlen,
+                       ares_callback callback,
+                       ares_timed_callback timed_callback, void *arg)
 {
   struct query *query;
-  int i, packetsz;
+  int i, packetsz, alen, have_hash;
+  long enclen;
   struct timeval now;
+  unsigned char *abuf;
 
   /* Verify that the query is at least long enough to hold the header. */
   if (qlen < HFIXEDSZ || qlen >= (1 << 16))
     {
-      callback(arg, ARES_EBADQUERY, 0, NULL, 0);
+      send_failed(channel, callback, timed_callback, arg, ARES_EBADQUERY);
+      return;
+    }
+
+  /* Answer from the cache if we can. Queries with their own destination
+   * always go out, as they're asking that server in particular. */
+  if (!dest && channel->cache_size &&
+      ares__cache_fetch(channel, qbuf, qlen, &abuf, &alen) == ARES_SUCCESS)
+    {
+      send_cached(channel, callback, timed_callback, arg, abuf, alen);
       return;
     }
 
+  /* Wait on an identical query if there's one outstanding, rather than
+   * sending another. */
+  if (!dest && (channel->flags & ARES_FLAG_COALESCE))
+    {
+      query = ares__find_coalescable(channel, qbuf, qlen);
+      if (query &&
+          add_waiter(channel, query, qbuf, callback, timed_callback, arg))
+        return;
+    }
+
+  /* Queries with their own destination only go out over UDP. */
+  packetsz = (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : PACKETSZ;
+  if (dest)
+    {
+#ifndef HAVE_RECVFROM
+      /* Without recvfrom() we couldn't tell who answered. */
+      send_failed(channel, callback, timed_callback, arg, ARES_ENOTIMP);
+      return;
+#endif
+      if (dest->family != AF_INET && dest->family != AF_INET6)
+        {
+          send_failed(channel, callback, timed_callback, arg, ARES_EBADFAMILY);
+          return;
+        }
+      if (qlen > packetsz)
+        {
+          send_failed(channel, callback, timed_callback, arg, ARES_EBADQUERY);
+          return;
+        }
+    }
+
   /* Allocate space for query and allocated fields. */
   query = ares_malloc(sizeof(struct query));
   if (!query)
     {
-      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      send_failed(channel, callback, timed_callback, arg, ARES_ENOMEM);
       return;
     }
   query->tcpbuf = ares_malloc(qlen + 2);
   if (!query->tcpbuf)
     {
       ares_free(query);
-      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      send_failed(channel, callback, timed_callback, arg, ARES_ENOMEM);
       return;
     }
-  query->server_info = ares_malloc(channel->nservers *
-                                   sizeof(query->server_info[0]));
-  if (!query->server_info)
+  query->server_info = NULL;
+  if (!dest)
+    query->server_info = ares_malloc(channel->nservers *
+                                     sizeof(query->server_info[0]));
+  if (!dest && !query->server_info)
     {
       ares_free(query->tcpbuf);
       ares_free(query);
-      callback(arg, ARES_ENOMEM, 0, NULL, 0);
+      send_failed(channel, callback, timed_callback, arg, ARES_ENOMEM);
       return;
     }
 
   /* Compute the query ID.  Start with no timeout. */
   query->qid = DNS_HEADER_QID(qbuf);
+  query->user_qid = query->qid;
   query->timeout.tv_sec = 0;
   query->timeout.tv_usec = 0;
 
@@ -87,45 +258,258 @@ void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
   query->qbuf = query->tcpbuf + 2;
   query->qlen = qlen;
   query->callback = callback;
+  query->timed_callback = timed_callback;
   query->arg = arg;
+  query->batched = !callback && !timed_callback;
+  memset(&query->times, 0, sizeof(query->times));
+
+  /* Hash the question name once, rather than expanding it for every answer
+   * that arrives with this query's id.
+   */
+  query->qname_hash = 0;
+  have_hash = qlen > HFIXEDSZ &&
+    ares__name_hash(qbuf + HFIXEDSZ, qbuf, qlen, &query->qname_hash,
+                    &enclen) == ARES_SUCCESS;
 
   /* Initialize query status. */
   query->try_count = 0;
+  query->hedged_from = -1;
 
-  /* Choose the server to send the query to. If rotation is enabled, keep track
-   * of the next server we want to use. */
-  query->server = channel->last_server;
-  if (channel->rotate == 1)
-    channel->last_server = (channel->last_server + 1) % channel->nservers;
-
-  for (i = 0; i < channel->nservers; i++)
+  if (dest)
     {
-      query->server_info[i].skip_server = 0;
-      query->server_info[i].tcp_connection_generation = 0;
+      /* Send the query to the given destination rather than to one of the
+       * channel's servers. */
+      query->has_dest = 1;
+      query->dest.family = dest->family;
+      if (dest->family == AF_INET)
+        memcpy(&query->dest.addrV4, &dest->addrV4, sizeof(dest->addrV4));
+      else
+        memcpy(&query->dest.addrV6, &dest->addrV6, sizeof(dest->addrV6));
+      if (dest->udp_port)
+        query->dest.udp_port = htons((unsigned short)dest->udp_port);
+      else
+        query->dest.udp_port = channel->udp_port;
+      query->dest.tcp_port = 0;
+      query->server = -1;
+      query->using_tcp = 0;
+
+      /* Answers are matched by destination and qid, so if the caller's qid
+       * is already in use for this destination, send the query with an
+       * unused one instead. The caller's qid goes back into the answer.
+       */
+      if (ares__find_query_by_dest(channel, &query->dest, query->qid))
+        {
+          unsigned short id = ares__generate_new_id(&channel->id_key);
+
+          for (i = 0; i < ARES_QID_TABLE_SIZE; i++, id++)
+            {
+              if (!ares__find_query_by_dest(channel, &query->dest, id))
+                break;
+            }
+          if (i == ARES_QID_TABLE_SIZE)
+            {
+              /* Every qid is taken for this destination. */
+              ares_free(query->tcpbuf);
+              ares_free(query);
+              send_failed(channel, callback, timed_callback, arg, ARES_ENOMEM);
+              return;
+            }
+          query->qid = id;
+          DNS_HEADER_SET_QID(query->tcpbuf + 2, id);
+        }
     }
+  else
+    {
+      query->has_dest = 0;
 
-  packetsz = (channel->flags & ARES_FLAG_EDNS) ? channel->ednspsz : PACKETSZ;
-  query->using_tcp = (channel->flags & ARES_FLAG_USEVC) || qlen > packetsz;
+      /* Choose the server to send the query to: the one doing best, or if
+       * rotation is enabled, keep track of the next server we want to use. */
+      if (channel->flags & ARES_FLAG_ADAPTIVE_SERVERS)
+        query->server = ares__choose_server(channel);
+      else
+        {
+          query->server = channel->last_server;
+          if (channel->rotate == 1)
+            channel->last_server =
+              (channel->last_server + 1) % channel->nservers;
+        }
+
+      for (i = 0; i < channel->nservers; i++)
+        {
+          query->server_info[i].skip_server = 0;
+          query->server_info[i].tcp_connection_generation = 0;
+        }
+
+      query->using_tcp = (channel->flags & ARES_FLAG_USEVC) || qlen > packetsz;
+    }
 
   query->error_status = ARES_ECONNREFUSED;
   query->timeouts = 0;
+  query->hedge_armed = 0;
 
   /* Initialize our list nodes. */
-  ares__init_list_node(&(query->queries_by_qid),     query);
-  ares__init_list_node(&(query->queries_by_timeout), query);
+  query->qid_next = NULL;
+  query->coalesce_next = NULL;
+  query->coalescable = 0;
+  query->waiters = NULL;
+  query->waiters_tail = &query->waiters;
+  query->timeout_index = -1;
+  ares__init_list_node(&(query->queries_timed_out), query);
   ares__init_list_node(&(query->queries_to_server),  query);
   ares__init_list_node(&(query->all_queries),        query);
+  ares__init_list_node(&(query->queries_udp_pending), query);
+  ares__init_list_head(&(query->sendreqs));
 
+  /* Keep track of queries indexed by qid, or by destination and qid, so we
+   * can process DNS responses quickly.
+   */
+  if (query->has_dest)
+    {
+      if (ares__insert_query_by_dest(channel, query) != ARES_SUCCESS)
+        {
+          ares_free(query->tcpbuf);
+          ares_free(query);
+          send_failed(channel, callback, timed_callback, arg, ARES_ENOMEM);
+          return;
+        }
+    }
+  else
+    {
+      ares__insert_query_by_qid(channel, query);
+      if ((channel->flags & ARES_FLAG_COALESCE) && have_hash &&
+          DNS_HEADER_QDCOUNT(qbuf) == 1)
+        ares__insert_coalescable(channel, query);
+    }
   /* Chain the query into the list of all queries. */
   ares__insert_in_list(&(query->all_queries), &(channel->all_queries));
-  /* Keep track of queries bucketed by qid, so we can process DNS
-   * responses quickly.
-   */
-  ares__insert_in_list(
-    &(query->queries_by_qid),
-    &(channel->queries_by_qid[query->qid % ARES_QID_TABLE_SIZE]));
 
   /* Perform the first query action. */
   now = ares__tvnow();
   ares__send_query(channel, query, &now);
 }
+
+void ares_send(ares_channel channel, const unsigned char *qbuf, int qlen,
+               ares_callback callback, void *arg)
+{
+  send_query(channel, NULL, qbuf, qlen, callback, NULL, arg);
+}
+
+/* Like ares_send(), but the query is sent to the given address instead of
+ * the channel's servers, so one channel can talk to any number of servers
+ * without reconfiguring it.
+ */
+void ares_send_to(ares_channel channel, const struct ares_addr_port_node *dest,
+                  const unsigned char *qbuf, int qlen,
+                  ares_callback callback, void *arg)
+{
+  if (!dest)
+    {
+      callback(arg, ARES_EBADQUERY, 0, NULL, 0);
+      return;
+    }
+  send_query(channel, dest, qbuf, qlen, callback, NULL, arg);
+}
+
+/* Like ares_send() and ares_send_to(), but the callback also gets to know
+ * when the query was sent and its answer received. With
+ * ARES_FLAG_KERNEL_TIMESTAMPS the receive time comes from the kernel, so
+ * it doesn't include the time the answer spent waiting to be read.
+ */
+void ares_send_timed(ares_channel channel, const unsigned char *qbuf,
+                     int qlen, ares_timed_callback callback, void *arg)
+{
+  send_query(channel, NULL, qbuf, qlen, NULL, callback, arg);
+}
+
+void ares_send_to_timed(ares_channel channel,
+                        const struct ares_addr_port_node *dest,
+                        const unsigned char *qbuf, int qlen,
+                        ares_timed_callback callback, void *arg)
+{
+  if (!dest)
+    {
+      send_failed(channel, NULL, callback, arg, ARES_EBADQUERY);
+      return;
+    }
+  send_query(channel, dest, qbuf, qlen, NULL, callback, arg);
+}
+
+/* Like ares_send() and ares_send_to(), but instead of a callback being
+ * invoked for each query, the outcome is added to a ring of completions
+ * that the caller takes in bulk with ares_get_completions().
+ */
+void ares_send_batched(ares_channel channel, const unsigned char *qbuf,
+                       int qlen, void *arg)
+{
+  send_query(channel, NULL, qbuf, qlen, NULL, NULL, arg);
+}
+
+void ares_send_to_batched(ares_channel channel,
+                          const struct ares_addr_port_node *dest,
+                          const unsigned char *qbuf, int qlen, void *arg)
+{
+  if (!dest)
+    {
+      send_failed(channel, NULL, NULL, arg, ARES_EBADQUERY);
+      return;
+    }
+  send_query(channel, dest, qbuf, qlen, NULL, NULL, arg);
+}
+
+/* Takes up to ncompletions of the oldest completions off the channel's
+ * ring, and returns how many it took. */
+int ares_get_completions(ares_channel channel,
+                         struct ares_completion *completions,
+                         int ncompletions)
+{
+  int n = 0;
+
+  while (n < ncompletions && channel->ncompletions > 0)
+    {
+      completions[n++] = channel->completions[channel->completions_head];
+      channel->completions_head = (channel->completions_head + 1) &
+        (channel->completions_alloc - 1);
+      channel->ncompletions--;
+    }
+  return n;
+}
+
+static void invoke_callback(ares_channel channel, ares_callback callback,
+                            ares_timed_callback timed_callback, void *arg,
+                            int status, int timeouts, unsigned char *abuf,
+                            int alen, const struct ares_query_times *times)
+{
+  if (timed_callback)
+    timed_callback(arg, status, timeouts, abuf, alen, times);
+  else if (callback)
+    callback(arg, status, timeouts, abuf, alen);
+  else
+    add_completion(channel, arg, status, timeouts, abuf, alen, times);
+}
+
+/* Invoke the query's callback, whichever kind it has, and then those of
+ * any callers waiting on it, each with the answer under its own qid */
+void ares__query_callback(ares_channel channel, struct query *query,
+                          int status, int timeouts,
+                          unsigned char *abuf, int alen)
+{
+  struct query_waiter *waiter, *waiters = query->waiters;
+
+  /* Nobody else gets to wait on a query that's finished. */
+  ares__remove_coalescable(channel, query);
+  query->waiters = NULL;
+  query->waiters_tail = &query->waiters;
+
+  invoke_callback(channel, query->callback, query->timed_callback,
+                  query->arg, status, timeouts, abuf, alen, &query->times);
+  while ((waiter = waiters) != NULL)
+    {
+      waiters = waiter->next;
+      if (abuf)
+        DNS_HEADER_SET_QID(abuf, waiter->qid);
+      invoke_callback(channel, waiter->callback, waiter->timed_callback,
+                      waiter->arg, status, timeouts, abuf, alen,
+                      &query->times);
+      ares_free(waiter);
+    }
+}
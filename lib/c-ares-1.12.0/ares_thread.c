@@ -0,0 +1,610 @@
+/* Copyright (C) 2017 by the c-ares contributors
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose and without fee is hereby granted, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of M.I.T. not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  M.I.T. makes no representations about the
+ * suitability of this software for any purpose.  It is provided "as is"
+ * without express or implied warranty.
+ */
+
+#include "ares_setup.h"
+
+/* The I/O thread needs POSIX threads and the compiler's atomic builtins;
+ * without them the functions below fail with ARES_ENOTIMP. */
+#if !defined(WIN32) && !defined(WATT32) && defined(__ATOMIC_ACQUIRE)
+#define USE_IO_THREAD
+#endif
+
+#ifdef USE_IO_THREAD
+#include <pthread.h>
+#include <sched.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#endif
+
+#ifdef HAVE_ARPA_NAMESER_H
+#  include <arpa/nameser.h>
+#else
+#  include "nameser.h"
+#endif
+#ifdef HAVE_ARPA_NAMESER_COMPAT_H
+#  include <arpa/nameser_compat.h>
+#endif
+
+#include "ares.h"
+#include "ares_private.h"
+
+#ifdef USE_IO_THREAD
+
+/* Routines for running a channel on a thread of its own. Other threads
+ * hand it queries through a bounded ring without taking any lock, and get
+ * the answers back through completion queues, which are unbounded lists
+ * that the I/O thread pushes onto, again without a lock. Each side only
+ * makes a system call, a write to a pipe, when the other may be asleep.
+ *
+ * The ring is an array of slots, each with a sequence number that says
+ * whether it's free for the submission at a given position or holds the
+ * one to be sent next. Submitters claim positions with a compare and swap;
+ * only the I/O thread takes submissions out.
+ */
+
+#define DEFAULT_QUEUE_SIZE 256
+
+/* A query on its way through the I/O thread. It doubles as the node that
+ * carries its answer back through a completion queue. */
+struct ares_thread_request {
+  struct ares_thread_request *next;
+  ares_completion_queue cq;
+  void *arg;
+  int has_dest;
+  struct ares_addr_port_node dest;
+  /* The query, and then the answer */
+  unsigned char *buf;
+  int len;
+  int status;
+  int timeouts;
+};
+
+struct ring_slot {
+  unsigned long seq;
+  struct ares_thread_request *request;
+};
+
+struct ares_io_thread {
+  pthread_t thread;
+  struct ring_slot *ring;
+  unsigned long mask;
+  unsigned long enqueue_pos;  /* claimed by submitters */
+  unsigned long dequeue_pos;  /* the I/O thread's own */
+  /* Written to wake the I/O thread up, if wake_pending wasn't set already */
+  int wake_fds[2];
+  int wake_pending;
+  int stop;
+};
+
+struct ares_completion_queuedata {
+  /* Requests are pushed at head and taken from tail; the list always holds
+   * at least one node, the stub when it is otherwise empty. */
+  struct ares_thread_request *head;
+  struct ares_thread_request *tail;
+  struct ares_thread_request stub;
+  /* Written to wake the owner up, if waiting is set */
+  int wake_fds[2];
+  int waiting;
+};
+
+static int open_wake_pipe(int fds[2])
+{
+  int i, flags;
+
+  if (pipe(fds) != 0)
+    return ARES_ENOMEM;
+  for (i = 0; i < 2; i++)
+    {
+      flags = fcntl(fds[i], F_GETFL, 0);
+      fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+  return ARES_SUCCESS;
+}
+
+static void close_wake_pipe(int fds[2])
+{
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void drain_wake_pipe(int fd)
+{
+  char buf[64];
+
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+static void wake_io_thread(struct ares_io_thread *t)
+{
+  if (__atomic_exchange_n(&t->wake_pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+      /* The pipe can only be full if the thread has a wakeup coming. */
+      if (write(t->wake_fds[1], "", 1) < 0)
+        return;
+    }
+}
+
+/* Adds a request to the ring; fails if the ring is full. */
+static int ring_push(struct ares_io_thread *t,
+                     struct ares_thread_request *request)
+{
+  unsigned long pos = __atomic_load_n(&t->enqueue_pos, __ATOMIC_RELAXED);
+  struct ring_slot *slot;
+  long diff;
+
+  for (;;)
+    {
+      slot = &t->ring[pos & t->mask];
+      diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0)
+        {
+          /* On failure this reloads pos. */
+          if (__atomic_compare_exchange_n(&t->enqueue_pos, &pos, pos + 1, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        return 0;
+      else
+        pos = __atomic_load_n(&t->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  slot->request = request;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Takes the next request out of the ring, or returns NULL. Only the I/O
+ * thread calls this. */
+static struct ares_thread_request *ring_pop(struct ares_io_thread *t)
+{
+  struct ring_slot *slot = &t->ring[t->dequeue_pos & t->mask];
+  struct ares_thread_request *request;
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t->dequeue_pos + 1)
+    return NULL;
+  request = slot->request;
+  __atomic_store_n(&slot->seq, t->dequeue_pos + t->mask + 1,
+                   __ATOMIC_RELEASE);
+  t->dequeue_pos++;
+  return request;
+}
+
+static void cq_push(ares_completion_queue cq,
+                    struct ares_thread_request *request)
+{
+  struct ares_thread_request *prev;
+
+  __atomic_store_n(&request->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&cq->head, request, __ATOMIC_SEQ_CST);
+  /* Until this store the list is cut short after prev; the owner sees it
+   * as empty then, and is woken up below if it goes to sleep. */
+  __atomic_store_n(&prev->next, request, __ATOMIC_SEQ_CST);
+}
+
+static void complete(struct ares_thread_request *request)
+{
+  ares_completion_queue cq = request->cq;
+
+  cq_push(cq, request);
+  if (__atomic_exchange_n(&cq->waiting, 0, __ATOMIC_SEQ_CST))
+    {
+      if (write(cq->wake_fds[1], "", 1) < 0)
+        return;
+    }
+}
+
+/* Takes the oldest completed request off the queue, or returns NULL. Only
+ * the queue's owner calls this. */
+static struct ares_thread_request *cq_pop(ares_completion_queue cq)
+{
+  struct ares_thread_request *tail = cq->tail;
+  struct ares_thread_request *next;
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+  if (tail == &cq->stub)
+    {
+      if (!next)
+        return NULL;
+      cq->tail = next;
+      tail = next;
+      next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    }
+  if (next)
+    {
+      cq->tail = next;
+      return tail;
+    }
+  /* tail is the last node. Unless a push is still linking in a later one,
+   * put the stub back behind it so that tail can be taken off. */
+  if (tail != __atomic_load_n(&cq->head, __ATOMIC_SEQ_CST))
+    return NULL;
+  cq_push(cq, &cq->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+  if (next)
+    {
+      cq->tail = next;
+      return tail;
+    }
+  return NULL;
+}
+
+static void free_request(struct ares_thread_request *request)
+{
+  if (request->buf)
+    ares_free(request->buf);
+  ares_free(request);
+}
+
+static void thread_callback(void *arg, int status, int timeouts,
+                            unsigned char *abuf, int alen)
+{
+  struct ares_thread_request *request = arg;
+
+  /* ares_send() has its own copy of the query by now. */
+  ares_free(request->buf);
+  request->buf = NULL;
+  request->len = 0;
+  if (abuf)
+    {
+      request->buf = ares_malloc(alen);
+      if (request->buf)
+        {
+          memcpy(request->buf, abuf, alen);
+          request->len = alen;
+        }
+      else
+        status = ARES_ENOMEM;
+    }
+  request->status = status;
+  request->timeouts = timeouts;
+  complete(request);
+}
+
+static void *io_thread_main(void *data)
+{
+  ares_channel channel = data;
+  struct ares_io_thread *t = channel->io_thread;
+  struct ares_thread_request *request;
+  fd_set read_fds, write_fds;
+  struct timeval tv, *tvp;
+  int nfds;
+
+  for (;;)
+    {
+      while ((request = ring_pop(t)) != NULL)
+        {
+          if (request->has_dest)
+            ares_send_to(channel, &request->dest, request->buf, request->len,
+                         thread_callback, request);
+          else
+            ares_send(channel, request->buf, request->len,
+                      thread_callback, request);
+        }
+      if (__atomic_load_n(&t->stop, __ATOMIC_SEQ_CST))
+        break;
+
+      FD_ZERO(&read_fds);
+      FD_ZERO(&write_fds);
+      nfds = ares_fds(channel, &read_fds, &write_fds);
+      FD_SET(t->wake_fds[0], &read_fds);
+      if (t->wake_fds[0] >= nfds)
+        nfds = t->wake_fds[0] + 1;
+      tvp = ares_timeout(channel, NULL, &tv);
+      if (select(nfds, &read_fds, &write_fds, NULL, tvp) < 0)
+        {
+          FD_ZERO(&read_fds);
+          FD_ZERO(&write_fds);
+        }
+      if (FD_ISSET(t->wake_fds[0], &read_fds))
+        {
+          drain_wake_pipe(t->wake_fds[0]);
+          __atomic_store_n(&t->wake_pending, 0, __ATOMIC_SEQ_CST);
+          FD_CLR(t->wake_fds[0], &read_fds);
+        }
+      ares_process(channel, &read_fds, &write_fds);
+    }
+
+  ares_cancel(channel);
+  while ((request = ring_pop(t)) != NULL)
+    {
+      ares_free(request->buf);
+      request->buf = NULL;
+      request->len = 0;
+      request->status = ARES_ECANCELLED;
+      request->timeouts = 0;
+      complete(request);
+    }
+  return NULL;
+}
+
+int ares_thread_start(ares_channel channel, int queue_size)
+{
+  struct ares_io_thread *t;
+  unsigned long size, i;
+  int status;
+
+  if (channel->io_thread)
+    return ARES_EBADFLAGS;
+
+  if (queue_size <= 0)
+    queue_size = DEFAULT_QUEUE_SIZE;
+  for (size = 2; size < (unsigned long)queue_size; size *= 2)
+    ;
+
+  t = ares_malloc(sizeof(struct ares_io_thread));
+  if (!t)
+    return ARES_ENOMEM;
+  t->ring = ares_malloc(size * sizeof(struct ring_slot));
+  if (!t->ring)
+    {
+      ares_free(t);
+      return ARES_ENOMEM;
+    }
+  for (i = 0; i < size; i++)
+    t->ring[i].seq = i;
+  t->mask = size - 1;
+  t->enqueue_pos = 0;
+  t->dequeue_pos = 0;
+  t->wake_pending = 0;
+  t->stop = 0;
+  status = open_wake_pipe(t->wake_fds);
+  if (status != ARES_SUCCESS)
+    {
+      ares_free(t->ring);
+      ares_free(t);
+      return status;
+    }
+
+  channel->io_thread = t;
+  if (pthread_create(&t->thread, NULL, io_thread_main, channel) != 0)
+    {
+      channel->io_thread = NULL;
+      close_wake_pipe(t->wake_fds);
+      ares_free(t->ring);
+      ares_free(t);
+      return ARES_ENOMEM;
+    }
+  return ARES_SUCCESS;
+}
+
+void ares_thread_stop(ares_channel channel)
+{
+  struct ares_io_thread *t = channel->io_thread;
+
+  if (!t)
+    return;
+
+  __atomic_store_n(&t->stop, 1, __ATOMIC_SEQ_CST);
+  wake_io_thread(t);
+  pthread_join(t->thread, NULL);
+
+  channel->io_thread = NULL;
+  close_wake_pipe(t->wake_fds);
+  ares_free(t->ring);
+  ares_free(t);
+}
+
+int ares_thread_send(ares_channel channel,
+                     const struct ares_addr_port_node *dest,
+                     const unsigned char *qbuf, int qlen,
+                     ares_completion_queue cq, void *arg)
+{
+  struct ares_io_thread *t = channel->io_thread;
+  struct ares_thread_request *request;
+
+  if (!t)
+    return ARES_ENOTINITIALIZED;
+  if (qlen < HFIXEDSZ || qlen >= (1 << 16))
+    return ARES_EBADQUERY;
+
+  request = ares_malloc(sizeof(struct ares_thread_request));
+  if (!request)
+    return ARES_ENOMEM;
+  request->buf = ares_malloc(qlen);
+  if (!request->buf)
+    {
+      ares_free(request);
+      return ARES_ENOMEM;
+    }
+  memcpy(request->buf, qbuf, qlen);
+  request->len = qlen;
+  request->next = NULL;
+  request->cq = cq;
+  request->arg = arg;
+  request->has_dest = dest != NULL;
+  if (dest)
+    {
+      request->dest = *dest;
+      request->dest.next = NULL;
+    }
+  request->status = ARES_SUCCESS;
+  request->timeouts = 0;
+
+  /* A full ring means the I/O thread is behind; let it catch up. */
+  while (!ring_push(t, request))
+    {
+      wake_io_thread(t);
+      sched_yield();
+    }
+  wake_io_thread(t);
+  return ARES_SUCCESS;
+}
+
+int ares_completion_queue_create(ares_completion_queue *cqp)
+{
+  ares_completion_queue cq;
+  int status;
+
+  cq = ares_malloc(sizeof(struct ares_completion_queuedata));
+  if (!cq)
+    return ARES_ENOMEM;
+  status = open_wake_pipe(cq->wake_fds);
+  if (status != ARES_SUCCESS)
+    {
+      ares_free(cq);
+      return status;
+    }
+  cq->stub.next = NULL;
+  cq->head = &cq->stub;
+  cq->tail = &cq->stub;
+  cq->waiting = 0;
+  *cqp = cq;
+  return ARES_SUCCESS;
+}
+
+void ares_completion_queue_destroy(ares_completion_queue cq)
+{
+  struct ares_thread_request *request;
+
+  if (!cq)
+    return;
+  while ((request = cq_pop(cq)) != NULL)
+    free_request(request);
+  close_wake_pipe(cq->wake_fds);
+  ares_free(cq);
+}
+
+int ares_completion_queue_wait(ares_completion_queue cq,
+                               struct ares_thread_completion *completions,
+                               int ncompletions, int timeout_ms)
+{
+  struct ares_thread_request *request;
+  struct timeval now, deadline, tv;
+  fd_set read_fds;
+  long left;
+  int n = 0;
+
+  if (timeout_ms > 0)
+    {
+      deadline = ares__tvnow();
+      deadline.tv_sec += timeout_ms / 1000;
+      deadline.tv_usec += (timeout_ms % 1000) * 1000;
+      if (deadline.tv_usec >= 1000000)
+        {
+          deadline.tv_sec++;
+          deadline.tv_usec -= 1000000;
+        }
+    }
+
+  for (;;)
+    {
+      while (n < ncompletions && (request = cq_pop(cq)) != NULL)
+        {
+          completions[n].arg = request->arg;
+          completions[n].status = request->status;
+          completions[n].timeouts = request->timeouts;
+          completions[n].abuf = request->buf;
+          completions[n].alen = request->len;
+          ares_free(request);
+          n++;
+        }
+      if (n > 0 || ncompletions <= 0 || timeout_ms == 0)
+        return n;
+
+      /* Tell the I/O thread to wake us up, then look once more, in case
+       * something was completed before it could see that. */
+      __atomic_store_n(&cq->waiting, 1, __ATOMIC_SEQ_CST);
+      request = cq_pop(cq);
+      if (request)
+        {
+          __atomic_store_n(&cq->waiting, 0, __ATOMIC_SEQ_CST);
+          completions[n].arg = request->arg;
+          completions[n].status = request->status;
+          completions[n].timeouts = request->timeouts;
+          completions[n].abuf = request->buf;
+          completions[n].alen = request->len;
+          ares_free(request);
+          n++;
+          continue;
+        }
+
+      FD_ZERO(&read_fds);
+      FD_SET(cq->wake_fds[0], &read_fds);
+      if (timeout_ms > 0)
+        {
+          now = ares__tvnow();
+          left = (deadline.tv_sec - now.tv_sec) * 1000 +
+                 (deadline.tv_usec - now.tv_usec) / 1000;
+          if (left <= 0)
+            {
+              __atomic_store_n(&cq->waiting, 0, __ATOMIC_SEQ_CST);
+              return 0;
+            }
+          tv.tv_sec = left / 1000;
+          tv.tv_usec = (left % 1000) * 1000;
+          select(cq->wake_fds[0] + 1, &read_fds, NULL, NULL, &tv);
+        }
+      else
+        select(cq->wake_fds[0] + 1, &read_fds, NULL, NULL, NULL);
+      drain_wake_pipe(cq->wake_fds[0]);
+    }
+}
+
+#else /* !USE_IO_THREAD */
+
+int ares_thread_start(ares_channel channel, int queue_size)
+{
+  (void)channel;
+  (void)queue_size;
+  return ARES_ENOTIMP;
+}
+
+void ares_thread_stop(ares_channel channel)
+{
+  (void)channel;
+}
+
+int ares_thread_send(ares_channel channel,
+                     const struct ares_addr_port_node *dest,
+                     const unsigned char *qbuf, int qlen,
+                     ares_completion_queue cq, void *arg)
+{
+  (void)channel;
+  (void)dest;
+  (void)qbuf;
+  (void)qlen;
+  (void)cq;
+  (void)arg;
+  return ARES_ENOTIMP;
+}
+
+int ares_completion_queue_create(ares_completion_queue *cqp)
+{
+  *cqp = NULL;
+  return ARES_ENOTIMP;
+}
+
+void ares_completion_queue_destroy(ares_completion_queue cq)
+{
+  (void)cq;
+}
+
+int ares_completion_queue_wait(ares_completion_queue cq,
+                               struct ares_thread_completion *completions,
+                               int ncompletions, int timeout_ms)
+{
+  (void)cq;
+  (void)completions;
+  (void)ncompletions;
+  (void)timeout_ms;
+  return 0;
+}
+
+#endif /* USE_IO_THREAD */
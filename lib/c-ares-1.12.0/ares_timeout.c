@@ -16,73 +16,53 @@
 
 #include "ares_setup.h"
 
-#ifdef HAVE_LIMITS_H
-#include <limits.h>
-#endif
-
 #include "ares.h"
 #include "ares_private.h"
 
-/* return time offset between now and (future) check, in milliseconds */
-static long timeoffset(struct timeval *now, struct timeval *check)
-{
-  return (check->tv_sec - now->tv_sec)*1000 +
-         (check->tv_usec - now->tv_usec)/1000;
-}
-
-/* WARNING: Beware that this is linear in the number of outstanding
- * requests! You are probably far better off just calling ares_process()
- * once per second, rather than calling ares_timeout() to figure out
- * when to next call ares_process().
+/* Returns the time until the next query times out, based on the query at
+ * the top of the channel's timeout heap, so this is cheap enough to call
+ * before every wait for events.
  */
 struct timeval *ares_timeout(ares_channel channel, struct timeval *maxtv,
                              struct timeval *tvbuf)
 {
   struct query *query;
-  struct list_node* list_head;
-  struct list_node* list_node;
   struct timeval now;
   struct timeval nextstop;
-  long offset, min_offset;
 
-  /* No queries, no timeout (and no fetch of the current time). */
-  if (ares__is_list_empty(&(channel->all_queries)))
+  /* No timeouts, no timeout (and no fetch of the current time). */
+  query = ares__next_timeout(channel);
+  if (!query)
     return maxtv;
 
-  /* Find the minimum timeout for the current set of queries. */
+  /* Work out how long it is until the first query times out, to the
+   * microsecond, so that sub-second timeouts are waited for accurately.
+   */
   now = ares__tvnow();
-  min_offset = -1;
-
-  list_head = &(channel->all_queries);
-  for (list_node = list_head->next; list_node != list_head;
-       list_node = list_node->next)
+  if (ares__timedout(&now, &query->timeout))
     {
-      query = list_node->data;
-      if (query->timeout.tv_sec == 0)
-        continue;
-      offset = timeoffset(&now, &query->timeout);
-      if (offset < 0)
-        offset = 0;
-      if (min_offset == -1 || offset < min_offset)
-        min_offset = offset;
+      nextstop.tv_sec = 0;
+      nextstop.tv_usec = 0;
     }
-
-  /* If we found a minimum timeout and it's sooner than the one specified in
-   * maxtv (if any), return it.  Otherwise go with maxtv.
-   */
-  if (min_offset != -1)
+  else
     {
-      int ioffset = (min_offset > (long)INT_MAX) ? INT_MAX : (int)min_offset;
-
-      nextstop.tv_sec = ioffset/1000;
-      nextstop.tv_usec = (ioffset%1000)*1000;
-
-      if (!maxtv || ares__timedout(maxtv, &nextstop))
+      nextstop.tv_sec = query->timeout.tv_sec - now.tv_sec;
+      nextstop.tv_usec = query->timeout.tv_usec - now.tv_usec;
+      if (nextstop.tv_usec < 0)
         {
-          *tvbuf = nextstop;
-          return tvbuf;
+          nextstop.tv_sec--;
+          nextstop.tv_usec += 1000000;
         }
     }
 
+  /* If that's sooner than the time specified in maxtv (if any), return it.
+   * Otherwise go with maxtv.
+   */
+  if (!maxtv || ares__timedout(maxtv, &nextstop))
+    {
+      *tvbuf = nextstop;
+      return tvbuf;
+    }
+
   return maxtv;
 }
@@ -86,6 +86,8 @@ TEST_F(LibraryTest, OptionsChannelInit) {
   opts.lookups = strdup("b");
   optmask |= ARES_OPT_LOOKUPS;
   optmask |= ARES_OPT_ROTATE;
+  opts.tcp_conns = 3;
+  optmask |= ARES_OPT_TCP_CONNS;
 
   ares_channel channel = nullptr;
   EXPECT_EQ(ARES_SUCCESS, ares_init_options(&channel, &opts, optmask));
@@ -112,6 +114,8 @@ TEST_F(LibraryTest, OptionsChannelInit) {
   EXPECT_EQ(std::string(opts.domains[0]), std::string(opts2.domains[0]));
   EXPECT_EQ(std::string(opts.domains[1]), std::string(opts2.domains[1]));
   EXPECT_EQ(std::string(opts.lookups), std::string(opts2.lookups));
+  EXPECT_NE(0, optmask2 & ARES_OPT_TCP_CONNS);
+  EXPECT_EQ(opts.tcp_conns, opts2.tcp_conns);
 
   ares_destroy_options(&opts);
   ares_destroy_options(&opts2);
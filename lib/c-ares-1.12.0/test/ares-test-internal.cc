@@ -221,6 +221,91 @@ TEST(Misc, Bitncmp) {
   EXPECT_GT(0, ares__bitncmp(a, b, 3*8 + 7));
 }
 
+TEST(Misc, NameHashAndEqual) {
+  // Header-less message holding "www.Example.com", "WWW.example.COM" with
+  // its last two labels compressed, "example.org" and a pointer loop.
+  byte msg[] = {3, 'w', 'w', 'w', 7, 'E', 'x', 'a', 'm', 'p', 'l', 'e',
+                3, 'c', 'o', 'm', 0,
+                3, 'W', 'W', 'W', 0xC0, 4,
+                7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'o', 'r', 'g', 0,
+                0xC0, 36};
+  int len = sizeof(msg);
+  unsigned int hash1, hash2, hash3;
+  long enclen;
+
+  EXPECT_EQ(ARES_SUCCESS, ares__name_hash(msg, msg, len, &hash1, &enclen));
+  EXPECT_EQ(17, enclen);
+  EXPECT_EQ(ARES_SUCCESS, ares__name_hash(msg + 17, msg, len, &hash2, &enclen));
+  EXPECT_EQ(6, enclen);
+  EXPECT_EQ(hash1, hash2);
+  EXPECT_EQ(ARES_SUCCESS, ares__name_hash(msg + 23, msg, len, &hash3, &enclen));
+  EXPECT_EQ(13, enclen);
+  EXPECT_NE(hash1, hash3);
+  EXPECT_EQ(ARES_EBADNAME, ares__name_hash(msg + 36, msg, len, &hash3, &enclen));
+
+  EXPECT_EQ(1, ares__name_equal(msg, msg, len, msg + 17, msg, len));
+  EXPECT_EQ(1, ares__name_equal(msg + 17, msg, len, msg, msg, len));
+  EXPECT_EQ(0, ares__name_equal(msg, msg, len, msg + 23, msg, len));
+  EXPECT_EQ(0, ares__name_equal(msg + 36, msg, len, msg + 36, msg, len));
+  // Truncated message.
+  EXPECT_EQ(0, ares__name_equal(msg, msg, 10, msg, msg, len));
+}
+
+TEST_F(LibraryTest, SocketTable) {
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init(&channel));
+  EXPECT_EQ(nullptr, ares__find_socket(channel, 3));
+
+  // No real sockets are needed; the table just maps values.
+  for (int fd = 1000; fd < 1300; fd++) {
+    EXPECT_EQ(ARES_SUCCESS, ares__add_socket(channel, fd, ARES_SOCKET_UDP, fd - 1000));
+  }
+  // Remove every third one, which leaves holes in the probe runs.
+  for (int fd = 1000; fd < 1300; fd += 3) {
+    ares__remove_socket(channel, fd);
+  }
+  ares__remove_socket(channel, 1000);
+  for (int fd = 1000; fd < 1300; fd++) {
+    struct ares_socket_entry *entry = ares__find_socket(channel, fd);
+    if ((fd - 1000) % 3 == 0) {
+      EXPECT_EQ(nullptr, entry);
+    } else {
+      ASSERT_NE(nullptr, entry);
+      EXPECT_EQ(fd, entry->fd);
+      EXPECT_EQ(ARES_SOCKET_UDP, entry->kind);
+      EXPECT_EQ(fd - 1000, entry->index);
+    }
+  }
+  EXPECT_EQ(200, channel->nsockets);
+  for (int fd = 1000; fd < 1300; fd++) {
+    ares__remove_socket(channel, fd);
+  }
+  EXPECT_EQ(0, channel->nsockets);
+  ares_destroy(channel);
+}
+
+TEST_F(LibraryTest, ChooseServerProbe) {
+  ares_channel channel = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_init(&channel));
+  EXPECT_EQ(ARES_SUCCESS, ares_set_servers_csv(channel, "1.1.1.1,2.2.2.2,3.3.3.3"));
+  // All cost the same, so the first is the best; every 32nd choice probes
+  // another, skipping a broken one.
+  channel->servers[1].is_broken = 1;
+  std::vector<int> probes;
+  for (int i = 0; i < 32 * 3; i++) {
+    int server = ares__choose_server(channel);
+    if (server != 0) probes.push_back(server);
+  }
+  EXPECT_EQ(std::vector<int>({2, 2, 2}), probes);
+
+  // With nothing else left to probe, the best is chosen anyway.
+  channel->servers[2].is_broken = 1;
+  for (int i = 0; i < 32; i++) {
+    EXPECT_EQ(0, ares__choose_server(channel));
+  }
+  ares_destroy(channel);
+}
+
 TEST_F(LibraryTest, Casts) {
   ssize_t ssz = 100;
   unsigned int u = 100;
@@ -27,6 +27,15 @@ TEST_F(DefaultChannelTest, GetServersFailures) {
   EXPECT_EQ(ARES_ENODATA, ares_get_servers(nullptr, &servers));
 }
 
+TEST_F(DefaultChannelTest, GetStats) {
+  struct ares_stats stats;
+  memset(&stats, 0xff, sizeof(stats));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(0UL, stats.udp_deferred_sends);
+  EXPECT_EQ(ARES_ENODATA, ares_get_stats(nullptr, &stats));
+  EXPECT_EQ(ARES_ENODATA, ares_get_stats(channel_, nullptr));
+}
+
 TEST_F(DefaultChannelTest, SetServers) {
   EXPECT_EQ(ARES_SUCCESS, ares_set_servers(channel_, nullptr));
   std::vector<std::string> empty;
@@ -1,7 +1,14 @@
 #include "ares-test.h"
 #include "dns-proto.h"
 
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 using testing::InvokeWithoutArgs;
@@ -86,6 +93,67 @@ TEST_P(MockUDPChannelTest, ParallelLookups) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss3.str());
 }
 
+// UDP only so mock server doesn't get confused by concatenated requests
+TEST_P(MockUDPChannelTest, SendDuplicateQIDs) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp1));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {1, 2, 3, 4}));
+  ON_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp2));
+
+  // Two outstanding queries share a qid; each answer must reach its own query.
+  unsigned char *qbuf1;
+  unsigned char *qbuf2;
+  int qlen1, qlen2;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x4242, 1, &qbuf1, &qlen1, 0));
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in, ns_t_a,
+                                            0x4242, 1, &qbuf2, &qlen2, 0));
+  SearchResult result1;
+  ares_send(channel_, qbuf1, qlen1, SearchCallback, &result1);
+  SearchResult result2;
+  ares_send(channel_, qbuf2, qlen2, SearchCallback, &result2);
+  ares_free_string(qbuf1);
+  ares_free_string(qbuf2);
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_SUCCESS, result1.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.google.com' IN A} "
+            "A:{'www.google.com' IN A TTL=100 2.3.4.5}",
+            PacketToString(result1.data_));
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.example.com' IN A} "
+            "A:{'www.example.com' IN A TTL=100 1.2.3.4}",
+            PacketToString(result2.data_));
+}
+
+TEST_P(MockUDPChannelTest, AnswerQuestionCaseDiffers) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("WWW.Google.COM", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // The answer's question only differs in case, so it still matches.
+  SearchResult result;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'WWW.Google.COM' IN A} "
+            "A:{'www.google.com' IN A TTL=100 2.3.4.5}",
+            PacketToString(result.data_));
+}
+
 // UDP to TCP specific test
 TEST_P(MockUDPChannelTest, TruncationRetry) {
   DNSPacket rsptruncated;
@@ -138,6 +206,77 @@ TEST_P(MockChannelTest, SockCallback) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
 }
 
+TEST_P(MockChannelTest, SocketEvents) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  HostResult result = {};
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+
+  // Drive the channel with the event API alone, keeping track of the sockets
+  // it wants watched the way an epoll loop would.
+  std::map<int, int> watched;
+  struct ares_socket_event events[2];
+  for (int i = 0; i < 100 && !result.done_; i++) {
+    int n;
+    while ((n = ares_get_socket_events(channel_, events, 2)) > 0) {
+      for (int j = 0; j < n; j++) {
+        if (events[j].events) {
+          watched[events[j].fd] = events[j].events;
+        } else {
+          watched.erase(events[j].fd);
+        }
+      }
+    }
+
+    fd_set readers, writers;
+    FD_ZERO(&readers);
+    FD_ZERO(&writers);
+    int nfds = 0;
+    for (const auto& w : watched) {
+      if (w.second & ARES_SOCKET_EVENT_READ) FD_SET(w.first, &readers);
+      if (w.second & ARES_SOCKET_EVENT_WRITE) FD_SET(w.first, &writers);
+      nfds = std::max(nfds, w.first + 1);
+    }
+    for (int fd : fds()) {
+      FD_SET(fd, &readers);
+      nfds = std::max(nfds, fd + 1);
+    }
+    struct timeval tv = {0, 100000};
+    ASSERT_LE(0, select(nfds, &readers, &writers, nullptr, &tv));
+
+    std::vector<struct ares_socket_event> ready;
+    for (const auto& w : watched) {
+      struct ares_socket_event ev = {w.first, 0};
+      if (FD_ISSET(w.first, &readers)) ev.events |= ARES_SOCKET_EVENT_READ;
+      if (FD_ISSET(w.first, &writers)) ev.events |= ARES_SOCKET_EVENT_WRITE;
+      if (ev.events) ready.push_back(ev);
+    }
+    ares_process_events(channel_, ready.data(), (int)ready.size());
+    for (int fd : fds()) {
+      if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+    }
+  }
+  EXPECT_TRUE(result.done_);
+  std::stringstream ss;
+  ss << result.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+
+  // With nothing left to do the channel closed its socket, and says so.
+  EXPECT_FALSE(watched.empty());
+  int n = ares_get_socket_events(channel_, events, 2);
+  for (int j = 0; j < n; j++) {
+    EXPECT_EQ(0, events[j].events);
+    watched.erase(events[j].fd);
+  }
+  EXPECT_TRUE(watched.empty());
+  EXPECT_EQ(0, ares_get_socket_events(channel_, events, 2));
+}
+
 TEST_P(MockChannelTest, SockFailCallback) {
   // Notification of new sockets gives an error.
   int rc = -1;
@@ -197,6 +336,95 @@ TEST_P(MockChannelTest, SockConfigureFailCallback) {
   EXPECT_EQ(ARES_ECONNREFUSED, result.status_);
 }
 
+// Swaps the new UDP socket for one end of a datagram socketpair, and sends
+// on it until its send buffer is full. The other end goes to the test,
+// which decides when there's room again by reading from it.
+static int FillSendBufferCallback(ares_socket_t fd, int type, void *data) {
+  int sv[2];
+  if (type != SOCK_DGRAM || socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) return -1;
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  dup2(sv[0], fd);
+  close(sv[0]);
+  char filler = 0;
+  while (send(fd, &filler, 1, 0) == 1) {
+  }
+  *(int*)data = sv[1];
+  return 0;
+}
+
+TEST_P(MockUDPChannelTest, DefersSendWhenBufferFull) {
+  int peer = -1;
+  ares_set_socket_callback(channel_, FillSendBufferCallback, &peer);
+
+  SearchResult result = {};
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result);
+  ASSERT_NE(-1, peer);
+
+  // The query waits for room rather than failing over, and the channel
+  // asks to be told when the socket is writable.
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(1UL, stats.udp_deferred_sends);
+  struct ares_server_stats server_stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &server_stats));
+  EXPECT_EQ(1UL, server_stats.udp_deferred_sends);
+  ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+  EXPECT_TRUE(ARES_GETSOCK_WRITABLE(bitmask, 0));
+  EXPECT_FALSE(result.done_);
+
+  // Only the filler made it into the buffer.
+  byte buf[512];
+  int len;
+  int nfiller = 0;
+  while ((len = (int)recv(peer, buf, sizeof(buf), MSG_DONTWAIT)) == 1) nfiller++;
+  EXPECT_LT(0, nfiller);
+  EXPECT_EQ(-1, len);
+
+  // Once there's room, the query goes out and writability isn't wanted.
+  ares_process_fd(channel_, ARES_SOCKET_BAD, socks[0]);
+  len = (int)recv(peer, buf, sizeof(buf), MSG_DONTWAIT);
+  ASSERT_LT(0, len);
+  std::vector<byte> sent(buf, buf + len);
+  EXPECT_EQ("REQ QRY RD  Q:{'www.google.com' IN A}", PacketToString(sent));
+  bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+  EXPECT_FALSE(ARES_GETSOCK_WRITABLE(bitmask, 0));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(1UL, stats.udp_deferred_sends);
+
+  ares_cancel(channel_);
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  close(peer);
+}
+
+TEST_P(MockUDPChannelTest, TimeoutValueSubSecond) {
+  // The queries are cancelled before they are ever answered.
+  struct timeval tinfo;
+  EXPECT_EQ(nullptr, ares_timeout(channel_, nullptr, &tinfo));
+
+  SearchResult result1;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result1);
+  SearchResult result2;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+
+  // The 1500ms timeout (less up to 7/16 jitter) is reported to the
+  // microsecond rather than rounded to whole seconds or milliseconds.
+  struct timeval* pt = ares_timeout(channel_, nullptr, &tinfo);
+  EXPECT_EQ(&tinfo, pt);
+  long usecs = pt->tv_sec * 1000000L + pt->tv_usec;
+  EXPECT_LT(800000L, usecs);
+  EXPECT_GE(1500000L, usecs);
+  EXPECT_GT(1000000L, pt->tv_usec);
+
+  ares_cancel(channel_);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result1.status_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result2.status_);
+  EXPECT_EQ(nullptr, ares_timeout(channel_, nullptr, &tinfo));
+}
+
 // TCP only to prevent retries
 TEST_P(MockTCPChannelTest, MalformedResponse) {
   std::vector<byte> one = {0x01};
@@ -325,6 +553,86 @@ TEST_P(MockExtraOptsTest, SimpleQuery) {
   EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
 }
 
+TEST_P(MockExtraOptsTest, SendToFromLocalIP4) {
+  if (GetParam().first != AF_INET) return;
+  ares_set_local_ip4(channel_, 0x7F000002);
+
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // A given destination is sent to from the channel's local address too.
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  SearchResult result;
+  ares_send_to(channel_, servers, qbuf, qlen, SearchCallback, &result);
+  ares_free_string(qbuf);
+  ares_free_data(servers);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  EXPECT_EQ("127.0.0.2", server_.lastsource());
+}
+
+#ifdef SO_RXQ_OVFL
+TEST_P(MockExtraOptsTest, ReceiveBufferDrops) {
+  if (GetParam().second) return;  // UDP only
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  auto read_channel = [this]() {
+    ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+    int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+    for (int i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+      if (ARES_GETSOCK_READABLE(bitmask, i))
+        ares_process_fd(channel_, socks[i], ARES_SOCKET_BAD);
+    }
+  };
+
+  HostResult results[40] = {};
+  for (HostResult& result : results) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  }
+  // Let the server answer everything without the channel reading any of
+  // it, so the channel's small receive buffer overflows.
+  ProcessServers();
+  read_channel();
+
+  // The kernel only reports the drops with a later datagram.
+  HostResult last = {};
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &last);
+  ProcessServers();
+  read_channel();
+  EXPECT_TRUE(last.done_);
+
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  struct ares_server_stats server_stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &server_stats));
+  EXPECT_EQ(ARES_ENODATA, ares_get_server_stats(channel_, 1, &server_stats));
+  EXPECT_EQ(ARES_ENODATA, ares_get_server_stats(channel_, -1, &server_stats));
+  EXPECT_LT(0UL, stats.udp_rx_drops);
+  EXPECT_EQ(stats.udp_rx_drops, server_stats.udp_rx_drops);
+  int answered = 0;
+  for (const HostResult& result : results) {
+    if (result.done_) answered++;
+  }
+  EXPECT_EQ(40UL, answered + stats.udp_rx_drops);
+  ares_cancel(channel_);
+}
+#endif
+
 class MockFlagsChannelOptsTest
     : public MockChannelOptsTest,
       public ::testing::WithParamInterface< std::pair<int, bool> > {
@@ -337,55 +645,782 @@ class MockFlagsChannelOptsTest
     opts->flags = flags;
     return opts;
   }
- private:
-  struct ares_options opts_;
-};
+ private:
+  struct ares_options opts_;
+};
+
+class MockNoCheckRespChannelTest : public MockFlagsChannelOptsTest {
+ public:
+  MockNoCheckRespChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_NOCHECKRESP) {}
+};
+
+TEST_P(MockNoCheckRespChannelTest, ServFailResponse) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a));
+  rsp.set_rcode(ns_r_servfail);
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ESERVFAIL, result.status_);
+}
+
+TEST_P(MockNoCheckRespChannelTest, NotImplResponse) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a));
+  rsp.set_rcode(ns_r_notimpl);
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ENOTIMP, result.status_);
+}
+
+TEST_P(MockNoCheckRespChannelTest, RefusedResponse) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a));
+  rsp.set_rcode(ns_r_refused);
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_EREFUSED, result.status_);
+}
+
+class MockKernelTimestampsTest : public MockFlagsChannelOptsTest {
+ public:
+  MockKernelTimestampsTest() : MockFlagsChannelOptsTest(ARES_FLAG_KERNEL_TIMESTAMPS) {}
+};
+
+struct TimedResult {
+  bool done_;
+  int status_;
+  struct ares_query_times times_;
+};
+
+static void TimedCallback(void *data, int status, int timeouts,
+                          unsigned char *abuf, int alen,
+                          const struct ares_query_times *times) {
+  TimedResult* result = reinterpret_cast<TimedResult*>(data);
+  result->done_ = true;
+  result->status_ = status;
+  result->times_ = *times;
+}
+
+static double Seconds(const struct ares_timestamp& ts) {
+  return ts.sec + ts.nsec / 1e9;
+}
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+TEST_P(MockKernelTimestampsTest, Times) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  bool udp = !GetParam().second;
+#ifdef SO_TIMESTAMPNS
+  if (udp) {
+    // The kernel may take a moment to start timestamping answers as they
+    // arrive once the channel's socket asks for it, and until then stamps
+    // them as they're read, so wait until it does.
+    bool stamped = false;
+    for (int i = 0; i < 100 && !stamped; i++) {
+      TimedResult warmup = {};
+      ares_send_timed(channel_, qbuf, qlen, TimedCallback, &warmup);
+      ProcessServers();
+      double answered = Now();
+      Process();
+      EXPECT_TRUE(warmup.done_);
+      stamped = Seconds(warmup.times_.received) <= answered;
+      qbuf[1]++;  // a different qid
+    }
+    EXPECT_TRUE(stamped);
+  }
+#endif
+  TimedResult result = {};
+  ares_send_timed(channel_, qbuf, qlen, TimedCallback, &result);
+  double queued = Now();
+  // Have the answer sent, but not yet read.
+  ProcessServers();
+  double answered = Now();
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_SUCCESS, result.status_);
+  double sent = Seconds(result.times_.sent);
+  double received = Seconds(result.times_.received);
+  EXPECT_LT(0, sent);
+  EXPECT_LE(sent, received);
+  if (udp) {
+    EXPECT_LE(sent, queued);
+  } else {
+    // Over TCP the query is written once the connection is writable.
+    EXPECT_LE(queued, sent);
+  }
+#ifdef SO_TIMESTAMPNS
+  EXPECT_EQ(udp ? 1 : 0, result.times_.kernel_received);
+  // The kernel saw the answer arrive before it was read.
+  if (udp) {
+    EXPECT_LE(received, answered);
+  } else {
+    EXPECT_LE(answered, received);
+  }
+#endif
+
+  // No answer, no receive time.
+  TimedResult failed = {};
+  ares_send_to_timed(channel_, nullptr, qbuf, qlen, TimedCallback, &failed);
+  EXPECT_TRUE(failed.done_);
+  EXPECT_EQ(ARES_EBADQUERY, failed.status_);
+  EXPECT_EQ(0, failed.times_.received.sec);
+  ares_free_string(qbuf);
+}
+
+class MockBatchIOTest : public MockFlagsChannelOptsTest {
+ public:
+  MockBatchIOTest() : MockFlagsChannelOptsTest(ARES_FLAG_BATCH_IO) {}
+};
+
+TEST_P(MockBatchIOTest, ManyQueries) {
+  if (GetParam().second) return;  // UDP only
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  HostResult results[40] = {};
+  std::vector<SearchResult> sent_to(40);
+  for (int i = 0; i < 40; i++) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &results[i]);
+    qbuf[1] = i;
+    ares_send_to(channel_, servers, qbuf, qlen, SearchCallback, &sent_to[i]);
+  }
+  ares_free_string(qbuf);
+  ares_free_data(servers);
+
+  // The queries wait to go out together once the sockets are writable.
+  fd_set readers, writers;
+  FD_ZERO(&readers);
+  FD_ZERO(&writers);
+  int nfds = ares_fds(channel_, &readers, &writers);
+  int nreadable = 0;
+  int nwritable = 0;
+  for (int fd = 0; fd < nfds; fd++) {
+    if (FD_ISSET(fd, &readers)) nreadable++;
+    if (FD_ISSET(fd, &writers)) nwritable++;
+  }
+  EXPECT_LT(1, nwritable);
+  EXPECT_EQ(nreadable, nwritable);
+
+  Process();
+  for (int i = 0; i < 40; i++) {
+    EXPECT_TRUE(results[i].done_);
+    std::stringstream ss;
+    ss << results[i].host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+    EXPECT_TRUE(sent_to[i].done_);
+    EXPECT_EQ(ARES_SUCCESS, sent_to[i].status_);
+  }
+
+  // Waiting for the next batch isn't waiting for room in the send buffer.
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(0UL, stats.udp_deferred_sends);
+}
+
+class MockBatchIOAdaptiveTest : public MockFlagsChannelOptsTest {
+ public:
+  MockBatchIOAdaptiveTest()
+    : MockFlagsChannelOptsTest(ARES_FLAG_BATCH_IO | ARES_FLAG_ADAPTIVE_TIMEOUTS) {}
+};
+
+TEST_P(MockBatchIOAdaptiveTest, TimesFromSend) {
+  if (GetParam().second) return;  // UDP only
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // The query waits to go out until the socket is next seen writable, and
+  // the time it waits isn't the server's.
+  HostResult result;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  usleep(100000);
+  Process();
+  EXPECT_TRUE(result.done_);
+  struct ares_server_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &stats));
+  EXPECT_LT(0, stats.srtt);
+  EXPECT_GT(50000, stats.srtt);
+}
+
+class MockTCPConnsTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockTCPConnsTest()
+    : MockChannelOptsTest(1, GetParam(), true, FillOptions(&opts_),
+                          ARES_OPT_TCP_CONNS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->tcp_conns = 3;
+    return opts;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockTCPConnsTest, PipelinedQueries) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  HostResult results[30] = {};
+  for (HostResult& result : results) {
+    ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  }
+
+  // The queries take the connections in turn.
+  ares_socket_t socks[ARES_GETSOCK_MAXNUM];
+  int bitmask = ares_getsock(channel_, socks, ARES_GETSOCK_MAXNUM);
+  int nsocks = 0;
+  for (int i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+    if (ARES_GETSOCK_READABLE(bitmask, i)) nsocks++;
+  }
+  EXPECT_EQ(3, nsocks);
+
+  Process();
+  for (const HostResult& result : results) {
+    EXPECT_TRUE(result.done_);
+    std::stringstream ss;
+    ss << result.host_;
+    EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  }
+}
+
+TEST_P(MockChannelTest, ThreadedQueries) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  // A small ring makes the submitters wait for room now and then.
+  EXPECT_EQ(ARES_SUCCESS, ares_thread_start(channel_, 8));
+  EXPECT_EQ(ARES_EBADFLAGS, ares_thread_start(channel_, 8));
+
+  const int kThreads = 4;
+  const int kQueries = 50;
+  int answered[kThreads] = {};
+  std::atomic<int> finished(0);
+  std::vector<std::thread> submitters;
+  for (int t = 0; t < kThreads; t++) {
+    submitters.emplace_back([this, t, &answered, &finished] {
+      ares_completion_queue cq;
+      EXPECT_EQ(ARES_SUCCESS, ares_completion_queue_create(&cq));
+      unsigned char *qbuf;
+      int qlen;
+      EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                                0x1000 * t, 1, &qbuf, &qlen, 0));
+      int ids[kQueries];
+      for (int i = 0; i < kQueries; i++) {
+        ids[i] = i;
+        EXPECT_EQ(ARES_SUCCESS, ares_thread_send(channel_, nullptr, qbuf, qlen,
+                                                 cq, &ids[i]));
+      }
+      ares_free_string(qbuf);
+
+      std::vector<bool> seen(kQueries);
+      struct ares_thread_completion completions[16];
+      int done = 0;
+      while (done < kQueries) {
+        int n = ares_completion_queue_wait(cq, completions, 16, 10000);
+        if (n == 0) break;
+        for (int i = 0; i < n; i++) {
+          int id = *(int*)completions[i].arg;
+          EXPECT_FALSE(seen[id]);
+          seen[id] = true;
+          EXPECT_EQ(ARES_SUCCESS, completions[i].status);
+          EXPECT_NE(nullptr, completions[i].abuf);
+          if (completions[i].status == ARES_SUCCESS) answered[t]++;
+          ares_free_string(completions[i].abuf);
+        }
+        done += n;
+      }
+      ares_completion_queue_destroy(cq);
+      finished++;
+    });
+  }
+
+  // The I/O thread owns the channel; this one only runs the server.
+  while (finished < kThreads) ProcessServers();
+  for (auto& submitter : submitters) submitter.join();
+  ares_thread_stop(channel_);
+  for (int t = 0; t < kThreads; t++) {
+    EXPECT_EQ(kQueries, answered[t]);
+  }
+}
+
+TEST_P(MockChannelTest, ThreadStopCancels) {
+  EXPECT_EQ(ARES_ENOTINITIALIZED,
+            ares_thread_send(channel_, nullptr, nullptr, 0, nullptr, nullptr));
+  EXPECT_EQ(ARES_SUCCESS, ares_thread_start(channel_, 0));
+  ares_completion_queue cq;
+  EXPECT_EQ(ARES_SUCCESS, ares_completion_queue_create(&cq));
+  struct ares_thread_completion completions[4];
+  EXPECT_EQ(0, ares_completion_queue_wait(cq, completions, 4, 0));
+  EXPECT_EQ(0, ares_completion_queue_wait(cq, completions, 4, 10));
+
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  EXPECT_EQ(ARES_EBADQUERY, ares_thread_send(channel_, nullptr, qbuf, 5, cq, nullptr));
+  int ids[3] = {0, 1, 2};
+  for (int& id : ids) {
+    EXPECT_EQ(ARES_SUCCESS, ares_thread_send(channel_, nullptr, qbuf, qlen, cq, &id));
+  }
+  ares_free_string(qbuf);
+
+  // Nobody answers, so the queries are still outstanding when the thread stops.
+  ares_thread_stop(channel_);
+  int n = ares_completion_queue_wait(cq, completions, 4, 0);
+  EXPECT_EQ(3, n);
+  std::set<void*> args;
+  for (int i = 0; i < n; i++) {
+    args.insert(completions[i].arg);
+    EXPECT_EQ(ARES_ECANCELLED, completions[i].status);
+    EXPECT_EQ(nullptr, completions[i].abuf);
+  }
+  EXPECT_EQ(std::set<void*>({&ids[0], &ids[1], &ids[2]}), args);
+  ares_completion_queue_destroy(cq);
+}
+
+class MockAdaptiveTimeoutsTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface<int> {
+ public:
+  MockAdaptiveTimeoutsTest()
+    : MockChannelOptsTest(1, GetParam(), false, FillOptions(&opts_),
+                          ARES_OPT_FLAGS | ARES_OPT_TRIES |
+                          ARES_OPT_TIMEOUTMS | ARES_OPT_TIMEOUT_BOUNDS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_ADAPTIVE_TIMEOUTS;
+    opts->tries = 2;
+    opts->timeout = 100;
+    opts->timeout_min = 10;
+    opts->timeout_max = 4000;
+    return opts;
+  }
+  // Milliseconds until the channel's next timeout
+  int NextTimeout() {
+    struct timeval tv;
+    if (!ares_timeout(channel_, nullptr, &tv)) return -1;
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(MockAdaptiveTimeoutsTest, LearnsRoundTripTime) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+
+  // Until the server has answered, queries wait the configured timeout,
+  // without the usual random jitter.
+  struct ares_server_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &stats));
+  EXPECT_EQ(0, stats.srtt);
+  SearchResult first;
+  ares_send(channel_, qbuf, qlen, SearchCallback, &first);
+  EXPECT_LT(90, NextTimeout());
+  Process();
+  EXPECT_TRUE(first.done_);
+  EXPECT_EQ(ARES_SUCCESS, first.status_);
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &stats));
+  EXPECT_LT(0, stats.srtt);
+  EXPECT_LE(0, stats.rttvar);
+
+  // A local server answers quickly, so the next query needn't wait long.
+  SearchResult second;
+  ares_send(channel_, qbuf, qlen, SearchCallback, &second);
+  EXPECT_GT(50, NextTimeout());
+  Process();
+  EXPECT_TRUE(second.done_);
+
+  // Destinations of ares_send_to() are measured separately.
+  SearchResult third;
+  ares_send_to(channel_, servers, qbuf, qlen, SearchCallback, &third);
+  EXPECT_LT(90, NextTimeout());
+  Process();
+  EXPECT_TRUE(third.done_);
+  SearchResult fourth;
+  ares_send_to(channel_, servers, qbuf, qlen, SearchCallback, &fourth);
+  EXPECT_GT(50, NextTimeout());
+  Process();
+  EXPECT_TRUE(fourth.done_);
+  EXPECT_EQ(ARES_SUCCESS, fourth.status_);
+
+  ares_free_string(qbuf);
+  ares_free_data(servers);
+}
+
+TEST_P(MockAdaptiveTimeoutsTest, BacksOff) {
+  // The server never answers.
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  SearchResult result;
+  ares_send(channel_, qbuf, qlen, SearchCallback, &result);
+  Process();
+  EXPECT_TRUE(result.done_);
+  EXPECT_EQ(ARES_ETIMEOUT, result.status_);
+  EXPECT_EQ(2, result.timeouts_);
+
+  // Each timeout doubled the server's timeout, and it hasn't answered since.
+  SearchResult again;
+  ares_send(channel_, qbuf, qlen, SearchCallback, &again);
+  EXPECT_LT(350, NextTimeout());
+  EXPECT_GE(400, NextTimeout());
+  ares_cancel(channel_);
+  EXPECT_TRUE(again.done_);
+  ares_free_string(qbuf);
+}
+
+class MockCacheTest
+    : public MockChannelOptsTest,
+      public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  MockCacheTest(int size)
+    : MockChannelOptsTest(1, GetParam().first, GetParam().second,
+                          FillOptions(&opts_, size), ARES_OPT_CACHE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts,
+                                          int size) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->cache_size = size;
+    return opts;
+  }
+  unsigned long CacheHits() {
+    struct ares_stats stats;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+    return stats.cache_hits;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+class CacheMockTest : public MockCacheTest {
+ public:
+  CacheMockTest() : MockCacheTest(65536) {}
+};
+
+// Only has room for one of the answers below
+class SmallCacheMockTest : public MockCacheTest {
+ public:
+  SmallCacheMockTest() : MockCacheTest(200) {}
+};
+
+TEST_P(CacheMockTest, CachesAnswers) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+  DNSPacket rsp6;
+  rsp6.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_aaaa))
+    .add_answer(new DNSAaaaRR("www.google.com", 100,
+                              {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                               0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_aaaa))
+    .WillOnce(SetReply(&server_, &rsp6));
+
+  SearchResult first;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &first);
+  Process();
+  EXPECT_TRUE(first.done_);
+  EXPECT_EQ(ARES_SUCCESS, first.status_);
+
+  // The same question is answered straight away, whatever its case.
+  SearchResult second;
+  ares_query(channel_, "WWW.Google.com", ns_c_in, ns_t_a, SearchCallback, &second);
+  EXPECT_TRUE(second.done_);
+  EXPECT_EQ(ARES_SUCCESS, second.status_);
+  EXPECT_EQ(first.data_.size(), second.data_.size());
+  EXPECT_EQ(1UL, CacheHits());
+
+  // Another type of record for the name is a different question.
+  SearchResult third;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_aaaa, SearchCallback, &third);
+  EXPECT_FALSE(third.done_);
+  Process();
+  EXPECT_TRUE(third.done_);
+  EXPECT_EQ(ARES_SUCCESS, third.status_);
+
+  // So do lookups built on queries.
+  HostResult host;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &host);
+  EXPECT_TRUE(host.done_);
+  std::stringstream ss;
+  ss << host.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  EXPECT_EQ(2UL, CacheHits());
+}
+
+TEST_P(CacheMockTest, CachesNegativeAnswers) {
+  DNSPacket nxdomain;
+  nxdomain.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("missing.google.com", ns_t_a))
+    .add_auth(new DNSSoaRR("google.com", 300, "ns1.google.com",
+                           "dns-admin.google.com", 1, 900, 900, 1800, 60));
+  EXPECT_CALL(server_, OnRequest("missing.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &nxdomain));
+
+  SearchResult first;
+  ares_query(channel_, "missing.google.com", ns_c_in, ns_t_a, SearchCallback, &first);
+  Process();
+  EXPECT_TRUE(first.done_);
+  EXPECT_EQ(ARES_ENOTFOUND, first.status_);
+  SearchResult second;
+  ares_query(channel_, "missing.google.com", ns_c_in, ns_t_a, SearchCallback, &second);
+  EXPECT_TRUE(second.done_);
+  EXPECT_EQ(ARES_ENOTFOUND, second.status_);
+  EXPECT_EQ(1UL, CacheHits());
+}
+
+TEST_P(CacheMockTest, KeysOnQueryFlags) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .Times(5).WillRepeatedly(SetReply(&server_, &rsp));
+
+  // Queries with and without recursion desired, with an OPT record, with
+  // DNSSEC OK set in it, and with checking disabled; each has an answer of
+  // its own, which a second asking of it is answered from.
+  std::vector<std::vector<byte>> queries;
+  for (int i = 0; i < 5; i++) {
+    unsigned char *qbuf;
+    int qlen;
+    EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                              0x1234, i != 0, &qbuf, &qlen,
+                                              i == 2 || i == 3 ? 1280 : 0));
+    std::vector<byte> query(qbuf, qbuf + qlen);
+    ares_free_string(qbuf);
+    if (i == 3) query[query.size() - 4] |= 0x80;  // DO, in the OPT's TTL
+    if (i == 4) query[3] |= 0x10;                 // CD
+    queries.push_back(query);
+  }
+  for (int round = 0; round < 2; round++) {
+    for (const auto& query : queries) {
+      SearchResult result = {};
+      ares_send(channel_, query.data(), query.size(), SearchCallback, &result);
+      EXPECT_EQ(round == 1, result.done_);
+      Process();
+      EXPECT_TRUE(result.done_);
+      EXPECT_EQ(ARES_SUCCESS, result.status_);
+    }
+  }
+  EXPECT_EQ(5UL, CacheHits());
+}
+
+TEST_P(CacheMockTest, SkipsUncacheableAnswers) {
+  // A negative answer without an SOA record, and one with no TTL
+  DNSPacket nxdomain;
+  nxdomain.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("missing.google.com", ns_t_a));
+  EXPECT_CALL(server_, OnRequest("missing.google.com", ns_t_a))
+    .Times(2).WillRepeatedly(SetReply(&server_, &nxdomain));
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 0, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .Times(2).WillRepeatedly(SetReply(&server_, &rsp));
+
+  for (int i = 0; i < 2; i++) {
+    SearchResult missing;
+    ares_query(channel_, "missing.google.com", ns_c_in, ns_t_a, SearchCallback, &missing);
+    Process();
+    EXPECT_TRUE(missing.done_);
+    EXPECT_EQ(ARES_ENOTFOUND, missing.status_);
+    SearchResult result;
+    ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+  EXPECT_EQ(0UL, CacheHits());
+}
+
+TEST_P(SmallCacheMockTest, EvictsLeastRecentlyUsed) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.first.com", ns_t_a))
+    .add_answer(new DNSARR("www.first.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.first.com", ns_t_a))
+    .Times(2).WillRepeatedly(SetReply(&server_, &rsp1));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.second.com", ns_t_a))
+    .add_answer(new DNSARR("www.second.com", 100, {3, 4, 5, 6}));
+  EXPECT_CALL(server_, OnRequest("www.second.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp2));
+
+  const char *names[] = {"www.first.com", "www.first.com", "www.second.com",
+                         "www.second.com", "www.first.com"};
+  for (const char *name : names) {
+    SearchResult result;
+    ares_query(channel_, name, ns_c_in, ns_t_a, SearchCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+  EXPECT_EQ(2UL, CacheHits());
+}
 
-class MockNoCheckRespChannelTest : public MockFlagsChannelOptsTest {
+class CoalesceMockTest : public MockFlagsChannelOptsTest {
  public:
-  MockNoCheckRespChannelTest() : MockFlagsChannelOptsTest(ARES_FLAG_NOCHECKRESP) {}
+  CoalesceMockTest() : MockFlagsChannelOptsTest(ARES_FLAG_COALESCE) {}
+  unsigned long QueriesCoalesced() {
+    struct ares_stats stats;
+    EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+    return stats.queries_coalesced;
+  }
 };
 
-TEST_P(MockNoCheckRespChannelTest, ServFailResponse) {
+TEST_P(CoalesceMockTest, SharesOutstandingQuery) {
   DNSPacket rsp;
   rsp.set_response().set_aa()
-    .add_question(new DNSQuestion("www.google.com", ns_t_a));
-  rsp.set_rcode(ns_r_servfail);
-  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &rsp));
-  HostResult result;
-  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+
+  SearchResult results[3];
+  for (int i = 0; i < 3; i++) {
+    ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &results[i]);
+  }
+  // So do lookups built on queries.
+  HostResult host;
+  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &host);
   Process();
-  EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_ESERVFAIL, result.status_);
-}
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(results[i].done_);
+    EXPECT_EQ(ARES_SUCCESS, results[i].status_);
+  }
+  EXPECT_TRUE(host.done_);
+  std::stringstream ss;
+  ss << host.host_;
+  EXPECT_EQ("{'www.google.com' aliases=[] addrs=[2.3.4.5]}", ss.str());
+  EXPECT_EQ(3UL, QueriesCoalesced());
 
-TEST_P(MockNoCheckRespChannelTest, NotImplResponse) {
-  DNSPacket rsp;
-  rsp.set_response().set_aa()
-    .add_question(new DNSQuestion("www.google.com", ns_t_a));
-  rsp.set_rcode(ns_r_notimpl);
-  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &rsp));
-  HostResult result;
-  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+  // Once it has completed, the question is asked again.
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+  SearchResult again;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &again);
   Process();
-  EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_ENOTIMP, result.status_);
+  EXPECT_TRUE(again.done_);
+  EXPECT_EQ(ARES_SUCCESS, again.status_);
+  EXPECT_EQ(3UL, QueriesCoalesced());
 }
 
-TEST_P(MockNoCheckRespChannelTest, RefusedResponse) {
+TEST_P(CoalesceMockTest, DifferentQuestionsSent) {
   DNSPacket rsp;
   rsp.set_response().set_aa()
-    .add_question(new DNSQuestion("www.google.com", ns_t_a));
-  rsp.set_rcode(ns_r_refused);
-  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
-    .WillByDefault(SetReply(&server_, &rsp));
-  HostResult result;
-  ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp));
+  DNSPacket rsp6;
+  rsp6.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_aaaa))
+    .add_answer(new DNSAaaaRR("www.google.com", 100,
+                              {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                               0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10}));
+  EXPECT_CALL(server_, OnRequest("www.google.com", ns_t_aaaa))
+    .WillOnce(SetReply(&server_, &rsp6));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {3, 4, 5, 6}));
+  EXPECT_CALL(server_, OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(&server_, &rsp2));
+
+  SearchResult a, aaaa, other;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &a);
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_aaaa, SearchCallback, &aaaa);
+  ares_query(channel_, "www.example.com", ns_c_in, ns_t_a, SearchCallback, &other);
   Process();
-  EXPECT_TRUE(result.done_);
-  EXPECT_EQ(ARES_EREFUSED, result.status_);
+  EXPECT_TRUE(a.done_);
+  EXPECT_EQ(ARES_SUCCESS, a.status_);
+  EXPECT_TRUE(aaaa.done_);
+  EXPECT_EQ(ARES_SUCCESS, aaaa.status_);
+  EXPECT_TRUE(other.done_);
+  EXPECT_EQ(ARES_SUCCESS, other.status_);
+  EXPECT_EQ(0UL, QueriesCoalesced());
+}
+
+TEST_P(CoalesceMockTest, CancelCallsWaiters) {
+  SearchResult result1, result2;
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result1);
+  ares_query(channel_, "www.google.com", ns_c_in, ns_t_a, SearchCallback, &result2);
+  EXPECT_EQ(1UL, QueriesCoalesced());
+  ares_cancel(channel_);
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result1.status_);
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_ECANCELLED, result2.status_);
 }
 
 class MockEDNSChannelTest : public MockFlagsChannelOptsTest {
@@ -900,6 +1935,96 @@ TEST_P(MockUDPChannelTest, CancelLater) {
   EXPECT_EQ(0, result.timeouts_);
 }
 
+TEST_P(MockChannelTest, BatchedQueries) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.google.com", ns_t_a))
+    .add_answer(new DNSARR("www.google.com", 100, {2, 3, 4, 5}));
+  ON_CALL(server_, OnRequest("www.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &rsp));
+  DNSPacket nxrsp;
+  nxrsp.set_response().set_aa().set_rcode(ns_r_nxdomain)
+    .add_question(new DNSQuestion("nosuch.google.com", ns_t_a));
+  ON_CALL(server_, OnRequest("nosuch.google.com", ns_t_a))
+    .WillByDefault(SetReply(&server_, &nxrsp));
+
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  int ids[100];
+  for (int i = 0; i < 99; i++) {
+    ids[i] = i;
+    qbuf[1] = i;
+    ares_send_batched(channel_, qbuf, qlen, &ids[i]);
+  }
+  ares_free_string(qbuf);
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("nosuch.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  ids[99] = 99;
+  ares_send_batched(channel_, qbuf, qlen, &ids[99]);
+  ares_free_string(qbuf);
+
+  // Nothing completes until the channel is processed.
+  struct ares_completion completions[64];
+  EXPECT_EQ(0, ares_get_completions(channel_, completions, 64));
+  Process();
+
+  // The ring grew to hold them all, and they come out in batches.
+  std::vector<bool> seen(100);
+  int total = 0;
+  int n;
+  while ((n = ares_get_completions(channel_, completions, 64)) > 0) {
+    EXPECT_GE(64, n);
+    for (int i = 0; i < n; i++) {
+      int id = *(int*)completions[i].arg;
+      EXPECT_FALSE(seen[id]);
+      seen[id] = true;
+      EXPECT_EQ(0, completions[i].timeouts);
+      EXPECT_NE(0, completions[i].flags & ARES_COMPLETION_AA);
+      EXPECT_EQ(0, completions[i].flags & ARES_COMPLETION_TC);
+      EXPECT_NE(-1L, completions[i].rtt);
+      // As with ares_send(), an NXDOMAIN answer is still an answer.
+      EXPECT_EQ(ARES_SUCCESS, completions[i].status);
+      EXPECT_EQ(id == 99 ? ns_r_nxdomain : ns_r_noerror, completions[i].rcode);
+    }
+    total += n;
+  }
+  EXPECT_EQ(100, total);
+
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(0UL, stats.completions_dropped);
+}
+
+TEST_P(MockChannelTest, BatchedQueryFailures) {
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.google.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+  int ids[3] = {0, 1, 2};
+  ares_send_to_batched(channel_, nullptr, qbuf, qlen, &ids[0]);
+  ares_send_batched(channel_, qbuf, 5, &ids[1]);
+  ares_send_batched(channel_, qbuf, qlen, &ids[2]);
+  ares_free_string(qbuf);
+  ares_cancel(channel_);
+
+  struct ares_completion completions[4];
+  EXPECT_EQ(3, ares_get_completions(channel_, completions, 4));
+  EXPECT_EQ(&ids[0], completions[0].arg);
+  EXPECT_EQ(ARES_EBADQUERY, completions[0].status);
+  EXPECT_EQ(&ids[1], completions[1].arg);
+  EXPECT_EQ(ARES_EBADQUERY, completions[1].status);
+  EXPECT_EQ(&ids[2], completions[2].arg);
+  EXPECT_EQ(ARES_ECANCELLED, completions[2].status);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(-1, completions[i].rcode);
+    EXPECT_EQ(0, completions[i].flags);
+    EXPECT_EQ(-1L, completions[i].rtt);
+  }
+  EXPECT_EQ(0, ares_get_completions(channel_, completions, 4));
+}
+
 TEST_P(MockChannelTest, GetHostByNameDestroyAbsolute) {
   HostResult result;
   ares_gethostbyname(channel_, "www.google.com.", AF_INET, HostCallback, &result);
@@ -1114,6 +2239,439 @@ TEST_P(NoRotateMultiMockTest, ThirdServer) {
   CheckExample();
 }
 
+TEST_P(NoRotateMultiMockTest, RebindServers) {
+  DNSPacket okrsp;
+  okrsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[0].get(), &okrsp));
+  CheckExample();
+
+  // Only the third server is left once the channel is rebound.
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  struct ares_addr_port_node* third = servers->next->next;
+  EXPECT_EQ(ARES_ENODATA, ares_rebind_servers(nullptr, third, 0));
+  EXPECT_EQ(ARES_ENODATA, ares_rebind_servers(channel_, nullptr, 0));
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_rebind_servers(channel_, third, ARES_REBIND_KEEP_SOCKETS));
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[2].get(), &okrsp));
+  CheckExample();
+
+  // Back to all three servers, first one first.
+  EXPECT_EQ(ARES_SUCCESS,
+            ares_rebind_servers(channel_, servers, ARES_REBIND_KEEP_SOCKETS));
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[0].get(), &okrsp));
+  CheckExample();
+
+  // Queries keep per-server state, so the servers can't change under them.
+  HostResult result;
+  ares_gethostbyname(channel_, "www.example.com.", AF_INET, HostCallback, &result);
+  EXPECT_EQ(ARES_ENOTIMP, ares_rebind_servers(channel_, third, 0));
+  ares_cancel(channel_);
+  EXPECT_EQ(ARES_ECANCELLED, result.status_);
+  ares_free_data(servers);
+}
+
+TEST_P(NoRotateMultiMockTest, SendTo) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {1,1,1,1}));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,2,2,2}));
+  DNSPacket servfail;
+  servfail.set_response().set_aa().set_rcode(ns_r_servfail)
+    .add_question(new DNSQuestion("www.example.com", ns_t_a));
+  EXPECT_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a)).Times(0);
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &servfail))
+    .WillOnce(SetReply(servers_[1].get(), &rsp1));
+  EXPECT_CALL(*servers_[2], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[2].get(), &rsp2));
+
+  // Both queries share a qid, and go to servers the channel doesn't know of
+  // as its own first choice; each answer must come back to its own query.
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  struct ares_addr_port_node* second = servers->next;
+  struct ares_addr_port_node* third = servers->next->next;
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in, ns_t_a,
+                                            0x4242, 1, &qbuf, &qlen, 0));
+  SearchResult result1;
+  ares_send_to(channel_, second, qbuf, qlen, SearchCallback, &result1);
+  SearchResult result2;
+  ares_send_to(channel_, third, qbuf, qlen, SearchCallback, &result2);
+  SearchResult result3;
+  ares_send_to(channel_, nullptr, qbuf, qlen, SearchCallback, &result3);
+  EXPECT_TRUE(result3.done_);
+  EXPECT_EQ(ARES_EBADQUERY, result3.status_);
+  ares_free_string(qbuf);
+  ares_free_data(servers);
+
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_SUCCESS, result1.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.example.com' IN A} "
+            "A:{'www.example.com' IN A TTL=100 1.1.1.1}",
+            PacketToString(result1.data_));
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.example.com' IN A} "
+            "A:{'www.example.com' IN A TTL=100 2.2.2.2}",
+            PacketToString(result2.data_));
+}
+
+TEST_P(NoRotateMultiMockTest, SendToSharedQid) {
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {1,1,1,1}));
+  DNSPacket rsp2;
+  rsp2.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_aaaa))
+    .add_answer(new DNSAaaaRR("www.example.com", 100,
+                              {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                               0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10}));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillOnce(SetReply(servers_[1].get(), &rsp1));
+  EXPECT_CALL(*servers_[1], OnRequest("www.example.com", ns_t_aaaa))
+    .WillOnce(SetReply(servers_[1].get(), &rsp2));
+
+  // Two queries to the same server with the same qid: the second goes out
+  // with another qid, and each caller still sees its own qid in the answer.
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  unsigned char *qbuf1;
+  unsigned char *qbuf2;
+  int qlen1, qlen2;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in, ns_t_a,
+                                            0x4242, 1, &qbuf1, &qlen1, 0));
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in,
+                                            ns_t_aaaa, 0x4242, 1, &qbuf2,
+                                            &qlen2, 0));
+  SearchResult result1;
+  ares_send_to(channel_, servers->next, qbuf1, qlen1, SearchCallback, &result1);
+  SearchResult result2;
+  ares_send_to(channel_, servers->next, qbuf2, qlen2, SearchCallback, &result2);
+  ares_free_string(qbuf1);
+  ares_free_string(qbuf2);
+  ares_free_data(servers);
+
+  Process();
+  EXPECT_TRUE(result1.done_);
+  EXPECT_EQ(ARES_SUCCESS, result1.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.example.com' IN A} "
+            "A:{'www.example.com' IN A TTL=100 1.1.1.1}",
+            PacketToString(result1.data_));
+  ASSERT_LE(2, (int)result1.data_.size());
+  EXPECT_EQ(0x4242, (result1.data_[0] << 8 | result1.data_[1]));
+  EXPECT_TRUE(result2.done_);
+  EXPECT_EQ(ARES_SUCCESS, result2.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'www.example.com' IN AAAA} "
+            "A:{'www.example.com' IN AAAA TTL=100 0102:0304:0506:0708:090a:0b0c:0d0e:0f10}",
+            PacketToString(result2.data_));
+  ASSERT_LE(2, (int)result2.data_.size());
+  EXPECT_EQ(0x4242, (result2.data_[0] << 8 | result2.data_[1]));
+}
+
+TEST_P(NoRotateMultiMockTest, SendToManySharedQid) {
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {1,1,1,1}));
+  ON_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillByDefault(SetReply(servers_[1].get(), &rsp));
+
+  // Enough queries with one qid to make the channel grow its table.
+  struct ares_addr_port_node* servers = nullptr;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_servers_ports(channel_, &servers));
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in, ns_t_a,
+                                            0x4242, 1, &qbuf, &qlen, 0));
+  std::vector<SearchResult> results(600);
+  for (SearchResult& result : results) {
+    ares_send_to(channel_, servers->next, qbuf, qlen, SearchCallback, &result);
+  }
+  ares_free_string(qbuf);
+  ares_free_data(servers);
+
+  Process();
+  for (const SearchResult& result : results) {
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+  }
+}
+
+
+class AdaptiveServersMultiMockTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface< std::pair<int, bool> > {
+ public:
+  AdaptiveServersMultiMockTest()
+    : MockChannelOptsTest(3, GetParam().first, GetParam().second,
+                          FillOptions(&opts_),
+                          ARES_OPT_FLAGS | ARES_OPT_TRIES | ARES_OPT_TIMEOUTMS) {}
+  static struct ares_options* FillOptions(struct ares_options * opts) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = ARES_FLAG_ADAPTIVE_SERVERS;
+    opts->tries = 1;
+    opts->timeout = 100;
+    return opts;
+  }
+  // Sends a query and returns how many times it timed out
+  int Query(const unsigned char *qbuf, int qlen) {
+    SearchResult result;
+    ares_send(channel_, qbuf, qlen, SearchCallback, &result);
+    Process();
+    EXPECT_TRUE(result.done_);
+    EXPECT_EQ(ARES_SUCCESS, result.status_);
+    return result.timeouts_;
+  }
+ private:
+  struct ares_options opts_;
+};
+
+TEST_P(AdaptiveServersMultiMockTest, FailsOver) {
+  // The first server never answers.
+  DNSPacket rsp;
+  rsp.set_response().set_aa()
+    .add_question(new DNSQuestion("www.example.com", ns_t_a))
+    .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+  ON_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+    .WillByDefault(SetReply(servers_[1].get(), &rsp));
+  ON_CALL(*servers_[2], OnRequest("www.example.com", ns_t_a))
+    .WillByDefault(SetReply(servers_[2].get(), &rsp));
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in, ns_t_a,
+                                            0x1234, 1, &qbuf, &qlen, 0));
+
+  // Nothing is known about the servers, so the first query starts with the
+  // first, and moves on to the second when it times out.
+  EXPECT_EQ(1, Query(qbuf, qlen));
+  struct ares_server_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &stats));
+  EXPECT_LT(0, stats.loss);
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 1, &stats));
+  EXPECT_EQ(0, stats.loss);
+
+  // From then on, queries keep away from it...
+  for (int i = 1; i < 31; i++) {
+    EXPECT_EQ(0, Query(qbuf, qlen));
+  }
+
+  // ...but it still gets the occasional probe.
+  int probes = 0;
+  for (int i = 0; i < 96; i++) {
+    probes += Query(qbuf, qlen);
+  }
+  EXPECT_LE(1, probes);
+  EXPECT_GE(3, probes);
+  ares_free_string(qbuf);
+}
+
+
+class MockHedgeTest
+  : public MockChannelOptsTest,
+    public ::testing::WithParamInterface<int> {
+ public:
+  MockHedgeTest(int budget, int flags = 0)
+    : MockChannelOptsTest(2, GetParam(), false, FillOptions(&opts_, budget, flags),
+                          ARES_OPT_FLAGS | ARES_OPT_TRIES | ARES_OPT_TIMEOUTMS |
+                          ARES_OPT_HEDGE) {}
+  static struct ares_options* FillOptions(struct ares_options * opts,
+                                          int budget, int flags) {
+    memset(opts, 0, sizeof(struct ares_options));
+    opts->flags = flags;
+    opts->tries = 1;
+    opts->timeout = 500;
+    opts->hedge_percentile = 50;
+    opts->hedge_budget = budget;
+    return opts;
+  }
+  // Has the first server answer enough queries to work out when to hedge
+  void LearnHedgeDelay() {
+    DNSPacket rsp;
+    rsp.set_response().set_aa()
+      .add_question(new DNSQuestion("www.example.com", ns_t_a))
+      .add_answer(new DNSARR("www.example.com", 100, {2,3,4,5}));
+    ON_CALL(*servers_[0], OnRequest("www.example.com", ns_t_a))
+      .WillByDefault(SetReply(servers_[0].get(), &rsp));
+    ON_CALL(*servers_[1], OnRequest("www.example.com", ns_t_a))
+      .WillByDefault(SetReply(servers_[1].get(), &rsp));
+
+    unsigned char *qbuf;
+    int qlen;
+    EXPECT_EQ(ARES_SUCCESS, ares_create_query("www.example.com", ns_c_in,
+                                              ns_t_a, 0x1234, 1, &qbuf, &qlen,
+                                              0));
+    for (int i = 0; i < 16; i++) {
+      SearchResult fast;
+      ares_send(channel_, qbuf, qlen, SearchCallback, &fast);
+      Process();
+      EXPECT_TRUE(fast.done_);
+      EXPECT_EQ(ARES_SUCCESS, fast.status_);
+    }
+    ares_free_string(qbuf);
+  }
+  // Then sends a query only the second server answers
+  void QuerySlowName(SearchResult *result) {
+    LearnHedgeDelay();
+    DNSPacket slowrsp;
+    slowrsp.set_response().set_aa()
+      .add_question(new DNSQuestion("slow.example.com", ns_t_a))
+      .add_answer(new DNSARR("slow.example.com", 100, {3,4,5,6}));
+    ON_CALL(*servers_[1], OnRequest("slow.example.com", ns_t_a))
+      .WillByDefault(SetReply(servers_[1].get(), &slowrsp));
+
+    unsigned char *qbuf;
+    int qlen;
+    EXPECT_EQ(ARES_SUCCESS, ares_create_query("slow.example.com", ns_c_in,
+                                              ns_t_a, 0x1234, 1, &qbuf, &qlen,
+                                              0));
+    ares_send(channel_, qbuf, qlen, SearchCallback, result);
+    Process();
+    ares_free_string(qbuf);
+    EXPECT_TRUE(result->done_);
+    EXPECT_EQ(ARES_SUCCESS, result->status_);
+  }
+ private:
+  struct ares_options opts_;
+};
+
+class HedgeMockTest : public MockHedgeTest {
+ public:
+  HedgeMockTest() : MockHedgeTest(100) {}
+};
+
+class HedgeBudgetMockTest : public MockHedgeTest {
+ public:
+  HedgeBudgetMockTest() : MockHedgeTest(1) {}
+};
+
+class HedgeAdaptiveMockTest : public MockHedgeTest {
+ public:
+  HedgeAdaptiveMockTest() : MockHedgeTest(100, ARES_FLAG_ADAPTIVE_TIMEOUTS) {}
+};
+
+struct CountedResult {
+  int calls_ = 0;
+  SearchResult result_ = {};
+};
+
+static void CountedCallback(void *data, int status, int timeouts,
+                            unsigned char *abuf, int alen) {
+  CountedResult* counted = reinterpret_cast<CountedResult*>(data);
+  counted->calls_++;
+  SearchCallback(&counted->result_, status, timeouts, abuf, alen);
+}
+
+TEST_P(HedgeMockTest, SecondServerAnswers) {
+  // The query goes to the second server long before it times out on the
+  // first.
+  SearchResult result;
+  QuerySlowName(&result);
+  EXPECT_EQ(0, result.timeouts_);
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_LE(1UL, stats.queries_hedged);
+}
+
+TEST_P(HedgeAdaptiveMockTest, FirstServerAnswersAfterHedge) {
+  LearnHedgeDelay();
+  DNSPacket rsp0;
+  rsp0.set_response().set_aa()
+    .add_question(new DNSQuestion("slow.example.com", ns_t_a))
+    .add_answer(new DNSARR("slow.example.com", 100, {3,4,5,6}));
+  ON_CALL(*servers_[0], OnRequest("slow.example.com", ns_t_a))
+    .WillByDefault(SetReply(servers_[0].get(), &rsp0));
+  DNSPacket rsp1;
+  rsp1.set_response().set_aa()
+    .add_question(new DNSQuestion("slow.example.com", ns_t_a))
+    .add_answer(new DNSARR("slow.example.com", 100, {4,5,6,7}));
+  ON_CALL(*servers_[1], OnRequest("slow.example.com", ns_t_a))
+    .WillByDefault(SetReply(servers_[1].get(), &rsp1));
+  struct ares_server_stats before0, before1;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &before0));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 1, &before1));
+  EXPECT_EQ(0, before1.srtt);
+
+  unsigned char *qbuf;
+  int qlen;
+  EXPECT_EQ(ARES_SUCCESS, ares_create_query("slow.example.com", ns_c_in,
+                                            ns_t_a, 0x1234, 1, &qbuf, &qlen,
+                                            0));
+  CountedResult counted;
+  ares_send(channel_, qbuf, qlen, CountedCallback, &counted);
+  ares_free_string(qbuf);
+
+  // Nobody has answered by the time the query is hedged.
+  usleep(20000);
+  ares_process_fd(channel_, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(1UL, stats.queries_hedged);
+
+  // Then the first server answers, and its answer is the one taken.
+  fd_set readers;
+  FD_ZERO(&readers);
+  int nfds = 0;
+  for (int fd : servers_[0]->fds()) {
+    FD_SET(fd, &readers);
+    if (fd >= nfds) nfds = fd + 1;
+  }
+  struct timeval tv = {1, 0};
+  ASSERT_LT(0, select(nfds, &readers, nullptr, nullptr, &tv));
+  for (int fd : servers_[0]->fds()) {
+    if (FD_ISSET(fd, &readers)) servers_[0]->ProcessFD(fd);
+  }
+  while (!counted.result_.done_) {
+    fd_set writers;
+    FD_ZERO(&readers);
+    FD_ZERO(&writers);
+    nfds = ares_fds(channel_, &readers, &writers);
+    tv = {1, 0};
+    ASSERT_LT(0, select(nfds, &readers, &writers, nullptr, &tv));
+    ares_process(channel_, &readers, &writers);
+  }
+  EXPECT_EQ(ARES_SUCCESS, counted.result_.status_);
+  EXPECT_EQ("RSP QRY AA NOERROR Q:{'slow.example.com' IN A} "
+            "A:{'slow.example.com' IN A TTL=100 3.4.5.6}",
+            PacketToString(counted.result_.data_));
+
+  // The second server's answer comes too late, and is dropped.
+  Process();
+  EXPECT_EQ(1, counted.calls_);
+
+  // The answer was the first server's, and took it all the time since the
+  // query first went out.
+  struct ares_server_stats after0, after1;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 0, &after0));
+  EXPECT_EQ(ARES_SUCCESS, ares_get_server_stats(channel_, 1, &after1));
+  EXPECT_LE(before0.srtt + 20000 / 8, after0.srtt);
+  EXPECT_EQ(0, after1.srtt);
+}
+
+TEST_P(HedgeBudgetMockTest, WaitsForTimeout) {
+  // Sixteen queries haven't earned a hedge, so the query has to time out
+  // before it goes to the second server.
+  SearchResult result;
+  QuerySlowName(&result);
+  EXPECT_EQ(1, result.timeouts_);
+  struct ares_stats stats;
+  EXPECT_EQ(ARES_SUCCESS, ares_get_stats(channel_, &stats));
+  EXPECT_EQ(0UL, stats.queries_hedged);
+}
+
 
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockChannelTest,
                         ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
@@ -1127,18 +2685,69 @@ INSTANTIATE_TEST_CASE_P(AddressFamilies, MockUDPChannelTest,
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockTCPChannelTest,
                         ::testing::Values(AF_INET, AF_INET6));
 
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockTCPConnsTest,
+                        ::testing::Values(AF_INET, AF_INET6));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockAdaptiveTimeoutsTest,
+                        ::testing::Values(AF_INET, AF_INET6));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, HedgeMockTest,
+                        ::testing::Values(AF_INET, AF_INET6));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, HedgeBudgetMockTest,
+                        ::testing::Values(AF_INET, AF_INET6));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, HedgeAdaptiveMockTest,
+                        ::testing::Values(AF_INET, AF_INET6));
+
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockExtraOptsTest,
                         ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
                                           std::make_pair<int, bool>(AF_INET, true),
                                           std::make_pair<int, bool>(AF_INET6, false),
                                           std::make_pair<int, bool>(AF_INET6, true)));
 
+INSTANTIATE_TEST_CASE_P(AddressFamilies, CacheMockTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, SmallCacheMockTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, CoalesceMockTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockNoCheckRespChannelTest,
                         ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
                                           std::make_pair<int, bool>(AF_INET, true),
                                           std::make_pair<int, bool>(AF_INET6, false),
                                           std::make_pair<int, bool>(AF_INET6, true)));
 
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockKernelTimestampsTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockBatchIOTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
+INSTANTIATE_TEST_CASE_P(AddressFamilies, MockBatchIOAdaptiveTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
 INSTANTIATE_TEST_CASE_P(AddressFamilies, MockEDNSChannelTest,
                         ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
                                           std::make_pair<int, bool>(AF_INET, true),
@@ -1157,5 +2766,11 @@ INSTANTIATE_TEST_CASE_P(TransportModes, NoRotateMultiMockTest,
                                           std::make_pair<int, bool>(AF_INET6, false),
                                           std::make_pair<int, bool>(AF_INET6, true)));
 
+INSTANTIATE_TEST_CASE_P(TransportModes, AdaptiveServersMultiMockTest,
+                        ::testing::Values(std::make_pair<int, bool>(AF_INET, false),
+                                          std::make_pair<int, bool>(AF_INET, true),
+                                          std::make_pair<int, bool>(AF_INET6, false),
+                                          std::make_pair<int, bool>(AF_INET6, true)));
+
 }  // namespace test
 }  // namespace ares
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 
 #include <functional>
+#include <mutex>
 #include <sstream>
 
 #ifdef WIN32
@@ -101,6 +102,9 @@ void LibraryTest::ClearFails() {
 
 // static
 bool LibraryTest::ShouldAllocFail(size_t size) {
+  // The library may allocate from an I/O thread and its submitters at once.
+  static std::mutex lock;
+  std::lock_guard<std::mutex> guard(lock);
   bool fail = (fails_ & 0x01);
   fails_ >>= 1;
   if (size_fails_[size] > 0) {
@@ -225,29 +229,50 @@ void MockServer::ProcessFD(int fd) {
   // Activity on a data-bearing file descriptor.
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
-  byte buffer[2048];
+  byte buffer[16384];
   int len = recvfrom(fd, BYTE_CAST buffer, sizeof(buffer), 0,
                      (struct sockaddr *)&addr, &addrlen);
   byte* data = buffer;
   if (fd != udpfd_) {
-    if (len == 0) {
-      connfds_.erase(std::find(connfds_.begin(), connfds_.end(), fd));
-      sclose(fd);
-      return;
-    }
-    if (len < 2) {
-      std::cerr << "Packet too short (" << len << ")" << std::endl;
-      return;
-    }
-    int tcplen = (data[0] << 8) + data[1];
-    data += 2;
-    len -= 2;
-    if (tcplen != len) {
-      std::cerr << "Warning: TCP length " << tcplen
-                << " doesn't match remaining data length " << len << std::endl;
+    addrlen = sizeof(addr);
+    getpeername(fd, (struct sockaddr *)&addr, &addrlen);
+  }
+  if (fd == udpfd_) {
+    ProcessPacket(fd, &addr, addrlen, data, len);
+    return;
+  }
+
+  if (len == 0) {
+    if (!tcpdata_[fd].empty()) {
+      std::cerr << "Warning: connection closed with " << tcpdata_[fd].size()
+                << " bytes of an incomplete request" << std::endl;
     }
+    tcpdata_.erase(fd);
+    connfds_.erase(std::find(connfds_.begin(), connfds_.end(), fd));
+    sclose(fd);
+    return;
+  }
+  if (len < 0) {
+    std::cerr << "Error reading from fd " << fd << std::endl;
+    return;
   }
+  // Pipelined requests can arrive together, each with its own length, and
+  // a request can be split over several reads, so keep any part of one
+  // until the rest of it has arrived.
+  std::vector<byte>& pending = tcpdata_[fd];
+  pending.insert(pending.end(), data, data + len);
+  size_t pos = 0;
+  while (pending.size() - pos >= 2) {
+    size_t tcplen = (pending[pos] << 8) + pending[pos + 1];
+    if (pending.size() - pos - 2 < tcplen) break;
+    ProcessPacket(fd, &addr, addrlen, pending.data() + pos + 2, (int)tcplen);
+    pos += 2 + tcplen;
+  }
+  pending.erase(pending.begin(), pending.begin() + pos);
+}
 
+void MockServer::ProcessPacket(int fd, struct sockaddr_storage* addr,
+                               int addrlen, byte* data, int len) {
   // Assume the packet is a well-formed DNS request and extract the request
   // details.
   if (len < NS_HFIXEDSZ) {
@@ -303,7 +328,7 @@ void MockServer::ProcessFD(int fd) {
     std::cerr << "ProcessRequest(" << qid << ", '" << namestr
               << "', " << RRTypeToString(rrtype) << ")" << std::endl;
   }
-  ProcessRequest(fd, &addr, addrlen, qid, namestr, rrtype);
+  ProcessRequest(fd, addr, addrlen, qid, namestr, rrtype);
 }
 
 std::set<int> MockServer::fds() const {
@@ -315,6 +340,12 @@ std::set<int> MockServer::fds() const {
 
 void MockServer::ProcessRequest(int fd, struct sockaddr_storage* addr, int addrlen,
                                 int qid, const std::string& name, int rrtype) {
+  if (addr->ss_family == AF_INET) {
+    lastsource_ = AddressToString(&((struct sockaddr_in *)addr)->sin_addr, 4);
+  } else {
+    lastsource_ = AddressToString(&((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+  }
+
   // Before processing, let gMock know the request is happening.
   OnRequest(name, rrtype);
 
@@ -479,6 +510,24 @@ void MockChannelOptsTest::Process() {
               std::bind(&MockChannelOptsTest::ProcessFD, this, _1));
 }
 
+void MockChannelOptsTest::ProcessServers() {
+  while (true) {
+    fd_set readers;
+    FD_ZERO(&readers);
+    int nfds = 0;
+    std::set<int> serverfds = fds();
+    for (int fd : serverfds) {
+      FD_SET(fd, &readers);
+      if (fd >= nfds) nfds = fd + 1;
+    }
+    struct timeval tv = {0, 50000};  // 50ms
+    if (select(nfds, &readers, nullptr, nullptr, &tv) <= 0) return;
+    for (int fd : serverfds) {
+      if (FD_ISSET(fd, &readers)) ProcessFD(fd);
+    }
+  }
+}
+
 std::ostream& operator<<(std::ostream& os, const HostResult& result) {
   os << '{';
   if (result.done_) {
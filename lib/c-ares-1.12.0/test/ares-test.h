@@ -148,7 +148,12 @@ class MockServer {
   int udpport() const { return udpport_; }
   int tcpport() const { return tcpport_; }
 
+  // Address the last request came from
+  std::string lastsource() const { return lastsource_; }
+
  private:
+  void ProcessPacket(int fd, struct sockaddr_storage* addr, int addrlen,
+                     byte* data, int len);
   void ProcessRequest(int fd, struct sockaddr_storage* addr, int addrlen,
                       int qid, const std::string& name, int rrtype);
 
@@ -157,8 +162,11 @@ class MockServer {
   int udpfd_;
   int tcpfd_;
   std::set<int> connfds_;
+  // What has arrived on each TCP connection of the next request(s).
+  std::map<int, std::vector<byte>> tcpdata_;
   std::vector<byte> reply_;
   int qid_;
+  std::string lastsource_;
 };
 
 // Test fixture that uses a mock DNS server.
@@ -169,6 +177,9 @@ class MockChannelOptsTest : public LibraryTest {
 
   // Process all pending work on ares-owned and mock-server-owned file descriptors.
   void Process();
+  // Let the mock servers handle what has been sent to them, without
+  // processing anything on the channel's side.
+  void ProcessServers();
 
  protected:
   // NiceMockServer doesn't complain about uninteresting calls.
@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Tests of client3 against stand-in nameservers.
+
+The stand-ins are small UDP nameservers, each on its own 127.0.0.x address
+and all on one unprivileged port, so client3 is pointed at the root one with
+-i 127.0.0.1:port and walks down from there on that port. Linux routes all of
+127/8 to the loopback interface; elsewhere 127.0.0.2 to 127.0.0.9 have to be
+added as aliases of it first.
+
+    CLIENT3=./client3 python3 test/test_client3.py
+
+CLIENT3 defaults to the client3 at the top of the repository, and
+STANDIN_PORT to 5399.
+"""
+
+import os
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import unittest
+
+PORT = int(os.environ.get('STANDIN_PORT', '5399'))
+CLIENT3 = os.environ.get('CLIENT3', os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), '..', 'client3'))
+
+T_A = 1
+T_NS = 2
+
+
+def encode_name(name):
+    out = b''
+    for label in name.split('.'):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def decode_question(msg):
+    """The id, flags, name and type of a query."""
+    qid, flags = struct.unpack('!HH', msg[:4])
+    labels = []
+    i = 12
+    while msg[i]:
+        labels.append(msg[i + 1:i + 1 + msg[i]].decode().lower())
+        i += 1 + msg[i]
+    qtype, = struct.unpack('!H', msg[i + 1:i + 3])
+    return qid, flags, '.'.join(labels), qtype, msg[12:i + 5]
+
+
+def encode_rr(name, rtype, value):
+    rdata = socket.inet_aton(value) if rtype == T_A else encode_name(value)
+    return encode_name(name) + struct.pack('!HHIH', rtype, 1, 300, len(rdata)) + rdata
+
+
+def in_zone(name, zone):
+    return zone == '' or name == zone or name.endswith('.' + zone)
+
+
+class StandIn:
+    """A nameserver answering from its records, or referring anything below
+    one of its delegations, and remembering who asked it what.
+
+    records: (name, type, value) tuples
+    delegations: child zone -> [(nameserver, glue address or None)]
+    """
+
+    def __init__(self, addr, records=(), delegations=None):
+        self.addr = addr
+        self.records = list(records)
+        self.delegations = delegations or {}
+        self.queries = []       # (source address, name, type)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind((addr, PORT))
+        self.sock.settimeout(0.1)
+        self.stopping = False
+        self.thread = threading.Thread(target=self.serve, daemon=True)
+        self.thread.start()
+
+    def serve(self):
+        while not self.stopping:
+            try:
+                msg, source = self.sock.recvfrom(4096)
+            except socket.timeout:
+                continue
+            qid, flags, name, qtype, question = decode_question(msg)
+            self.queries.append((source[0], name, qtype))
+            self.sock.sendto(self.respond(qid, flags, name, qtype, question), source)
+
+    def respond(self, qid, flags, name, qtype, question):
+        rd = flags & 0x0100
+        for child, servers in self.delegations.items():
+            if in_zone(name, child):
+                authority = [encode_rr(child, T_NS, ns) for ns, _ in servers]
+                additional = [encode_rr(ns, T_A, glue) for ns, glue in servers if glue]
+                return (struct.pack('!HHHHHH', qid, 0x8000 | rd, 1, 0,
+                                    len(authority), len(additional)) +
+                        question + b''.join(authority) + b''.join(additional))
+        answers = [encode_rr(n, t, v) for n, t, v in self.records
+                   if n == name and t == qtype]
+        return (struct.pack('!HHHHHH', qid, 0x8400 | rd, 1, len(answers), 0, 0) +
+                question + b''.join(answers))
+
+    def asked(self, name, qtype=T_A):
+        """The sources that asked for name"""
+        return [source for source, n, t in self.queries if n == name and t == qtype]
+
+    def close(self):
+        self.stopping = True
+        self.thread.join()
+        self.sock.close()
+
+
+class Client3Test(unittest.TestCase):
+    """A root refers test. to its TLD server, which refers example.test to
+    a nameserver inside it with glue, glueless.test to that same nameserver
+    without glue, and poisoned.test to it with glue pointing elsewhere,
+    which a resolver mustn't believe as it's outside poisoned.test."""
+
+    def setUp(self):
+        self.standins = [
+            StandIn('127.0.0.1', delegations={
+                'test': [('ns1.nic.test', '127.0.0.2')]}),
+            StandIn('127.0.0.2', records=[
+                ('test', T_NS, 'ns1.nic.test'),
+                ('ns1.nic.test', T_A, '127.0.0.2')], delegations={
+                'example.test': [('ns1.example.test', '127.0.0.3')],
+                'glueless.test': [('ns.example.test', None)],
+                'poisoned.test': [('ns.example.test', '127.0.0.9')]}),
+            StandIn('127.0.0.3', records=[
+                ('example.test', T_NS, 'ns1.example.test'),
+                ('ns1.example.test', T_A, '127.0.0.3'),
+                ('ns.example.test', T_A, '127.0.0.4')]),
+            StandIn('127.0.0.4', records=[
+                ('glueless.test', T_NS, 'ns.example.test'),
+                ('poisoned.test', T_NS, 'ns.example.test')]),
+            StandIn('127.0.0.9'),
+        ]
+        self.by_addr = {s.addr: s for s in self.standins}
+        self.dir = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        for standin in self.standins:
+            standin.close()
+        self.dir.cleanup()
+
+    def run_client3(self, domains, *opts, packets=4):
+        """The [info] and [source] rows client3 logs for domains"""
+        input_file = os.path.join(self.dir.name, 'in.txt')
+        log_file = os.path.join(self.dir.name, 'out.log')
+        with open(input_file, 'w') as f:
+            f.write(''.join(d + '\n' for d in domains))
+        subprocess.run([CLIENT3, *opts, '-i', '127.0.0.1:%d' % PORT,
+                        str(packets), input_file, log_file],
+                       stdout=subprocess.DEVNULL, timeout=60, check=True)
+        info, source = {}, {}
+        with open(log_file) as f:
+            for line in f:
+                fields = line.split()
+                if fields[0] == '[info]':
+                    info.setdefault(fields[1], []).append(fields[2:])
+                elif fields[0] == '[source]':
+                    source.setdefault(fields[1], []).append(fields[2:])
+        return info, source
+
+    def test_walk(self):
+        info, _ = self.run_client3(['example.test', 'glueless.test', 'poisoned.test'])
+        # nameserver, address, probes sent and answered
+        self.assertEqual([r[:4] for r in info['example.test']],
+                         [['ns1.example.test', '127.0.0.3', '4', '4']])
+        self.assertEqual([r[:4] for r in info['glueless.test']],
+                         [['ns.example.test', '127.0.0.4', '4', '4']])
+        self.assertEqual([r[:4] for r in info['poisoned.test']],
+                         [['ns.example.test', '127.0.0.4', '4', '4']])
+        self.assertEqual(self.by_addr['127.0.0.9'].queries, [])
+        # the walks ended at the zones' own servers, which had the probes
+        self.assertEqual(len(self.by_addr['127.0.0.3'].asked('example.test')), 4)
+        self.assertEqual(len(self.by_addr['127.0.0.4'].asked('glueless.test')), 4)
+
+    def test_sources_per_query(self):
+        _, source = self.run_client3(['example.test'], '-s', '127.0.0.5,127.0.0.6')
+        self.assertEqual(self.by_addr['127.0.0.3'].asked('example.test'),
+                         ['127.0.0.5', '127.0.0.6'] * 2)
+        self.assertEqual([r[:3] for r in source['example.test']],
+                         [['127.0.0.3', '127.0.0.5', '2'],
+                          ['127.0.0.3', '127.0.0.6', '2']])
+
+    def test_sources_per_target(self):
+        _, source = self.run_client3(['example.test', 'glueless.test', 'poisoned.test'],
+                                     '-s', '127.0.0.5,127.0.0.6', '-r')
+        self.assertEqual(self.by_addr['127.0.0.3'].asked('example.test'),
+                         ['127.0.0.5'] * 4)
+        self.assertEqual(self.by_addr['127.0.0.4'].asked('glueless.test'),
+                         ['127.0.0.6'] * 4)
+        self.assertEqual(self.by_addr['127.0.0.4'].asked('poisoned.test'),
+                         ['127.0.0.5'] * 4)
+        self.assertEqual([r[:3] for r in source['glueless.test']],
+                         [['127.0.0.4', '127.0.0.6', '4']])
+
+
+if __name__ == '__main__':
+    unittest.main()